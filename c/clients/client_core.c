@@ -1,4 +1,5 @@
 #include "client_core.h"
+#include "wire.h" // Binary framing
 #include <stdio.h>  // For printf in debug/status messages, perror
 #include <stdlib.h> // For malloc, free (if we were to dynamically allocate more)
 #include <string.h> // For strcmp, strncpy, strlen, etc.
@@ -9,10 +10,30 @@ static char g_server_ip[40]; // Max IP string length (IPv6)
 static int g_server_port = 0;
 static int g_is_connected = 0;
 static int g_login_phase_complete = 0; // To track if username handshake is done
+static unsigned long long g_history_cursor = 0; // Oldest record paged in
+static unsigned long long g_last_seq = 0; // Newest record seen; kept across
+                                          // reconnects for RESUME
+static int g_want_binary = 0; // Ask for binary framing at login
+static int g_binary = 0;      // Frames in use on this connection
+static char g_pending_username[CORE_USERNAME_MAX_LEN]; // Sent on BINARY_OK
+
+// Ids the server gave for names looked up on this connection
+#define CORE_ID_CACHE 64
+typedef struct {
+  char name[CORE_USERNAME_MAX_LEN];
+  unsigned id;
+} core_id_t;
+static core_id_t g_user_ids[CORE_ID_CACHE];
+static int g_num_user_ids = 0;
+static core_id_t g_group_ids[CORE_ID_CACHE];
+static int g_num_group_ids = 0;
 
 // Buffers for sending/receiving
 static char g_send_buffer[CORE_BUFFER_SIZE];
+static char g_line_buffer[WIRE_MAX_PAYLOAD + 2]; // Framed PRIVMSG/GROUPMSG
 static char g_recv_buffer[CORE_BUFFER_SIZE];
+static unsigned char g_frame_out[WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD];
+static unsigned char g_frame_in[WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD + 2];
 
 // Callbacks
 static client_core_on_status_change_cb g_on_status_cb = NULL;
@@ -74,6 +95,67 @@ static int core_send_full(socket_t sock, const char *buf, int len) {
   return total_sent;
 }
 
+// Helper function to receive exactly `len` bytes
+// Returns len, 0 on EOF, -1 on error
+static int core_recv_full(socket_t sock, char *buf, int len) {
+  int total_received = 0;
+  while (total_received < len) {
+    int n = recv(sock, buf + total_received, len - total_received, 0);
+    if (n == 0) {
+      return 0;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    total_received += n;
+  }
+  return total_received;
+}
+
+static int core_send_frame(unsigned char op, unsigned id, const char *payload,
+                           size_t len) {
+  if (len > WIRE_MAX_PAYLOAD) {
+    return -1;
+  }
+  size_t n = wire_encode_frame(g_frame_out, op, id, 0, payload, len);
+  return core_send_full(g_client_socket, (const char *)g_frame_out, (int)n);
+}
+
+// Sends one text-protocol line (ending with a newline), framed if the
+// binary protocol is in use
+static int core_send_line(const char *line) {
+  size_t len = strlen(line);
+  if (!g_binary) {
+    return core_send_full(g_client_socket, line, (int)len);
+  }
+  if (len > 0 && line[len - 1] == '\n') {
+    len--;
+  }
+  return core_send_frame(WIRE_OP_LINE, WIRE_NO_ID, line, len);
+}
+
+static unsigned core_id_find(const core_id_t *ids, int count,
+                             const char *name) {
+  for (int k = 0; k < count; k++) {
+    if (strcmp(ids[k].name, name) == 0) {
+      return ids[k].id;
+    }
+  }
+  return WIRE_NO_ID;
+}
+
+static void core_id_add(core_id_t *ids, int *count, const char *name,
+                        unsigned id) {
+  if (id == WIRE_NO_ID || *count == CORE_ID_CACHE ||
+      strlen(name) >= CORE_USERNAME_MAX_LEN ||
+      core_id_find(ids, *count, name) != WIRE_NO_ID) {
+    return;
+  }
+  strcpy(ids[*count].name, name);
+  ids[*count].id = id;
+  (*count)++;
+}
+
 static void invoke_status_cb(const char *message) {
   if (g_on_status_cb) {
     g_on_status_cb(message);
@@ -82,6 +164,33 @@ static void invoke_status_cb(const char *message) {
   }
 }
 
+// A frame can't carry more than WIRE_MAX_PAYLOAD bytes: `message` on its
+// own, or "<verb> <name> <message>" if `verb` is set. Callers check first
+// so an oversize message is refused without being mistaken for a send
+// failure, which would drop the connection.
+static int core_message_fits(const char *verb, const char *name,
+                             const char *message) {
+  size_t len = strlen(message);
+  if (verb != NULL) {
+    len += strlen(verb) + strlen(name) + 2;
+  }
+  if (g_binary && len > WIRE_MAX_PAYLOAD) {
+    invoke_status_cb("Message too long to send.");
+    return 0;
+  }
+  return 1;
+}
+
+// Sends "<verb> <name> <message>" as a text-protocol line. Framed, it may
+// be as long as a frame; plain text is cut to CORE_BUFFER_SIZE like any
+// other line.
+static int core_send_addressed(const char *verb, const char *name,
+                               const char *message) {
+  size_t size = g_binary ? sizeof(g_line_buffer) : CORE_BUFFER_SIZE;
+  snprintf(g_line_buffer, size, "%s %s %s\n", verb, name, message);
+  return core_send_line(g_line_buffer);
+}
+
 static void invoke_message_cb(const char *message) {
   if (g_on_message_cb) {
     g_on_message_cb(message);
@@ -110,6 +219,7 @@ int client_core_init(client_core_on_status_change_cb on_status_cb,
   g_client_socket = INVALID_SOCKET;
   g_is_connected = 0;
   g_login_phase_complete = 0;
+  g_last_seq = 0;
   invoke_status_cb("Client core initialized.");
   return 0;
 }
@@ -145,14 +255,20 @@ int client_core_connect(const char *ip, int port) {
     return -1;
   }
 
+  // Each command is sent whole; Nagle would only delay one that follows
+  // another closely (e.g. a lookup and the DM it is for)
+  if (socket_set_nodelay(g_client_socket) < 0) {
+    print_socket_error("client_core_connect: TCP_NODELAY failed");
+  }
+
   g_is_connected = 1;
   g_login_phase_complete = 0; // Reset login phase
   char status_msg[100];
   snprintf(status_msg, sizeof(status_msg), "Connected to %s:%d.", ip, port);
   invoke_status_cb(status_msg);
 
-  // After connecting, the server should send REQ_USERNAME or SERVER_FULL
-  // This will be handled by client_core_process_incoming()
+  // After connecting, the server should send REQ_USERNAME, SERVER_FULL or
+  // RETRY_AFTER. This will be handled by client_core_process_incoming()
   return 0;
 }
 
@@ -168,7 +284,17 @@ int client_core_send_username(const char *username) {
     return -1;
   }
 
-  snprintf(g_send_buffer, sizeof(g_send_buffer), "%s\n", username);
+  // RESUME first: numbered lines from now on, and only what was missed
+  // since the last one seen (recent history on a first connect). With
+  // BINARY the username follows as a frame once the server agrees.
+  if (g_want_binary) {
+    strcpy(g_pending_username, username);
+    snprintf(g_send_buffer, sizeof(g_send_buffer), "RESUME %llu\nBINARY\n",
+             g_last_seq);
+  } else {
+    snprintf(g_send_buffer, sizeof(g_send_buffer), "RESUME %llu\n%s\n",
+             g_last_seq, username);
+  }
   if (core_send_full(g_client_socket, g_send_buffer, strlen(g_send_buffer)) <=
       0) {
     print_socket_error("client_core_send_username: send_full failed");
@@ -188,11 +314,20 @@ int client_core_send_global_message(const char *message) {
   }
   if (message == NULL || strlen(message) == 0)
     return 0; // Don't send empty
+  if (!core_message_fits(NULL, NULL, message)) {
+    return -1;
+  }
 
-  // Assume message already has newline if needed by protocol, or add it
-  snprintf(g_send_buffer, sizeof(g_send_buffer), "%s\n", message);
-  if (core_send_full(g_client_socket, g_send_buffer, strlen(g_send_buffer)) <=
-      0) {
+  int sent;
+  if (g_binary) {
+    sent = core_send_frame(WIRE_OP_SAY, WIRE_NO_ID, message, strlen(message));
+  } else {
+    // Assume message already has newline if needed by protocol, or add it
+    snprintf(g_send_buffer, sizeof(g_send_buffer), "%s\n", message);
+    sent = core_send_full(g_client_socket, g_send_buffer,
+                          strlen(g_send_buffer));
+  }
+  if (sent <= 0) {
     print_socket_error("client_core_send_global_message: send_full failed");
     invoke_status_cb("Failed to send global message.");
     client_core_disconnect();
@@ -211,10 +346,26 @@ int client_core_send_dm(const char *recipient, const char *message) {
     return -1; // Invalid args
   }
 
-  snprintf(g_send_buffer, sizeof(g_send_buffer), "PRIVMSG %s %s\n", recipient,
-           message);
-  if (core_send_full(g_client_socket, g_send_buffer, strlen(g_send_buffer)) <=
-      0) {
+  // By id once known; the first DM to a name goes as text and asks for it
+  unsigned id = g_binary ? core_id_find(g_user_ids, g_num_user_ids, recipient)
+                         : WIRE_NO_ID;
+  if (!core_message_fits(id == WIRE_NO_ID ? "PRIVMSG" : NULL, recipient,
+                         message)) {
+    return -1;
+  }
+  int sent = 1;
+  if (id != WIRE_NO_ID) {
+    sent = core_send_frame(WIRE_OP_DM, id, message, strlen(message));
+  } else {
+    if (g_binary) {
+      sent = core_send_frame(WIRE_OP_LOOKUP_USER, WIRE_NO_ID, recipient,
+                             strlen(recipient));
+    }
+    if (sent > 0) {
+      sent = core_send_addressed("PRIVMSG", recipient, message);
+    }
+  }
+  if (sent <= 0) {
     print_socket_error("client_core_send_dm: send_full failed");
     invoke_status_cb("Failed to send direct message.");
     client_core_disconnect();
@@ -234,10 +385,26 @@ int client_core_send_group_message(const char *groupname, const char *message) {
     return -1; // Invalid args
   }
 
-  snprintf(g_send_buffer, sizeof(g_send_buffer), "GROUPMSG %s %s\n", groupname,
-           message);
-  if (core_send_full(g_client_socket, g_send_buffer, strlen(g_send_buffer)) <=
-      0) {
+  unsigned id = g_binary
+                    ? core_id_find(g_group_ids, g_num_group_ids, groupname)
+                    : WIRE_NO_ID;
+  if (!core_message_fits(id == WIRE_NO_ID ? "GROUPMSG" : NULL, groupname,
+                         message)) {
+    return -1;
+  }
+  int sent = 1;
+  if (id != WIRE_NO_ID) {
+    sent = core_send_frame(WIRE_OP_GROUPMSG, id, message, strlen(message));
+  } else {
+    if (g_binary) {
+      sent = core_send_frame(WIRE_OP_LOOKUP_GROUP, WIRE_NO_ID, groupname,
+                             strlen(groupname));
+    }
+    if (sent > 0) {
+      sent = core_send_addressed("GROUPMSG", groupname, message);
+    }
+  }
+  if (sent <= 0) {
     print_socket_error("client_core_send_group_message: send_full failed");
     invoke_status_cb("Failed to send group message.");
     client_core_disconnect();
@@ -246,10 +413,189 @@ int client_core_send_group_message(const char *groupname, const char *message) {
   return 0;
 }
 
+// Sends one HISTORY command line built by the callers below
+static int core_send_history_command(const char *what) {
+  if (!g_is_connected || !g_login_phase_complete) {
+    invoke_status_cb("Cannot request history: Not connected or not logged in.");
+    return -1;
+  }
+  if (core_send_line(g_send_buffer) <= 0) {
+    print_socket_error(what);
+    invoke_status_cb("Failed to send history request.");
+    client_core_disconnect();
+    return -1;
+  }
+  return 0;
+}
+
+int client_core_request_history(unsigned long long before_seq, int count) {
+  if (count <= 0) {
+    return -1; // Invalid args
+  }
+  snprintf(g_send_buffer, sizeof(g_send_buffer), "HISTORY %llu %d\n",
+           before_seq, count);
+  return core_send_history_command(
+      "client_core_request_history: send_full failed");
+}
+
+int client_core_request_history_before(const char *local_time, int count) {
+  if (local_time == NULL || strlen(local_time) == 0 ||
+      strchr(local_time, ' ') != NULL || count <= 0) {
+    return -1; // Invalid args; use 'T' between date and time
+  }
+  snprintf(g_send_buffer, sizeof(g_send_buffer), "HISTORY %s %d\n",
+           local_time, count);
+  return core_send_history_command(
+      "client_core_request_history_before: send_full failed");
+}
+
+int client_core_cancel_history() {
+  snprintf(g_send_buffer, sizeof(g_send_buffer), "HISTORY CANCEL\n");
+  return core_send_history_command(
+      "client_core_cancel_history: send_full failed");
+}
+
+unsigned long long client_core_history_cursor() { return g_history_cursor; }
+
+unsigned long long client_core_last_seq() { return g_last_seq; }
+
+void client_core_set_last_seq(unsigned long long seq) { g_last_seq = seq; }
+
+void client_core_use_binary(int enable) { g_want_binary = enable; }
+
+// Drops the "#<seq> " tag in front of a logged line, noting the number.
+// Replayed history can be older than what was already seen.
+static void core_strip_seq_tag(char *line) {
+  if (line[0] != '#') {
+    return;
+  }
+  char *end;
+  unsigned long long seq = strtoull(line + 1, &end, 10);
+  if (end == line + 1 || *end != ' ') {
+    return;
+  }
+  if (seq > g_last_seq) {
+    g_last_seq = seq;
+  }
+  memmove(line, end + 1, strlen(end + 1) + 1);
+}
+
+// Handles one line from the server (null-terminated, including the
+// newline) with any record number already taken off. Returns -1 if the
+// server ended the session.
+static int core_handle_line(char *line) {
+  char temp_line[CORE_BUFFER_SIZE]; // For manipulation without affecting
+                                    // original
+  strncpy(temp_line, line, sizeof(temp_line) - 1);
+  temp_line[sizeof(temp_line) - 1] = '\0';
+  temp_line[strcspn(temp_line, "\r\n")] = 0; // Cleaned version for strcmp
+
+  if (!g_login_phase_complete) { // Handling initial server responses
+    if (strcmp(temp_line, "REQ_USERNAME") == 0) {
+      invoke_username_req_cb();
+    } else if (strcmp(temp_line, "BINARY_OK") == 0 && g_want_binary &&
+               !g_binary) {
+      // Frames from here on, starting with the username
+      g_binary = 1;
+      if (core_send_frame(WIRE_OP_LOGIN, WIRE_NO_ID, g_pending_username,
+                          strlen(g_pending_username)) <= 0) {
+        print_socket_error("core_handle_line: send_frame failed");
+        invoke_status_cb("Failed to send username.");
+        client_core_disconnect();
+        return -1;
+      }
+    } else if (strcmp(temp_line, "SERVER_FULL") == 0) {
+      invoke_message_cb(line); // Pass full message
+      client_core_disconnect();
+      return -1; // Indicate connection ended by server
+    } else if (strncmp(temp_line, "RETRY_AFTER ", 12) == 0) {
+      // Turned away by admission control, with a hint when to come back
+      char status_msg[100];
+      snprintf(status_msg, sizeof(status_msg),
+               "Server busy; try again in %d s.", atoi(temp_line + 12));
+      invoke_status_cb(status_msg);
+      client_core_disconnect();
+      return -1; // Indicate connection ended by server
+    } else if (strncmp(temp_line, "Welcome, ", 9) == 0) {
+      g_login_phase_complete = 1;
+      invoke_message_cb(line); // Pass full welcome message
+    } else if (strncmp(temp_line, "BAD_USERNAME", 12) == 0 ||
+               strncmp(temp_line, "NOT_ALLOWED", 11) == 0) {
+      invoke_message_cb(line); // Pass full error message
+      client_core_disconnect();
+      return -1; // Indicate connection ended by server
+    } else {
+      // Potentially history or other messages before login fully complete
+      invoke_message_cb(line);
+    }
+  } else { // Login phase complete, regular messages
+    unsigned long long first, last;
+    if (sscanf(temp_line, "--- History #%llu-#%llu ---", &first, &last) ==
+        2) {
+      g_history_cursor = first; // Next page ends where this one starts
+    }
+    invoke_message_cb(line);
+  }
+  return 0;
+}
+
+// Reads and handles one frame once the binary protocol is in use. Lines
+// carry their record number in the header rather than a "#<seq> " tag.
+static int core_process_frame() {
+  char *payload = (char *)g_frame_in + WIRE_HEADER_SIZE;
+  wire_header_t h = {0, 0, 0, 0};
+  int len =
+      core_recv_full(g_client_socket, (char *)g_frame_in, WIRE_HEADER_SIZE);
+  if (len > 0) {
+    wire_decode_header(g_frame_in, &h);
+    if (h.len > WIRE_MAX_PAYLOAD) {
+      invoke_status_cb("Disconnected: Bad frame from server.");
+      client_core_disconnect();
+      return -1;
+    }
+    if (h.len > 0) {
+      len = core_recv_full(g_client_socket, payload, (int)h.len);
+    }
+  }
+  if (len == 0) { // Server closed connection
+    invoke_status_cb("Disconnected: Server closed connection.");
+    client_core_disconnect();
+    return -1;
+  } else if (len < 0) { // Error
+    print_socket_error("client_core_process_incoming: recv_full error");
+    invoke_status_cb("Disconnected: Network error.");
+    client_core_disconnect();
+    return -1;
+  }
+  payload[h.len] = '\0';
+
+  switch (h.op) {
+  case WIRE_OP_LINE:
+    if (h.seq > g_last_seq) {
+      g_last_seq = h.seq;
+    }
+    payload[h.len] = '\n';
+    payload[h.len + 1] = '\0';
+    return core_handle_line(payload);
+  case WIRE_OP_USER_ID:
+    core_id_add(g_user_ids, &g_num_user_ids, payload, h.id);
+    break;
+  case WIRE_OP_GROUP_ID:
+    core_id_add(g_group_ids, &g_num_group_ids, payload, h.id);
+    break;
+  default:
+    break; // Ops from newer servers
+  }
+  return 0;
+}
+
 int client_core_process_incoming() {
   if (!g_is_connected) {
     return 0; // Nothing to process if not connected
   }
+  if (g_binary) {
+    return core_process_frame();
+  }
 
   // For a non-blocking UI, we'd ideally use select() here too, or make the
   // socket non-blocking. For simplicity in this step, core_recv_line will block
@@ -261,34 +607,8 @@ int client_core_process_incoming() {
 
   if (len > 0) {
     // g_recv_buffer is null-terminated and includes the newline.
-    char temp_line[CORE_BUFFER_SIZE]; // For manipulation without affecting
-                                      // original
-    strncpy(temp_line, g_recv_buffer, sizeof(temp_line) - 1);
-    temp_line[sizeof(temp_line) - 1] = '\0';
-    temp_line[strcspn(temp_line, "\r\n")] = 0; // Cleaned version for strcmp
-
-    if (!g_login_phase_complete) { // Handling initial server responses
-      if (strcmp(temp_line, "REQ_USERNAME") == 0) {
-        invoke_username_req_cb();
-      } else if (strcmp(temp_line, "SERVER_FULL") == 0) {
-        invoke_message_cb(g_recv_buffer); // Pass full message
-        client_core_disconnect();
-        return -1; // Indicate connection ended by server
-      } else if (strncmp(temp_line, "Welcome, ", 9) == 0) {
-        g_login_phase_complete = 1;
-        invoke_message_cb(g_recv_buffer); // Pass full welcome message
-      } else if (strncmp(temp_line, "BAD_USERNAME", 12) == 0 ||
-                 strncmp(temp_line, "NOT_ALLOWED", 11) == 0) {
-        invoke_message_cb(g_recv_buffer); // Pass full error message
-        client_core_disconnect();
-        return -1; // Indicate connection ended by server
-      } else {
-        // Potentially history or other messages before login fully complete
-        invoke_message_cb(g_recv_buffer);
-      }
-    } else { // Login phase complete, regular messages
-      invoke_message_cb(g_recv_buffer);
-    }
+    core_strip_seq_tag(g_recv_buffer);
+    return core_handle_line(g_recv_buffer);
   } else if (len == 0) { // Server closed connection
     invoke_status_cb("Disconnected: Server closed connection.");
     client_core_disconnect();
@@ -313,6 +633,10 @@ void client_core_disconnect() {
   }
   g_is_connected = 0;
   g_login_phase_complete = 0;
+  g_history_cursor = 0;
+  g_binary = 0; // Ids are only good for one connection
+  g_num_user_ids = 0;
+  g_num_group_ids = 0;
   // Don't call invoke_status_cb("Disconnected.") here, as it might be called
   // due to an error where a more specific status was already given.
   // The caller of disconnect or process_incoming should handle final status.
@@ -42,6 +42,34 @@ int client_core_send_dm(const char *recipient, const char *message);
 // Sends a group message.
 int client_core_send_group_message(const char *groupname, const char *message);
 
+// Requests up to `count` older chat lines, those logged before record
+// number `before_seq` (0 = the newest). They arrive through on_message_cb,
+// between "--- History #A-#B ---" and "--- End of History before #N ---";
+// others' DMs and other groups' messages in that range are left out.
+int client_core_request_history(unsigned long long before_seq, int count);
+
+// Same, for lines logged before a local time "YYYY-MM-DD[THH:MM[:SS]]".
+int client_core_request_history_before(const char *local_time, int count);
+
+// Stops a history request that is still streaming.
+int client_core_cancel_history();
+
+// First record of the latest history page (0 if none yet): pass it as
+// before_seq to page further back.
+unsigned long long client_core_history_cursor();
+
+// Newest chat record number received (0 if none). The next connect sends
+// it with the username, so the server replays only what was missed in
+// between. Set it to carry the position over from a saved session.
+unsigned long long client_core_last_seq();
+void client_core_set_last_seq(unsigned long long seq);
+
+// Asks for the binary protocol at the next login: length-prefixed frames,
+// with users and groups addressed by server-assigned ids after the first
+// message to each. Callbacks see the same lines either way, but messages
+// may then contain newlines. Call before client_core_send_username().
+void client_core_use_binary(int enable);
+
 // Call this function periodically (e.g., in a loop or driven by UI events)
 // to process any incoming messages from the server.
 // It will trigger the registered callbacks when messages are received.
@@ -0,0 +1,40 @@
+#ifndef CMDPARSE_H
+#define CMDPARSE_H
+
+// Zero-copy tokenizing of protocol lines. Tokens are (pointer, length)
+// views into the received line: nothing is copied and nothing needs to be
+// NUL-terminated, so a verb can be looked up and its arguments handed on
+// without touching the rest of the line.
+
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+  const char *ptr;
+  size_t len;
+} cmd_token_t;
+
+// View of `line` without its line ending
+static inline cmd_token_t cmd_line(const char *line) {
+  cmd_token_t t = {line, strcspn(line, "\r\n")};
+  return t;
+}
+
+// Splits the next space-delimited token off the front of `rest`, which is
+// left pointing just past the single space that ended it (or empty at the
+// end of the line). The token is empty if `rest` starts with a space.
+static inline cmd_token_t cmd_next_token(cmd_token_t *rest) {
+  const char *space = (const char *)memchr(rest->ptr, ' ', rest->len);
+  size_t len = space != NULL ? (size_t)(space - rest->ptr) : rest->len;
+  cmd_token_t t = {rest->ptr, len};
+  size_t skip = space != NULL ? len + 1 : len;
+  rest->ptr += skip;
+  rest->len -= skip;
+  return t;
+}
+
+static inline int cmd_token_eq(cmd_token_t t, const char *s) {
+  return strncmp(t.ptr, s, t.len) == 0 && s[t.len] == '\0';
+}
+
+#endif // CMDPARSE_H
@@ -0,0 +1,310 @@
+#ifndef DMSTORE_H
+#define DMSTORE_H
+
+// Store-and-forward mailboxes for direct messages to offline users: one
+// append-only file per recipient ("<dir>/<user>.txt"), one "<time> <text>"
+// line per message. Storing a message is a single append and delivery is
+// a rename, a read and an unlink, so neither depends on how many other
+// mailboxes exist. Delivery is two steps: dmstore_get() moves the
+// messages aside ("<user>.txt.out") and reads them, and dmstore_drop()
+// deletes them once they are on their way, so a failed delivery leaves
+// them for next time while new messages go to a fresh mailbox. Each
+// mailbox holds at most `max_bytes`; messages older than `max_age` seconds
+// are dropped when it is read, or compacted to make room.
+//
+// Not thread-safe: callers keep all access on one thread or lock.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <direct.h>  // _mkdir()
+#include <windows.h> // MoveFileExA()
+#else
+#include <sys/stat.h> // mkdir()
+#endif
+
+#define DMSTORE_PATH_MAX 512
+#define DMSTORE_STAMP_DIGITS 20 // Room for "<time> " before each message
+
+typedef struct {
+  char dir[DMSTORE_PATH_MAX];
+  long max_bytes;  // Per mailbox
+  int64_t max_age; // Seconds; 0 = messages never expire
+} dmstore_t;
+
+// Opens (creating if needed) the store in `dir`, which must not end with
+// a slash. Returns 0 on success, -1 if the name is too long.
+static inline int dmstore_open(dmstore_t *store, const char *dir,
+                               long max_bytes, int64_t max_age) {
+  if ((size_t)snprintf(store->dir, sizeof(store->dir), "%s", dir) >=
+      sizeof(store->dir)) {
+    return -1;
+  }
+  store->max_bytes = max_bytes;
+  store->max_age = max_age;
+#ifdef _WIN32
+  _mkdir(store->dir);
+#else
+  mkdir(store->dir, 0755);
+#endif
+  return 0;
+}
+
+// Mailbox file of `user`. Returns -1 for names that are not safe as file
+// names, so they never get a mailbox.
+static inline int dmstore_path(const dmstore_t *store, const char *user,
+                               char *buf, size_t cap) {
+  if (user[0] == '\0' || user[0] == '.' || strpbrk(user, "/\\:") != NULL) {
+    return -1;
+  }
+  int n = snprintf(buf, cap, "%s/%s.txt", store->dir, user);
+  return n > 0 && (size_t)n < cap ? 0 : -1;
+}
+
+// Next "<time> <text>\n" record in [p, end): sets `when`, `text` and `len`
+// (excluding the newline) and returns the position after it, or NULL at
+// the end.
+static inline const char *dmstore_next(const char *p, const char *end,
+                                       int64_t *when, const char **text,
+                                       size_t *len) {
+  while (p < end) {
+    const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+    const char *stop = nl != NULL ? nl : end;
+    char *rest;
+    long long t = strtoll(p, &rest, 10);
+    if (rest > p && rest < stop && *rest == ' ') {
+      *when = (int64_t)t;
+      *text = rest + 1;
+      *len = (size_t)(stop - (rest + 1));
+      return nl != NULL ? nl + 1 : end;
+    }
+    p = nl != NULL ? nl + 1 : end; // Skip a damaged line
+  }
+  return NULL;
+}
+
+// Reads the mailbox at `path` into a malloc()ed buffer, keeping only
+// records newer than `max_age`. `*size` (if not NULL) gets the size of the
+// file. Returns the number kept (0 with *buf NULL if the mailbox does not
+// exist), or -1 on error.
+static inline long dmstore_read(const dmstore_t *store, const char *path,
+                                int64_t now, char **buf, size_t *len,
+                                long *size_out) {
+  *buf = NULL;
+  *len = 0;
+  if (size_out != NULL) {
+    *size_out = 0;
+  }
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+  long size = -1;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    size = ftell(f);
+  }
+  char *data = size >= 0 ? (char *)malloc((size_t)size + 1) : NULL;
+  if (data == NULL || fseek(f, 0, SEEK_SET) != 0 ||
+      fread(data, 1, (size_t)size, f) != (size_t)size) {
+    free(data);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  if (size_out != NULL) {
+    *size_out = size;
+  }
+
+  // Compact the survivors to the front, in place
+  long kept = 0;
+  size_t out = 0;
+  const char *p = data, *end = data + size;
+  int64_t when;
+  const char *text;
+  size_t n;
+  while ((p = dmstore_next(p, end, &when, &text, &n)) != NULL) {
+    if (store->max_age > 0 && now - when > store->max_age) {
+      continue;
+    }
+    const char *rec = text;
+    while (rec > data && rec[-1] != '\n') {
+      rec--; // Back to the start of the "<time> " prefix
+    }
+    size_t rec_len = (size_t)(text + n - rec);
+    memmove(data + out, rec, rec_len);
+    out += rec_len;
+    data[out++] = '\n';
+    kept++;
+  }
+  *buf = data;
+  *len = out;
+  return kept;
+}
+
+// Moves `tmp` over `path` in one step, so a crash leaves one or the other
+static inline int dmstore_replace(const char *tmp, const char *path) {
+#ifdef _WIN32
+  return MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+  return rename(tmp, path);
+#endif
+}
+
+// Replaces the mailbox at `path` with `len` bytes of `data`, by way of a
+// temporary file. Returns 0, or -1 with the mailbox left as it was.
+static inline int dmstore_rewrite(const char *path, const char *data,
+                                  size_t len) {
+  char tmp[DMSTORE_PATH_MAX + 72];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  int ok = fwrite(data, 1, len, f) == len;
+  if (fclose(f) != 0 || !ok || dmstore_replace(tmp, path) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// Appends `text` (one line; a trailing newline is ignored) to `user`'s
+// mailbox. When it would grow past `max_bytes`, expired messages are
+// dropped first. Returns 0 if stored, 1 if the mailbox is full, -1 on
+// error.
+static inline int dmstore_put(dmstore_t *store, const char *user, int64_t now,
+                              const char *text, size_t len) {
+  char path[DMSTORE_PATH_MAX + 64];
+  if (dmstore_path(store, user, path, sizeof(path)) < 0) {
+    return -1;
+  }
+  while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+    len--;
+  }
+  char stamp[DMSTORE_STAMP_DIGITS + 2];
+  int stamp_len = snprintf(stamp, sizeof(stamp), "%lld ", (long long)now);
+  long rec_len = (long)(stamp_len + len + 1);
+
+  FILE *f = fopen(path, "ab");
+  if (f == NULL) {
+    return -1;
+  }
+  long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+  if (size < 0) {
+    fclose(f);
+    return -1;
+  }
+  if (size + rec_len > store->max_bytes) {
+    fclose(f);
+    char *data;
+    size_t kept_len;
+    if (dmstore_read(store, path, now, &data, &kept_len, NULL) < 0) {
+      return -1;
+    }
+    if ((long)kept_len + rec_len > store->max_bytes) {
+      free(data);
+      return 1;
+    }
+    // Rewrite without the expired messages, then append as usual
+    int rewritten = dmstore_rewrite(path, data, kept_len);
+    free(data);
+    if (rewritten < 0) {
+      return -1;
+    }
+    f = fopen(path, "ab");
+    if (f == NULL) {
+      return -1;
+    }
+  }
+  int ok = fwrite(stamp, 1, (size_t)stamp_len, f) == (size_t)stamp_len &&
+           fwrite(text, 1, len, f) == len && fputc('\n', f) != EOF;
+  return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+// Moves the messages in the mailbox at `path` onto the end of those set
+// aside in `out`. Returns 0, or -1 on error (the mailbox is left in place,
+// so some messages may come twice).
+static inline int dmstore_set_aside(const char *path, const char *out) {
+  FILE *src = fopen(path, "rb");
+  if (src == NULL) {
+    return 0; // Nothing new
+  }
+  FILE *dst = fopen(out, "rb");
+  if (dst == NULL) {
+    fclose(src);
+    return dmstore_replace(path, out);
+  }
+  fclose(dst);
+  dst = fopen(out, "ab");
+  if (dst == NULL) {
+    fclose(src);
+    return -1;
+  }
+  char chunk[4096];
+  size_t n;
+  int ok = 1;
+  while (ok && (n = fread(chunk, 1, sizeof(chunk), src)) > 0) {
+    ok = fwrite(chunk, 1, n, dst) == n;
+  }
+  ok = ok && !ferror(src);
+  fclose(src);
+  if (fclose(dst) != 0 || !ok) {
+    return -1;
+  }
+  return remove(path) == 0 ? 0 : -1;
+}
+
+// Sets aside everything in `user`'s mailbox and reads what is unexpired,
+// as records for dmstore_next(). Messages set aside earlier and never
+// dropped come first. `*size` gets what to pass to dmstore_drop() once
+// the messages are delivered. Returns the number of messages (0 with *buf
+// NULL if there are none), or -1 on error. Free *buf.
+static inline long dmstore_get(const dmstore_t *store, const char *user,
+                               int64_t now, char **buf, size_t *len,
+                               long *size) {
+  char path[DMSTORE_PATH_MAX + 64];
+  char out[DMSTORE_PATH_MAX + 72];
+  *buf = NULL;
+  *len = 0;
+  *size = 0;
+  if (dmstore_path(store, user, path, sizeof(path)) < 0) {
+    return 0;
+  }
+  snprintf(out, sizeof(out), "%s.out", path);
+  if (dmstore_set_aside(path, out) < 0) {
+    return -1;
+  }
+  return dmstore_read(store, out, now, buf, len, size);
+}
+
+// Deletes the messages a dmstore_get() returned, once delivered. If
+// another dmstore_get() has set more aside since (the file is no longer
+// `size` bytes), they are left for that one to drop. Returns 0, or -1 on
+// error.
+static inline int dmstore_drop(const dmstore_t *store, const char *user,
+                               long size) {
+  char path[DMSTORE_PATH_MAX + 64];
+  char out[DMSTORE_PATH_MAX + 72];
+  if (dmstore_path(store, user, path, sizeof(path)) < 0) {
+    return 0;
+  }
+  snprintf(out, sizeof(out), "%s.out", path);
+  FILE *f = fopen(out, "rb");
+  if (f == NULL) {
+    return 0;
+  }
+  long now_size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+  fclose(f);
+  if (now_size != size) {
+    return 0;
+  }
+  return remove(out) == 0 ? 0 : -1;
+}
+
+#endif // DMSTORE_H
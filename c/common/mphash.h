@@ -0,0 +1,298 @@
+#ifndef MPHASH_H
+#define MPHASH_H
+
+// Static string set backed by a minimal perfect hash (hash and displace,
+// "CHD"). Built once from a key list, then every lookup costs one hash, one
+// table read and one strcmp(), whatever the number of keys. Keys are
+// borrowed: they must outlive the set.
+//
+// Keys are hashed into ~4-key buckets. Largest buckets first, each bucket
+// gets a displacement pair (d0, d1) that sends all of its keys to free
+// positions via (f1 + d0 * f2 + d1) mod m, with m ~3% above the key count n
+// so the last buckets still find room quickly. Positions >= n are then
+// remapped onto the holes left below n, which makes the hash minimal.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MPH_KEYS_PER_BUCKET 4
+#define MPH_SLACK_SHIFT 5 // m = n + n / 32 + 1
+#define MPH_MAX_D0 64   // Displacement multipliers tried per bucket
+#define MPH_MAX_SEEDS 8 // Fresh hash seeds tried before giving up
+
+typedef struct {
+  const char **slots; // One key per slot
+  uint32_t *disp;     // (d0, d1) per bucket
+  uint32_t *remap;    // Slot for each position >= num_keys
+  uint32_t num_keys;  // Distinct keys, which is also the number of slots
+  uint32_t num_positions; // m
+  uint32_t num_buckets;
+  uint64_t seed;
+} mph_set_t;
+
+static inline uint64_t mph_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Seeded FNV-1a with a final avalanche, over `len` bytes of `key`
+static inline uint64_t mph_hash_n(const char *key, size_t len, uint64_t seed) {
+  uint64_t h = 14695981039346656037ULL ^ seed;
+  const unsigned char *p = (const unsigned char *)key;
+  for (size_t k = 0; k < len; k++) {
+    h = (h ^ p[k]) * 1099511628211ULL;
+  }
+  return mph_mix(h);
+}
+
+static inline uint64_t mph_hash(const char *key, uint64_t seed) {
+  return mph_hash_n(key, strlen(key), seed);
+}
+
+static inline uint32_t mph_position(uint32_t f1, uint32_t f2, uint32_t d0,
+                                    uint32_t d1, uint32_t m) {
+  return (uint32_t)(((uint64_t)f1 + (uint64_t)d0 * f2 + d1) % m);
+}
+
+static inline void mph_init(mph_set_t *set) {
+  memset(set, 0, sizeof(*set));
+}
+
+static inline void mph_free(mph_set_t *set) {
+  free(set->slots);
+  free(set->disp);
+  free(set->remap);
+  mph_init(set);
+}
+
+// Slot of the `len` bytes at `key`, which need not be NUL-terminated (0 to
+// num_keys - 1, where slots[] holds it), or -1 if they are not in the set
+static inline long mph_index_n(const mph_set_t *set, const char *key,
+                               size_t len) {
+  if (set->num_keys == 0) {
+    return -1;
+  }
+  uint64_t h = mph_hash_n(key, len, set->seed);
+  uint32_t b = (uint32_t)(h >> 32) % set->num_buckets;
+  uint32_t m = set->num_positions;
+  uint32_t s = mph_position((uint32_t)h % m, (uint32_t)(mph_mix(h) % m),
+                            set->disp[2 * b], set->disp[2 * b + 1], m);
+  if (s >= set->num_keys) {
+    s = set->remap[s - set->num_keys];
+  }
+  return strncmp(set->slots[s], key, len) == 0 && set->slots[s][len] == '\0'
+             ? (long)s
+             : -1;
+}
+
+// Slot of `key` (0 to num_keys - 1, where slots[] holds it), or -1 if it
+// is not in the set
+static inline long mph_index(const mph_set_t *set, const char *key) {
+  return mph_index_n(set, key, strlen(key));
+}
+
+static inline int mph_contains(const mph_set_t *set, const char *key) {
+  return mph_index(set, key) >= 0;
+}
+
+// One attempt with `seed`. Returns 0 on success, 1 to retry with another
+// seed, -1 if out of memory. `set` is only written on success.
+static inline int mph_try_build(mph_set_t *set, const char **keys, size_t n,
+                                uint64_t seed) {
+  uint32_t nb = (uint32_t)(n / MPH_KEYS_PER_BUCKET + 1);
+  uint64_t *hashes = (uint64_t *)malloc(n * sizeof(uint64_t));
+  uint32_t *bucket_start = (uint32_t *)calloc((size_t)nb + 1, sizeof(uint32_t));
+  uint32_t *order = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t *by_size = (uint32_t *)malloc((size_t)nb * sizeof(uint32_t));
+  uint32_t *disp = (uint32_t *)calloc((size_t)nb * 2, sizeof(uint32_t));
+  const char **slots = NULL;
+  uint32_t *remap = NULL;
+  uint32_t *f = NULL; // (f1, f2) per key
+  uint32_t *pos = NULL;
+  int ret = -1;
+  if (hashes == NULL || bucket_start == NULL || order == NULL ||
+      by_size == NULL || disp == NULL) {
+    goto done;
+  }
+
+  // Counting sort of keys by bucket
+  for (size_t k = 0; k < n; k++) {
+    hashes[k] = mph_hash(keys[k], seed);
+    bucket_start[(uint32_t)(hashes[k] >> 32) % nb + 1]++;
+  }
+  for (uint32_t b = 0; b < nb; b++) {
+    bucket_start[b + 1] += bucket_start[b];
+  }
+  {
+    uint32_t *fill = by_size; // Borrowed as scratch until sorted below
+    memcpy(fill, bucket_start, (size_t)nb * sizeof(uint32_t));
+    for (size_t k = 0; k < n; k++) {
+      order[fill[(uint32_t)(hashes[k] >> 32) % nb]++] = (uint32_t)k;
+    }
+  }
+
+  // Drop duplicate keys. Equal hashes on different keys need a new seed.
+  uint32_t distinct = 0;
+  uint32_t max_size = 0;
+  for (uint32_t b = 0; b < nb; b++) {
+    uint32_t end = bucket_start[b + 1];
+    for (uint32_t x = bucket_start[b]; x < end; x++) {
+      for (uint32_t y = x + 1; y < end; y++) {
+        if (hashes[order[x]] != hashes[order[y]]) {
+          continue;
+        }
+        if (strcmp(keys[order[x]], keys[order[y]]) != 0) {
+          ret = 1;
+          goto done;
+        }
+        order[y--] = order[--end]; // Swap-remove the duplicate
+      }
+    }
+    // Compact the bucket's survivors down to its start
+    uint32_t size = end - bucket_start[b];
+    memmove(&order[distinct], &order[bucket_start[b]],
+            size * sizeof(uint32_t));
+    bucket_start[b] = distinct;
+    distinct += size;
+    if (size > max_size) {
+      max_size = size;
+    }
+  }
+  bucket_start[nb] = distinct;
+  if (distinct == 0) {
+    ret = 0;
+    mph_free(set);
+    goto done;
+  }
+
+  // Buckets by size, largest first (counting sort)
+  {
+    uint32_t *count = (uint32_t *)calloc((size_t)max_size + 2,
+                                         sizeof(uint32_t));
+    if (count == NULL) {
+      goto done;
+    }
+    for (uint32_t b = 0; b < nb; b++) {
+      count[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (uint32_t sz = 0; sz <= max_size; sz++) {
+      count[sz + 1] += count[sz];
+    }
+    for (uint32_t b = 0; b < nb; b++) {
+      by_size[count[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+    }
+    free(count);
+  }
+
+  uint32_t m = distinct + (distinct >> MPH_SLACK_SHIFT) + 1;
+  slots = (const char **)calloc(m, sizeof(const char *));
+  remap = (uint32_t *)malloc((size_t)(m - distinct) * sizeof(uint32_t));
+  f = (uint32_t *)malloc((size_t)distinct * 2 * sizeof(uint32_t));
+  pos = (uint32_t *)malloc(((size_t)max_size + 1) * sizeof(uint32_t));
+  if (slots == NULL || remap == NULL || f == NULL || pos == NULL) {
+    goto done;
+  }
+  for (uint32_t x = 0; x < distinct; x++) {
+    uint64_t h = hashes[order[x]];
+    f[2 * x] = (uint32_t)h % m;
+    f[2 * x + 1] = (uint32_t)(mph_mix(h) % m);
+  }
+  for (uint32_t i = 0; i < nb; i++) {
+    uint32_t b = by_size[i];
+    uint32_t first = bucket_start[b];
+    uint32_t size = bucket_start[b + 1] - first;
+    if (size == 0) {
+      break; // Only empty buckets remain
+    }
+    int placed = 0;
+    for (uint32_t d0 = 0; d0 < MPH_MAX_D0 && !placed; d0++) {
+      for (uint32_t d1 = 0; d1 < m && !placed; d1++) {
+        uint32_t k = 0;
+        for (; k < size; k++) {
+          uint32_t x = first + k;
+          pos[k] = mph_position(f[2 * x], f[2 * x + 1], d0, d1, m);
+          if (slots[pos[k]] != NULL) {
+            break;
+          }
+          slots[pos[k]] = keys[order[first + k]]; // Claim; undone on failure
+        }
+        if (k == size) {
+          disp[2 * b] = d0;
+          disp[2 * b + 1] = d1;
+          placed = 1;
+        } else {
+          while (k-- > 0) {
+            slots[pos[k]] = NULL;
+          }
+        }
+      }
+    }
+    if (!placed) {
+      ret = 1;
+      goto done;
+    }
+  }
+
+  // Move the keys that landed past n into the holes below it
+  for (uint32_t p = distinct, hole = 0; p < m; p++) {
+    if (slots[p] == NULL) {
+      remap[p - distinct] = 0; // Only non-members land here; strcmp() fails
+      continue;
+    }
+    while (slots[hole] != NULL) {
+      hole++;
+    }
+    slots[hole] = slots[p];
+    remap[p - distinct] = hole;
+  }
+
+  mph_free(set);
+  set->slots = slots;
+  set->disp = disp;
+  set->remap = remap;
+  set->num_keys = distinct;
+  set->num_positions = m;
+  set->num_buckets = nb;
+  set->seed = seed;
+  slots = NULL;
+  disp = NULL;
+  remap = NULL;
+  ret = 0;
+
+done:
+  free(hashes);
+  free(bucket_start);
+  free(order);
+  free(by_size);
+  free(disp);
+  free((void *)slots);
+  free(remap);
+  free(f);
+  free(pos);
+  return ret;
+}
+
+// Builds `set` from `n` keys; duplicates are ignored. Returns 0 on success
+// or -1 (out of memory, or no seed worked), leaving `set` untouched.
+static inline int mph_build(mph_set_t *set, const char **keys, size_t n) {
+  if (n >= UINT32_MAX) {
+    return -1;
+  }
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+  for (int attempt = 0; attempt < MPH_MAX_SEEDS; attempt++) {
+    int ret = mph_try_build(set, keys, n, seed);
+    if (ret <= 0) {
+      return ret;
+    }
+    seed = mph_mix(seed + (uint64_t)attempt + 1);
+  }
+  return -1;
+}
+
+#endif // MPHASH_H
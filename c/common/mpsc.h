@@ -0,0 +1,64 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+// Intrusive lock-free multi-producer / single-consumer queue (Vyukov).
+// Any thread may push; only the owning thread may pop. Embed an mpsc_node_t
+// as the first member of the queued struct and cast back after popping.
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct mpsc_node {
+  _Atomic(struct mpsc_node *) next;
+} mpsc_node_t;
+
+typedef struct {
+  _Atomic(mpsc_node_t *) head; // Producers swap themselves in here
+  mpsc_node_t *tail;           // Consumer side
+  mpsc_node_t stub;
+} mpsc_queue_t;
+
+static inline void mpsc_init(mpsc_queue_t *q) {
+  atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+  atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+  q->tail = &q->stub;
+}
+
+// Safe to call from any thread
+static inline void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  mpsc_node_t *prev =
+      atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Consumer thread only. Returns NULL when empty, or when a producer is
+// midway through a push (the item becomes visible once that push finishes).
+static inline mpsc_node_t *mpsc_pop(mpsc_queue_t *q) {
+  mpsc_node_t *tail = q->tail;
+  mpsc_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &q->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    q->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&next->next, memory_order_acquire);
+  }
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+    return NULL;
+  }
+  mpsc_push(q, &q->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+#endif // MPSC_H
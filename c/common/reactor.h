@@ -0,0 +1,246 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// Small readiness-notification abstraction used by the server event loop.
+// On Linux it is backed by epoll; everywhere else it falls back to select().
+// Callers should treat every READ/WRITE event as "drain until would-block":
+// that is required for edge-triggered epoll registrations and harmless for
+// the level-triggered select() fallback.
+
+#include "sockets.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define REACTOR_HAVE_EPOLL 1
+#else
+#define REACTOR_HAVE_EPOLL 0
+#endif
+
+#ifndef _WIN32
+#include <sys/select.h>
+#endif
+
+// Interest / event flags
+#define REACTOR_READ 0x01  // Socket is readable (or listener has a connection)
+#define REACTOR_WRITE 0x02 // Socket can accept more outbound data
+#define REACTOR_EDGE 0x04  // Registration only: edge-triggered where supported
+#define REACTOR_HUP 0x08   // Event only: peer hung up or socket error
+
+typedef enum {
+  REACTOR_BACKEND_AUTO = 0, // Best available backend for this platform
+  REACTOR_BACKEND_SELECT,
+  REACTOR_BACKEND_EPOLL,
+} reactor_backend_t;
+
+typedef struct {
+  unsigned events; // REACTOR_READ | REACTOR_WRITE | REACTOR_HUP
+  void *udata;     // Value given at registration
+} reactor_event_t;
+
+// One registered socket (select backend only)
+typedef struct {
+  socket_t fd;
+  unsigned interest;
+  void *udata;
+} reactor_entry_t;
+
+typedef struct {
+  reactor_backend_t backend;
+#if REACTOR_HAVE_EPOLL
+  int epoll_fd;
+#endif
+  // select() backend bookkeeping
+  reactor_entry_t *entries;
+  int num_entries;
+  int cap_entries;
+} reactor_t;
+
+static inline const char *reactor_backend_name(const reactor_t *r) {
+  return r->backend == REACTOR_BACKEND_EPOLL ? "epoll" : "select";
+}
+
+// Initializes a reactor. REACTOR_BACKEND_AUTO picks epoll when available.
+// Returns 0 on success, -1 on error.
+static inline int reactor_init(reactor_t *r, reactor_backend_t backend) {
+  memset(r, 0, sizeof(*r));
+#if REACTOR_HAVE_EPOLL
+  r->epoll_fd = -1;
+  if (backend == REACTOR_BACKEND_AUTO || backend == REACTOR_BACKEND_EPOLL) {
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd < 0) {
+      return -1;
+    }
+    r->backend = REACTOR_BACKEND_EPOLL;
+    return 0;
+  }
+#else
+  if (backend == REACTOR_BACKEND_EPOLL) {
+    return -1; // Not available on this platform
+  }
+#endif
+  r->backend = REACTOR_BACKEND_SELECT;
+  return 0;
+}
+
+static inline void reactor_close(reactor_t *r) {
+#if REACTOR_HAVE_EPOLL
+  if (r->epoll_fd >= 0) {
+    close(r->epoll_fd);
+    r->epoll_fd = -1;
+  }
+#endif
+  free(r->entries);
+  r->entries = NULL;
+  r->num_entries = 0;
+  r->cap_entries = 0;
+}
+
+#if REACTOR_HAVE_EPOLL
+static inline int reactor_epoll_ctl(reactor_t *r, int op, socket_t fd,
+                                    unsigned interest, void *udata) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  if (interest & REACTOR_READ)
+    ev.events |= EPOLLIN | EPOLLRDHUP;
+  if (interest & REACTOR_WRITE)
+    ev.events |= EPOLLOUT;
+  if (interest & REACTOR_EDGE)
+    ev.events |= EPOLLET;
+  ev.data.ptr = udata;
+  return epoll_ctl(r->epoll_fd, op, fd, &ev);
+}
+#endif
+
+static inline int reactor_find_entry(const reactor_t *r, socket_t fd) {
+  for (int i = 0; i < r->num_entries; i++) {
+    if (r->entries[i].fd == fd) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Starts watching a socket. Returns 0 on success, -1 on error.
+static inline int reactor_add(reactor_t *r, socket_t fd, unsigned interest,
+                              void *udata) {
+#if REACTOR_HAVE_EPOLL
+  if (r->backend == REACTOR_BACKEND_EPOLL) {
+    return reactor_epoll_ctl(r, EPOLL_CTL_ADD, fd, interest, udata);
+  }
+#endif
+  if (r->num_entries == r->cap_entries) {
+    int new_cap = r->cap_entries ? r->cap_entries * 2 : 16;
+    reactor_entry_t *grown = (reactor_entry_t *)realloc(
+        r->entries, (size_t)new_cap * sizeof(reactor_entry_t));
+    if (grown == NULL) {
+      return -1;
+    }
+    r->entries = grown;
+    r->cap_entries = new_cap;
+  }
+  r->entries[r->num_entries].fd = fd;
+  r->entries[r->num_entries].interest = interest;
+  r->entries[r->num_entries].udata = udata;
+  r->num_entries++;
+  return 0;
+}
+
+// Changes the interest set (and user data) of a watched socket.
+static inline int reactor_modify(reactor_t *r, socket_t fd, unsigned interest,
+                                 void *udata) {
+#if REACTOR_HAVE_EPOLL
+  if (r->backend == REACTOR_BACKEND_EPOLL) {
+    return reactor_epoll_ctl(r, EPOLL_CTL_MOD, fd, interest, udata);
+  }
+#endif
+  int idx = reactor_find_entry(r, fd);
+  if (idx < 0) {
+    return -1;
+  }
+  r->entries[idx].interest = interest;
+  r->entries[idx].udata = udata;
+  return 0;
+}
+
+// Stops watching a socket. Call before closing it.
+static inline int reactor_remove(reactor_t *r, socket_t fd) {
+#if REACTOR_HAVE_EPOLL
+  if (r->backend == REACTOR_BACKEND_EPOLL) {
+    return epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  }
+#endif
+  int idx = reactor_find_entry(r, fd);
+  if (idx < 0) {
+    return -1;
+  }
+  r->entries[idx] = r->entries[r->num_entries - 1];
+  r->num_entries--;
+  return 0;
+}
+
+// Waits for events. timeout_ms < 0 waits forever.
+// Returns the number of events written to `events`, 0 on timeout, or -1 on
+// error (check socket_interrupted() for EINTR).
+static inline int reactor_wait(reactor_t *r, reactor_event_t *events,
+                               int max_events, int timeout_ms) {
+#if REACTOR_HAVE_EPOLL
+  if (r->backend == REACTOR_BACKEND_EPOLL) {
+    struct epoll_event ep_events[64];
+    if (max_events > 64)
+      max_events = 64;
+    int n = epoll_wait(r->epoll_fd, ep_events, max_events, timeout_ms);
+    for (int i = 0; i < n; i++) {
+      unsigned flags = 0;
+      if (ep_events[i].events & EPOLLIN)
+        flags |= REACTOR_READ;
+      if (ep_events[i].events & EPOLLOUT)
+        flags |= REACTOR_WRITE;
+      if (ep_events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+        flags |= REACTOR_HUP | REACTOR_READ; // Let recv() report the reason
+      events[i].events = flags;
+      events[i].udata = ep_events[i].data.ptr;
+    }
+    return n;
+  }
+#endif
+  fd_set read_fds;
+  fd_set write_fds;
+  socket_t max_sd = 0;
+  FD_ZERO(&read_fds);
+  FD_ZERO(&write_fds);
+  for (int i = 0; i < r->num_entries; i++) {
+    if (r->entries[i].interest & REACTOR_READ)
+      FD_SET(r->entries[i].fd, &read_fds);
+    if (r->entries[i].interest & REACTOR_WRITE)
+      FD_SET(r->entries[i].fd, &write_fds);
+    if (r->entries[i].fd > max_sd)
+      max_sd = r->entries[i].fd;
+  }
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  int activity = select((int)max_sd + 1, &read_fds, &write_fds, NULL,
+                        timeout_ms < 0 ? NULL : &tv);
+  if (activity <= 0) {
+    return activity;
+  }
+  int n = 0;
+  for (int i = 0; i < r->num_entries && n < max_events; i++) {
+    unsigned flags = 0;
+    if (FD_ISSET(r->entries[i].fd, &read_fds))
+      flags |= REACTOR_READ;
+    if (FD_ISSET(r->entries[i].fd, &write_fds))
+      flags |= REACTOR_WRITE;
+    if (flags) {
+      events[n].events = flags;
+      events[n].udata = r->entries[i].udata;
+      n++;
+    }
+  }
+  return n;
+}
+
+#endif // REACTOR_H
@@ -0,0 +1,95 @@
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+// Fixed-capacity byte ring used for per-connection input. Capacity must be
+// a power of two; head/tail are free-running counters, so used bytes are
+// simply tail - head and no slot is wasted to tell full from empty.
+
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+  char *data;
+  size_t cap;  // Power of two
+  size_t head; // Next byte to read
+  size_t tail; // Next byte to write
+} ringbuf_t;
+
+static inline void ringbuf_init(ringbuf_t *rb, char *storage, size_t cap) {
+  rb->data = storage;
+  rb->cap = cap;
+  rb->head = 0;
+  rb->tail = 0;
+}
+
+static inline size_t ringbuf_used(const ringbuf_t *rb) {
+  return rb->tail - rb->head;
+}
+
+static inline size_t ringbuf_space(const ringbuf_t *rb) {
+  return rb->cap - ringbuf_used(rb);
+}
+
+// Contiguous free region at the write position, e.g. for recv() straight
+// into the ring. Follow with ringbuf_commit().
+static inline char *ringbuf_write_ptr(ringbuf_t *rb, size_t *len) {
+  size_t off = rb->tail & (rb->cap - 1);
+  size_t contiguous = rb->cap - off;
+  size_t space = ringbuf_space(rb);
+  *len = space < contiguous ? space : contiguous;
+  return rb->data + off;
+}
+
+static inline void ringbuf_commit(ringbuf_t *rb, size_t n) { rb->tail += n; }
+
+// Appends up to `n` bytes. Returns how many fit.
+static inline size_t ringbuf_write(ringbuf_t *rb, const char *src, size_t n) {
+  size_t written = 0;
+  while (written < n) {
+    size_t len;
+    char *dst = ringbuf_write_ptr(rb, &len);
+    if (len == 0) {
+      break;
+    }
+    if (len > n - written) {
+      len = n - written;
+    }
+    memcpy(dst, src + written, len);
+    ringbuf_commit(rb, len);
+    written += len;
+  }
+  return written;
+}
+
+// Copies the first `n` readable bytes (n <= used) without consuming them
+static inline void ringbuf_peek(const ringbuf_t *rb, char *dst, size_t n) {
+  size_t off = rb->head & (rb->cap - 1);
+  size_t first = rb->cap - off;
+  if (first > n) {
+    first = n;
+  }
+  memcpy(dst, rb->data + off, first);
+  memcpy(dst + first, rb->data, n - first);
+}
+
+static inline void ringbuf_consume(ringbuf_t *rb, size_t n) { rb->head += n; }
+
+// Offset of the first `c` at or after readable offset `from`, or -1
+static inline long ringbuf_find(const ringbuf_t *rb, size_t from, char c) {
+  size_t used = ringbuf_used(rb);
+  while (from < used) {
+    size_t off = (rb->head + from) & (rb->cap - 1);
+    size_t len = rb->cap - off;
+    if (len > used - from) {
+      len = used - from;
+    }
+    const char *hit = (const char *)memchr(rb->data + off, c, len);
+    if (hit != NULL) {
+      return (long)(from + (size_t)(hit - (rb->data + off)));
+    }
+    from += len;
+  }
+  return -1;
+}
+
+#endif // RINGBUF_H
@@ -0,0 +1,646 @@
+#ifndef SEGLOG_H
+#define SEGLOG_H
+
+// Append-only line log split into segment files, each with a sparse
+// sidecar index. Every record is one line and gets the next number of a
+// gapless sequence. A segment is named after the sequence number of its
+// first record ("<dir>/00000000000000000042.txt" plus ".idx"), so the
+// segment holding a record, and the one after it, follow from the names.
+//
+// The index is an array of fixed-size {seq, time, offset} entries: one for
+// the first record of the segment, then one for the first record after
+// every SEGLOG_INDEX_INTERVAL bytes. Finding a record by number or time is
+// a binary search over segments and index entries, then a scan of at most
+// one interval. Retention deletes whole segments, oldest first.
+//
+// One writer thread appends. Any thread may read: `mutex` guards the
+// segment list, and readers never go past `committed`, the records that
+// have been flushed.
+
+#include "thread.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <direct.h> // _mkdir()
+#include <io.h>     // _commit()
+#else
+#include <dirent.h>
+#include <sys/stat.h> // mkdir()
+#include <unistd.h>   // fdatasync()
+#endif
+
+#define SEGLOG_INDEX_INTERVAL 4096 // Bytes of text per index entry
+#define SEGLOG_PATH_MAX 512
+#define SEGLOG_NAME_DIGITS 20 // Zero-padded sequence number
+// Any file in the log: the directory, '/', the name and a short extension
+#define SEGLOG_FILE_MAX (SEGLOG_PATH_MAX + SEGLOG_NAME_DIGITS + 8)
+
+typedef struct {
+  uint64_t seq;
+  int64_t time;    // Wall-clock seconds the record was logged at
+  uint64_t offset; // Of the record's first byte in the segment
+} seglog_entry_t;
+
+typedef struct {
+  uint64_t base_seq; // First record
+  int64_t base_time; // When the first record was logged (0 if unknown)
+} seglog_segment_t;
+
+typedef struct {
+  char dir[SEGLOG_PATH_MAX];
+  uint64_t max_size;     // Rotate before a segment would grow past this
+  int daily;             // Also rotate when the local date changes
+  size_t retain_count;   // Segments to keep (0: no limit)
+  int64_t retain_secs;   // Drop segments older than this (0: no limit)
+  size_t buffer_size;    // stdio buffer of the active segment (0: default)
+
+  mutex_t mutex;          // Guards the segment list
+  seglog_segment_t *segs; // Retained segments, oldest first, from `first`
+  size_t first;
+  size_t count;
+  size_t cap;
+  _Atomic uint64_t committed; // Records below this are flushed and readable
+
+  // Writer only
+  FILE *data;
+  char *data_buf; // buffer_size bytes for `data`, kept across rotations
+  FILE *index;
+  uint64_t next_seq;
+  uint64_t size;       // Bytes in the active segment
+  uint64_t indexed_at; // Offset of its last index entry
+  long day;            // Local date of its first record (daily rotation)
+} seglog_t;
+
+// Sequential reader over records, crossing segment boundaries
+typedef struct {
+  seglog_t *log;
+  FILE *file;
+  uint64_t seq; // Number of the record next() returns
+} seglog_reader_t;
+
+static inline void seglog_path(const seglog_t *log, uint64_t base,
+                               const char *ext, char *buf, size_t cap) {
+  snprintf(buf, cap, "%s/%0*llu.%s", log->dir, SEGLOG_NAME_DIGITS,
+           (unsigned long long)base, ext);
+}
+
+static inline long seglog_day(int64_t when) {
+  time_t t = (time_t)when;
+  struct tm tm_now;
+#ifdef _WIN32
+  localtime_s(&tm_now, &t);
+#else
+  localtime_r(&t, &tm_now);
+#endif
+  return (long)tm_now.tm_year * 1000 + tm_now.tm_yday;
+}
+
+static inline seglog_segment_t *seglog_seg(seglog_t *log, size_t k) {
+  return &log->segs[log->first + k];
+}
+
+// Appends a segment to the list. Caller holds `mutex`.
+static inline int seglog_add_segment(seglog_t *log, uint64_t base,
+                                     int64_t base_time) {
+  if (log->first + log->count == log->cap) {
+    if (log->first > 0) {
+      memmove(log->segs, &log->segs[log->first],
+              log->count * sizeof(seglog_segment_t));
+      log->first = 0;
+    } else {
+      size_t cap = log->cap ? log->cap * 2 : 16;
+      seglog_segment_t *segs = (seglog_segment_t *)realloc(
+          log->segs, cap * sizeof(seglog_segment_t));
+      if (segs == NULL) {
+        return -1;
+      }
+      log->segs = segs;
+      log->cap = cap;
+    }
+  }
+  log->segs[log->first + log->count].base_seq = base;
+  log->segs[log->first + log->count].base_time = base_time;
+  log->count++;
+  return 0;
+}
+
+// Number of entries in an index file, which is left positioned at its end
+static inline size_t seglog_index_len(FILE *index) {
+  if (fseek(index, 0, SEEK_END) != 0) {
+    return 0;
+  }
+  long size = ftell(index);
+  return size > 0 ? (size_t)size / sizeof(seglog_entry_t) : 0;
+}
+
+static inline int seglog_read_entry(FILE *index, size_t k,
+                                    seglog_entry_t *entry) {
+  if (fseek(index, (long)(k * sizeof(seglog_entry_t)), SEEK_SET) != 0 ||
+      fread(entry, sizeof(*entry), 1, index) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+static int seglog_compare_segments(const void *a, const void *b) {
+  uint64_t x = ((const seglog_segment_t *)a)->base_seq;
+  uint64_t y = ((const seglog_segment_t *)b)->base_seq;
+  return x < y ? -1 : x > y;
+}
+
+// True if `name` is "<SEGLOG_NAME_DIGITS digits>.txt"
+static inline int seglog_parse_name(const char *name, uint64_t *base) {
+  uint64_t value = 0;
+  for (int k = 0; k < SEGLOG_NAME_DIGITS; k++) {
+    if (name[k] < '0' || name[k] > '9') {
+      return 0;
+    }
+    value = value * 10 + (uint64_t)(name[k] - '0');
+  }
+  if (strcmp(name + SEGLOG_NAME_DIGITS, ".txt") != 0) {
+    return 0;
+  }
+  *base = value;
+  return 1;
+}
+
+// Collects the segments found in `dir`, sorted. Caller holds `mutex`.
+static inline int seglog_scan_dir(seglog_t *log) {
+  uint64_t base;
+#ifdef _WIN32
+  char pattern[SEGLOG_FILE_MAX];
+  snprintf(pattern, sizeof(pattern), "%s/*.txt", log->dir);
+  WIN32_FIND_DATAA found;
+  HANDLE find = FindFirstFileA(pattern, &found);
+  if (find != INVALID_HANDLE_VALUE) {
+    do {
+      if (seglog_parse_name(found.cFileName, &base) &&
+          seglog_add_segment(log, base, 0) < 0) {
+        FindClose(find);
+        return -1;
+      }
+    } while (FindNextFileA(find, &found));
+    FindClose(find);
+  }
+#else
+  DIR *d = opendir(log->dir);
+  if (d == NULL) {
+    return -1;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (seglog_parse_name(ent->d_name, &base) &&
+        seglog_add_segment(log, base, 0) < 0) {
+      closedir(d);
+      return -1;
+    }
+  }
+  closedir(d);
+#endif
+  if (log->count > 0) {
+    qsort(log->segs, log->count, sizeof(seglog_segment_t),
+          seglog_compare_segments);
+  }
+  return 0;
+}
+
+// Deletes the oldest segments beyond the retention limits, never the
+// active one. Each costs two unlinks, however large the segment.
+static inline int seglog_retain(seglog_t *log, int64_t now) {
+  int dropped = 0;
+  mutex_lock(&log->mutex);
+  while (log->count > 1) {
+    int too_many = log->retain_count > 0 && log->count > log->retain_count;
+    // The oldest segment ended when the next one started
+    int64_t ended = seglog_seg(log, 1)->base_time;
+    int too_old = log->retain_secs > 0 && ended > 0 &&
+                  now - ended > log->retain_secs;
+    if (!too_many && !too_old) {
+      break;
+    }
+    char path[SEGLOG_FILE_MAX];
+    uint64_t base = seglog_seg(log, 0)->base_seq;
+    seglog_path(log, base, "txt", path, sizeof(path));
+    remove(path);
+    seglog_path(log, base, "idx", path, sizeof(path));
+    remove(path);
+    log->first++;
+    log->count--;
+    dropped++;
+  }
+  mutex_unlock(&log->mutex);
+  return dropped;
+}
+
+// Opens an active segment's text for appending, with `buffer_size` bytes
+// of stdio buffering so a batch of records reaches the file in few writes.
+// The buffer is supplied, as some C libraries ignore the size otherwise.
+static inline FILE *seglog_open_data(seglog_t *log, const char *path) {
+  FILE *data = fopen(path, "ab");
+  if (data != NULL && log->buffer_size > 0) {
+    if (log->data_buf == NULL) {
+      log->data_buf = (char *)malloc(log->buffer_size);
+    }
+    if (log->data_buf != NULL) {
+      setvbuf(data, log->data_buf, _IOFBF, log->buffer_size);
+    }
+  }
+  return data;
+}
+
+// Reopens the newest segment for appending and works out the next
+// sequence number from its last index entry and the lines after it. A
+// torn last line is terminated so that it counts as a record.
+static inline int seglog_recover_active(seglog_t *log) {
+  seglog_segment_t *seg = seglog_seg(log, log->count - 1);
+  char path[SEGLOG_FILE_MAX];
+  seglog_entry_t last = {seg->base_seq, seg->base_time, 0};
+  seglog_path(log, seg->base_seq, "idx", path, sizeof(path));
+  FILE *index = fopen(path, "rb");
+  if (index != NULL) {
+    size_t n = seglog_index_len(index);
+    if (n > 0) {
+      seglog_read_entry(index, n - 1, &last);
+    }
+    fclose(index);
+  }
+  seglog_path(log, seg->base_seq, "txt", path, sizeof(path));
+  FILE *data = fopen(path, "rb");
+  if (data == NULL) {
+    return -1;
+  }
+  uint64_t seq = last.seq;
+  uint64_t size = last.offset;
+  int tail = '\n';
+  char buf[SEGLOG_INDEX_INTERVAL];
+  size_t got;
+  fseek(data, (long)last.offset, SEEK_SET);
+  while ((got = fread(buf, 1, sizeof(buf), data)) > 0) {
+    for (char *p = buf; (p = (char *)memchr(p, '\n', got - (size_t)(p - buf)));
+         p++) {
+      seq++;
+    }
+    size += got;
+    tail = buf[got - 1];
+  }
+  fclose(data);
+
+  log->data = seglog_open_data(log, path);
+  seglog_path(log, seg->base_seq, "idx", path, sizeof(path));
+  log->index = fopen(path, "ab");
+  if (log->data == NULL || log->index == NULL) {
+    return -1;
+  }
+  if (tail != '\n') {
+    fputc('\n', log->data);
+    size++;
+    seq++;
+  }
+  log->next_seq = seq;
+  log->size = size;
+  log->indexed_at = last.offset;
+  log->day = seglog_day(seg->base_time ? seg->base_time : (int64_t)time(NULL));
+  return 0;
+}
+
+// Opens (creating if needed) the log in `dir`, which must not end with a
+// slash. Set the rotation and retention fields before calling. Returns 0
+// on success, -1 on error (including a name too long to hold).
+static inline int seglog_open(seglog_t *log, const char *dir) {
+  if ((size_t)snprintf(log->dir, sizeof(log->dir), "%s", dir) >=
+      sizeof(log->dir)) {
+    return -1;
+  }
+  mutex_init(&log->mutex);
+#ifdef _WIN32
+  _mkdir(log->dir);
+#else
+  mkdir(log->dir, 0755);
+#endif
+  mutex_lock(&log->mutex);
+  int ret = seglog_scan_dir(log);
+  // Segment start times, for time lookups and age-based retention
+  for (size_t k = 0; ret == 0 && k < log->count; k++) {
+    char path[SEGLOG_FILE_MAX];
+    seglog_path(log, seglog_seg(log, k)->base_seq, "idx", path, sizeof(path));
+    FILE *index = fopen(path, "rb");
+    seglog_entry_t entry;
+    if (index != NULL) {
+      if (seglog_read_entry(index, 0, &entry) == 0) {
+        seglog_seg(log, k)->base_time = entry.time;
+      }
+      fclose(index);
+    }
+  }
+  log->next_seq = 1; // 0 is left free to mean "no record"
+  if (ret == 0 && log->count > 0) {
+    ret = seglog_recover_active(log);
+  }
+  mutex_unlock(&log->mutex);
+  atomic_store(&log->committed, log->next_seq);
+  if (ret == 0) {
+    seglog_retain(log, (int64_t)time(NULL));
+  }
+  return ret;
+}
+
+static inline int seglog_flush(seglog_t *log) {
+  int ret = 0;
+  // Text before index, so no entry ever points past the text
+  if (log->data != NULL && fflush(log->data) != 0) {
+    ret = -1;
+  }
+  if (log->index != NULL && fflush(log->index) != 0) {
+    ret = -1;
+  }
+  atomic_store_explicit(&log->committed, log->next_seq, memory_order_release);
+  return ret;
+}
+
+// Forces the active segment's text to disk. The index is only a search
+// aid (missing entries cost longer scans), so it is left to the OS.
+static inline void seglog_sync(seglog_t *log) {
+  if (log->data == NULL) {
+    return;
+  }
+#ifdef _WIN32
+  _commit(_fileno(log->data));
+#elif defined(__linux__)
+  fdatasync(fileno(log->data));
+#else
+  fsync(fileno(log->data));
+#endif
+}
+
+// Closes the active segment and starts a new one at `next_seq`
+static inline int seglog_rotate(seglog_t *log, int64_t now) {
+  if (log->data != NULL) {
+    seglog_flush(log);
+    fclose(log->data);
+    fclose(log->index);
+    log->data = NULL;
+    log->index = NULL;
+  }
+  char path[SEGLOG_FILE_MAX];
+  seglog_path(log, log->next_seq, "txt", path, sizeof(path));
+  log->data = seglog_open_data(log, path);
+  seglog_path(log, log->next_seq, "idx", path, sizeof(path));
+  log->index = fopen(path, "ab");
+  if (log->data == NULL || log->index == NULL) {
+    if (log->data != NULL) {
+      fclose(log->data);
+    }
+    if (log->index != NULL) {
+      fclose(log->index);
+    }
+    log->data = NULL;
+    log->index = NULL;
+    return -1;
+  }
+  mutex_lock(&log->mutex);
+  int ret = seglog_add_segment(log, log->next_seq, now);
+  mutex_unlock(&log->mutex);
+  log->size = 0;
+  log->indexed_at = 0;
+  log->day = seglog_day(now);
+  seglog_retain(log, now);
+  return ret;
+}
+
+// Appends one record, which must be a single line ending in '\n'. Visible
+// to readers after the next seglog_flush(). Returns 0 or -1 on error.
+static inline int seglog_append(seglog_t *log, int64_t now, const char *line,
+                                size_t len) {
+  if (log->data == NULL ||
+      (log->size > 0 && (log->size + len > log->max_size ||
+                         (log->daily && seglog_day(now) != log->day)))) {
+    if (seglog_rotate(log, now) < 0) {
+      return -1;
+    }
+  }
+  if (log->size == 0 || log->size - log->indexed_at >= SEGLOG_INDEX_INTERVAL) {
+    seglog_entry_t entry = {log->next_seq, now, log->size};
+    fwrite(&entry, sizeof(entry), 1, log->index);
+    log->indexed_at = log->size;
+  }
+  if (fwrite(line, 1, len, log->data) != len) {
+    return -1;
+  }
+  log->size += len;
+  log->next_seq++;
+  return 0;
+}
+
+static inline void seglog_close(seglog_t *log) {
+  if (log->data != NULL) {
+    seglog_flush(log);
+    fclose(log->data);
+    fclose(log->index);
+    log->data = NULL;
+    log->index = NULL;
+  }
+  free(log->data_buf);
+  log->data_buf = NULL;
+  free(log->segs);
+  log->segs = NULL;
+  log->first = log->count = log->cap = 0;
+  mutex_destroy(&log->mutex);
+}
+
+// Oldest retained record and one past the newest readable one
+static inline void seglog_bounds(seglog_t *log, uint64_t *oldest,
+                                 uint64_t *end) {
+  mutex_lock(&log->mutex);
+  *end = atomic_load_explicit(&log->committed, memory_order_acquire);
+  *oldest = log->count > 0 ? seglog_seg(log, 0)->base_seq : *end;
+  mutex_unlock(&log->mutex);
+}
+
+// Finds the index entry at or before record `seq`. Returns 0 and fills
+// `entry` (with the segment's base in `base`), or -1 if `seq` is not held.
+static inline int seglog_locate(seglog_t *log, uint64_t seq, uint64_t *base,
+                                seglog_entry_t *entry) {
+  mutex_lock(&log->mutex);
+  size_t lo = 0, hi = log->count; // Last segment with base_seq <= seq
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (seglog_seg(log, mid)->base_seq <= seq) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  int held = log->count > 0 && seglog_seg(log, lo)->base_seq <= seq &&
+             seq < atomic_load(&log->committed);
+  if (held) {
+    *base = seglog_seg(log, lo)->base_seq;
+    entry->seq = *base;
+    entry->time = seglog_seg(log, lo)->base_time;
+    entry->offset = 0;
+  }
+  mutex_unlock(&log->mutex);
+  if (!held) {
+    return -1;
+  }
+  char path[SEGLOG_FILE_MAX];
+  seglog_path(log, *base, "idx", path, sizeof(path));
+  FILE *index = fopen(path, "rb");
+  if (index == NULL) {
+    return 0; // Scan from the start of the segment
+  }
+  size_t l = 0, h = seglog_index_len(index);
+  seglog_entry_t probe;
+  while (l < h) {
+    size_t mid = l + (h - l) / 2;
+    if (seglog_read_entry(index, mid, &probe) < 0) {
+      break;
+    }
+    if (probe.seq <= seq) {
+      *entry = probe;
+      l = mid + 1;
+    } else {
+      h = mid;
+    }
+  }
+  fclose(index);
+  return 0;
+}
+
+// Finds the last index entry logged at or before `when`: records before
+// its `seq` are all older than `when`, so a scan for the first record at
+// or after `when` can start there. Returns -1 if the log is empty.
+static inline int seglog_locate_time(seglog_t *log, int64_t when,
+                                     seglog_entry_t *entry) {
+  uint64_t base;
+  mutex_lock(&log->mutex);
+  if (log->count == 0) {
+    mutex_unlock(&log->mutex);
+    return -1;
+  }
+  size_t lo = 0, hi = log->count; // Last segment starting at or before
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (seglog_seg(log, mid)->base_time <= when) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  base = seglog_seg(log, lo)->base_seq;
+  entry->seq = base;
+  entry->time = seglog_seg(log, lo)->base_time;
+  entry->offset = 0;
+  mutex_unlock(&log->mutex);
+  char path[SEGLOG_FILE_MAX];
+  seglog_path(log, base, "idx", path, sizeof(path));
+  FILE *index = fopen(path, "rb");
+  if (index == NULL) {
+    return 0;
+  }
+  size_t l = 0, h = seglog_index_len(index);
+  seglog_entry_t probe;
+  while (l < h) {
+    size_t mid = l + (h - l) / 2;
+    if (seglog_read_entry(index, mid, &probe) < 0) {
+      break;
+    }
+    if (probe.time <= when) {
+      *entry = probe;
+      l = mid + 1;
+    } else {
+      h = mid;
+    }
+  }
+  fclose(index);
+  return 0;
+}
+
+static inline void seglog_reader_close(seglog_reader_t *r) {
+  if (r->file != NULL) {
+    fclose(r->file);
+    r->file = NULL;
+  }
+}
+
+// Reads one line into `buf` (NUL-terminated, cut to fit but keeping its
+// newline). Returns its length, or -1 at the end of the file.
+static inline long seglog_read_line(FILE *file, char *buf, size_t cap) {
+  if (fgets(buf, (int)cap, file) == NULL) {
+    return -1;
+  }
+  size_t len = strlen(buf);
+  if (len > 0 && buf[len - 1] != '\n') {
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n') {
+    }
+    if (c == '\n') {
+      buf[len - 1] = '\n';
+    }
+  }
+  return (long)len;
+}
+
+// Positions `r` on record `seq`. Returns 0, or -1 if it is not held.
+static inline int seglog_reader_open(seglog_reader_t *r, seglog_t *log,
+                                     uint64_t seq) {
+  uint64_t base;
+  seglog_entry_t entry;
+  r->log = log;
+  r->file = NULL;
+  if (seglog_locate(log, seq, &base, &entry) < 0) {
+    return -1;
+  }
+  char path[SEGLOG_FILE_MAX];
+  seglog_path(log, base, "txt", path, sizeof(path));
+  r->file = fopen(path, "rb");
+  if (r->file == NULL || fseek(r->file, (long)entry.offset, SEEK_SET) != 0) {
+    seglog_reader_close(r);
+    return -1;
+  }
+  r->seq = entry.seq;
+  char skip[SEGLOG_INDEX_INTERVAL];
+  while (r->seq < seq && seglog_read_line(r->file, skip, sizeof(skip)) >= 0) {
+    r->seq++;
+  }
+  if (r->seq != seq) {
+    seglog_reader_close(r);
+    return -1;
+  }
+  return 0;
+}
+
+// Reads record r->seq into `buf` and advances. Returns the line length, or
+// -1 once past the last flushed record (or on error).
+static inline long seglog_reader_next(seglog_reader_t *r, char *buf,
+                                      size_t cap) {
+  if (r->file == NULL ||
+      r->seq >= atomic_load_explicit(&r->log->committed,
+                                     memory_order_acquire)) {
+    return -1;
+  }
+  long len = seglog_read_line(r->file, buf, cap);
+  if (len < 0) {
+    // End of this segment; the next one is named after this record
+    fclose(r->file);
+    char path[SEGLOG_FILE_MAX];
+    seglog_path(r->log, r->seq, "txt", path, sizeof(path));
+    r->file = fopen(path, "rb");
+    if (r->file == NULL) {
+      return -1;
+    }
+    len = seglog_read_line(r->file, buf, cap);
+    if (len < 0) {
+      return -1;
+    }
+  }
+  r->seq++;
+  return len;
+}
+
+#endif // SEGLOG_H
@@ -9,17 +9,22 @@
 // #pragma comment(lib, "Ws2_32.lib") // We link explicitly with Zig, so this is
 // optional
 typedef SOCKET socket_t;
+typedef WSABUF socket_iov_t; // One buffer of a gathered send
 #define close_socket(s) closesocket(s)
 #define socket_errno WSAGetLastError()
 // INVALID_SOCKET is already defined in winsock2.h
 #else                  // Linux/macOS
 #include <arpa/inet.h> // For inet_ntop, htons, etc.
 #include <errno.h>     // For errno
+#include <fcntl.h>     // For fcntl, O_NONBLOCK
 #include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_NODELAY
 #include <string.h> // For strerror (needed by print_socket_error on Linux)
 #include <sys/socket.h>
+#include <sys/uio.h>        // For struct iovec
 #include <unistd.h>         // For close
 typedef int socket_t;
+typedef struct iovec socket_iov_t; // One buffer of a gathered send
 #define INVALID_SOCKET (-1) // Define it for POSIX
 #define close_socket(s) close(s)
 #define socket_errno errno
@@ -59,4 +64,75 @@ static inline void print_socket_error(const char *message) {
 #endif
 }
 
+// Puts a socket into non-blocking mode. Returns 0 on success, -1 on error.
+static inline int socket_set_nonblocking(socket_t s) {
+#ifdef _WIN32
+  u_long mode = 1;
+  return ioctlsocket(s, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+  int flags = fcntl(s, F_GETFL, 0);
+  if (flags < 0) {
+    return -1;
+  }
+  return fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0 ? -1 : 0;
+#endif
+}
+
+// Turns off Nagle's algorithm, for callers that batch their own writes.
+// Returns 0 on success, -1 on error.
+static inline int socket_set_nodelay(socket_t s) {
+  int on = 1;
+  return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on,
+                    sizeof(on)) == 0
+             ? 0
+             : -1;
+}
+
+// True if the last socket call failed only because it would have blocked
+static inline int socket_would_block(void) {
+#ifdef _WIN32
+  return socket_errno == WSAEWOULDBLOCK;
+#else
+  return socket_errno == EAGAIN || socket_errno == EWOULDBLOCK;
+#endif
+}
+
+// True if the last socket call was interrupted by a signal
+static inline int socket_interrupted(void) {
+#ifdef _WIN32
+  return socket_errno == WSAEINTR;
+#else
+  return socket_errno == EINTR;
+#endif
+}
+
+static inline void socket_iov_set(socket_iov_t *iov, const void *data,
+                                  size_t len) {
+#ifdef _WIN32
+  iov->buf = (CHAR *)data;
+  iov->len = (ULONG)len;
+#else
+  iov->iov_base = (void *)data;
+  iov->iov_len = len;
+#endif
+}
+
+// Sends `n` buffers with one call, in order (writev()/WSASend()).
+// Returns the number of bytes sent, or -1 on error.
+static inline long socket_sendv(socket_t s, socket_iov_t *iov, int n,
+                                int flags) {
+#ifdef _WIN32
+  DWORD sent = 0;
+  return WSASend(s, iov, (DWORD)n, &sent, (DWORD)flags, NULL, NULL) == 0
+             ? (long)sent
+             : -1;
+#else
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = (size_t)n;
+  return (long)sendmsg(s, &msg, flags);
+#endif
+}
+
 #endif // SOCKETS_H
@@ -0,0 +1,97 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+// Lock-free single-producer / single-consumer ring of variable-length
+// records. One thread pushes and one other thread pops; neither ever
+// blocks. Like ringbuf.h the capacity is a power of two and head/tail are
+// free-running byte counters. Each record is a size_t length followed by
+// its bytes, and may wrap around the end of the storage.
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+  char *data;
+  size_t cap;          // Power of two
+  _Atomic size_t head; // Next byte to pop; written by the consumer
+  _Atomic size_t tail; // Next byte to push; written by the producer
+} spsc_ring_t;
+
+static inline void spsc_init(spsc_ring_t *rb, char *storage, size_t cap) {
+  rb->data = storage;
+  rb->cap = cap;
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->tail, 0);
+}
+
+// Bytes in use. Exact from either side's own point of view, a snapshot
+// from anywhere else.
+static inline size_t spsc_used(spsc_ring_t *rb) {
+  return atomic_load_explicit(&rb->tail, memory_order_acquire) -
+         atomic_load_explicit(&rb->head, memory_order_acquire);
+}
+
+static inline void spsc_copy_in(spsc_ring_t *rb, size_t pos, const void *src,
+                                size_t n) {
+  size_t off = pos & (rb->cap - 1);
+  size_t first = rb->cap - off < n ? rb->cap - off : n;
+  memcpy(rb->data + off, src, first);
+  memcpy(rb->data, (const char *)src + first, n - first);
+}
+
+static inline void spsc_copy_out(const spsc_ring_t *rb, size_t pos, void *dst,
+                                 size_t n) {
+  size_t off = pos & (rb->cap - 1);
+  size_t first = rb->cap - off < n ? rb->cap - off : n;
+  memcpy(dst, rb->data + off, first);
+  memcpy((char *)dst + first, rb->data, n - first);
+}
+
+// Producer only. Appends one record, all or nothing. Returns 0 on success,
+// -1 if it does not fit right now.
+static inline int spsc_push(spsc_ring_t *rb, const void *src, size_t n) {
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  if (rb->cap - (tail - head) < sizeof(size_t) + n) {
+    return -1;
+  }
+  spsc_copy_in(rb, tail, &n, sizeof(size_t));
+  spsc_copy_in(rb, tail + sizeof(size_t), src, n);
+  atomic_store_explicit(&rb->tail, tail + sizeof(size_t) + n,
+                        memory_order_release);
+  return 0;
+}
+
+// Consumer only. Copies the first `n` bytes (or fewer, if it is shorter) of
+// the oldest record into `dst` without popping it. Returns its length, or
+// -1 if empty.
+static inline long spsc_peek(spsc_ring_t *rb, void *dst, size_t n) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  if (head == tail) {
+    return -1;
+  }
+  size_t len;
+  spsc_copy_out(rb, head, &len, sizeof(size_t));
+  spsc_copy_out(rb, head + sizeof(size_t), dst, n < len ? n : len);
+  return (long)len;
+}
+
+// Consumer only. Pops the oldest record into `dst` (which must hold the
+// largest record ever pushed). Returns its length, or -1 if empty.
+static inline long spsc_pop(spsc_ring_t *rb, void *dst) {
+  size_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  if (head == tail) {
+    return -1;
+  }
+  size_t n;
+  spsc_copy_out(rb, head, &n, sizeof(size_t));
+  spsc_copy_out(rb, head + sizeof(size_t), dst, n);
+  atomic_store_explicit(&rb->head, head + sizeof(size_t) + n,
+                        memory_order_release);
+  return (long)n;
+}
+
+#endif // SPSC_H
@@ -0,0 +1,132 @@
+#ifndef STRMAP_H
+#define STRMAP_H
+
+// Open-addressing hash map from NUL-terminated string keys to pointers.
+// Keys are borrowed, not copied: each must stay valid and unchanged while
+// it is in the map (point them into the record the value refers to).
+// Linear probing at a load factor of at most 1/2, with backward-shift
+// deletion so lookups never wade through tombstones.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRMAP_INITIAL_CAP 16 // Power of two
+
+typedef struct {
+  const char *key; // NULL marks an empty slot
+  uint32_t hash;
+  void *value;
+} strmap_slot_t;
+
+typedef struct {
+  strmap_slot_t *slots;
+  size_t cap; // Power of two, or 0 before the first insert
+  size_t count;
+} strmap_t;
+
+// FNV-1a
+static inline uint32_t strmap_hash(const char *key) {
+  uint32_t h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    h = (h ^ *p) * 16777619u;
+  }
+  return h;
+}
+
+static inline void strmap_init(strmap_t *map) {
+  map->slots = NULL;
+  map->cap = 0;
+  map->count = 0;
+}
+
+static inline void strmap_free(strmap_t *map) {
+  free(map->slots);
+  strmap_init(map);
+}
+
+// Slot holding `key`, or the empty slot where it would go
+static inline strmap_slot_t *strmap_probe(const strmap_t *map, const char *key,
+                                          uint32_t hash) {
+  size_t mask = map->cap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    strmap_slot_t *slot = &map->slots[i];
+    if (slot->key == NULL ||
+        (slot->hash == hash && strcmp(slot->key, key) == 0)) {
+      return slot;
+    }
+  }
+}
+
+static inline void *strmap_get(const strmap_t *map, const char *key) {
+  if (map->count == 0) {
+    return NULL;
+  }
+  return strmap_probe(map, key, strmap_hash(key))->value;
+}
+
+// Rehashes into `cap` slots. Returns 0 on success, -1 if out of memory.
+static inline int strmap_resize(strmap_t *map, size_t cap) {
+  strmap_slot_t *slots = (strmap_slot_t *)calloc(cap, sizeof(strmap_slot_t));
+  if (slots == NULL) {
+    return -1;
+  }
+  strmap_t grown = {slots, cap, map->count};
+  for (size_t i = 0; i < map->cap; i++) {
+    if (map->slots[i].key != NULL) {
+      *strmap_probe(&grown, map->slots[i].key, map->slots[i].hash) =
+          map->slots[i];
+    }
+  }
+  free(map->slots);
+  *map = grown;
+  return 0;
+}
+
+// Inserts or replaces. Returns 0 on success, -1 if out of memory.
+static inline int strmap_put(strmap_t *map, const char *key, void *value) {
+  if ((map->count + 1) * 2 > map->cap &&
+      strmap_resize(map, map->cap ? map->cap * 2 : STRMAP_INITIAL_CAP) < 0) {
+    return -1;
+  }
+  uint32_t hash = strmap_hash(key);
+  strmap_slot_t *slot = strmap_probe(map, key, hash);
+  if (slot->key == NULL) {
+    map->count++;
+  }
+  slot->key = key;
+  slot->hash = hash;
+  slot->value = value;
+  return 0;
+}
+
+// Removes `key` if present and returns its value (NULL if absent)
+static inline void *strmap_remove(strmap_t *map, const char *key) {
+  if (map->count == 0) {
+    return NULL;
+  }
+  strmap_slot_t *slot = strmap_probe(map, key, strmap_hash(key));
+  if (slot->key == NULL) {
+    return NULL;
+  }
+  void *value = slot->value;
+  size_t mask = map->cap - 1;
+  size_t hole = (size_t)(slot - map->slots);
+  // Pull back later entries of the probe run that may no longer be
+  // reachable past the hole.
+  for (size_t i = (hole + 1) & mask; map->slots[i].key != NULL;
+       i = (i + 1) & mask) {
+    size_t home = map->slots[i].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      map->slots[hole] = map->slots[i];
+      hole = i;
+    }
+  }
+  map->slots[hole].key = NULL;
+  map->slots[hole].value = NULL;
+  map->count--;
+  return value;
+}
+
+#endif // STRMAP_H
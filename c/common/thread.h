@@ -0,0 +1,187 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+// Thin portability layer over POSIX threads / Win32 threads: just the
+// threads, mutexes, condition variables and CPU helpers the server needs.
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>   // For clock_gettime
+#include <unistd.h> // For sysconf
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#endif
+
+#include <stdlib.h>
+
+typedef void *(*thread_fn_t)(void *arg);
+
+#ifdef _WIN32
+typedef struct {
+  thread_fn_t fn;
+  void *arg;
+} thread_start_t;
+
+static DWORD WINAPI thread_trampoline(LPVOID param) {
+  thread_start_t start = *(thread_start_t *)param;
+  free(param);
+  start.fn(start.arg);
+  return 0;
+}
+#endif
+
+// Starts `fn(arg)` on a new thread. Returns 0 on success, -1 on error.
+static inline int thread_create(thread_t *thread, thread_fn_t fn, void *arg) {
+#ifdef _WIN32
+  thread_start_t *start = (thread_start_t *)malloc(sizeof(thread_start_t));
+  if (start == NULL) {
+    return -1;
+  }
+  start->fn = fn;
+  start->arg = arg;
+  *thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+  if (*thread == NULL) {
+    free(start);
+    return -1;
+  }
+  return 0;
+#else
+  return pthread_create(thread, NULL, fn, arg) == 0 ? 0 : -1;
+#endif
+}
+
+static inline void thread_join(thread_t thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+static inline void mutex_init(mutex_t *m) {
+#ifdef _WIN32
+  InitializeCriticalSection(m);
+#else
+  pthread_mutex_init(m, NULL);
+#endif
+}
+
+static inline void mutex_lock(mutex_t *m) {
+#ifdef _WIN32
+  EnterCriticalSection(m);
+#else
+  pthread_mutex_lock(m);
+#endif
+}
+
+static inline void mutex_unlock(mutex_t *m) {
+#ifdef _WIN32
+  LeaveCriticalSection(m);
+#else
+  pthread_mutex_unlock(m);
+#endif
+}
+
+static inline void mutex_destroy(mutex_t *m) {
+#ifdef _WIN32
+  DeleteCriticalSection(m);
+#else
+  pthread_mutex_destroy(m);
+#endif
+}
+
+static inline void cond_init(cond_t *c) {
+#ifdef _WIN32
+  InitializeConditionVariable(c);
+#else
+  pthread_cond_init(c, NULL);
+#endif
+}
+
+static inline void cond_signal(cond_t *c) {
+#ifdef _WIN32
+  WakeConditionVariable(c);
+#else
+  pthread_cond_signal(c);
+#endif
+}
+
+// Waits on `c` with `m` held, for at most `ms` milliseconds. Spurious
+// wakeups are possible, so callers re-check their condition.
+static inline void cond_wait_ms(cond_t *c, mutex_t *m, int ms) {
+#ifdef _WIN32
+  SleepConditionVariableCS(c, m, (DWORD)ms);
+#else
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(c, m, &deadline);
+#endif
+}
+
+static inline void cond_destroy(cond_t *c) {
+#ifdef _WIN32
+  (void)c; // Win32 condition variables need no cleanup
+#else
+  pthread_cond_destroy(c);
+#endif
+}
+
+static inline void thread_sleep_ms(int ms) {
+#ifdef _WIN32
+  Sleep((DWORD)ms);
+#else
+  struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+#endif
+}
+
+// Number of online CPUs (at least 1)
+static inline int cpu_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+// Pins the calling thread to one CPU. Returns 0 on success, -1 if pinning
+// failed or is unsupported on this platform.
+// On Linux this needs _GNU_SOURCE defined before the first #include.
+static inline int thread_pin_to_cpu(int cpu) {
+#ifdef _WIN32
+  return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0
+             ? 0
+             : -1;
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0
+                                                                         : -1;
+#else
+  (void)cpu;
+  return -1;
+#endif
+}
+
+#endif // THREAD_H
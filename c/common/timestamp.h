@@ -0,0 +1,86 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+// Wall-clock stamp formatting with a per-caller cache: localtime() and
+// strftime() run only when the second changes, every other call is a
+// clock read and a memcpy(). Optional millisecond/microsecond fractions
+// and a monotonic "seconds since start" suffix for ordering and latency
+// work across wall-clock jumps.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h> // QueryPerformanceCounter
+#endif
+
+typedef enum {
+  TS_PRECISION_SEC,
+  TS_PRECISION_MS,
+  TS_PRECISION_US,
+} ts_precision_t;
+
+// Formatted "YYYY-MM-DD HH:MM:SS" for one second. Keep one per thread.
+typedef struct {
+  time_t sec; // Second `text` is for; 0 = nothing cached yet
+  char text[24];
+  size_t len;
+} ts_cache_t;
+
+static inline void ts_wall_now(struct timespec *ts) {
+  timespec_get(ts, TIME_UTC);
+}
+
+static inline void ts_monotonic_now(struct timespec *ts) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  ts->tv_sec = (time_t)(count.QuadPart / freq.QuadPart);
+  ts->tv_nsec =
+      (long)((count.QuadPart % freq.QuadPart) * 1000000000LL / freq.QuadPart);
+#else
+  clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
+
+// Writes the local time of `now` at `precision` into `buf`. Returns the
+// length written (excluding the NUL), truncated to fit `cap`.
+static inline size_t ts_format(ts_cache_t *cache, const struct timespec *now,
+                               ts_precision_t precision, char *buf,
+                               size_t cap) {
+  if (cap == 0) {
+    return 0;
+  }
+  if (cache->sec != now->tv_sec || cache->len == 0) {
+    struct tm tm_now;
+#ifdef _WIN32
+    localtime_s(&tm_now, &now->tv_sec);
+#else
+    localtime_r(&now->tv_sec, &tm_now);
+#endif
+    cache->len = strftime(cache->text, sizeof(cache->text),
+                          "%Y-%m-%d %H:%M:%S", &tm_now);
+    cache->sec = now->tv_sec;
+  }
+  size_t len = cache->len < cap - 1 ? cache->len : cap - 1;
+  memcpy(buf, cache->text, len);
+  int n = 0;
+  if (precision == TS_PRECISION_MS) {
+    n = snprintf(buf + len, cap - len, ".%03ld", now->tv_nsec / 1000000L);
+  } else if (precision == TS_PRECISION_US) {
+    n = snprintf(buf + len, cap - len, ".%06ld", now->tv_nsec / 1000L);
+  } else {
+    buf[len] = '\0';
+  }
+  if (n > 0) {
+    len += (size_t)n < cap - len ? (size_t)n : cap - len - 1;
+  }
+  return len;
+}
+
+#endif // TIMESTAMP_H
@@ -0,0 +1,53 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+// Token bucket rate limiting: tokens accrue at `rate` per second up to
+// `burst`, and each admitted event takes one. A bucket only records its
+// level and when that was last brought up to date, so many buckets that
+// share a limit (one per client address, say) can share one rate and
+// burst. Times are seconds on any monotonic clock.
+//
+// Not thread-safe: callers serialize access with their own lock.
+
+typedef struct {
+  double tokens;
+  double last; // When `tokens` was last brought up to date
+} token_bucket_t;
+
+// Starts `b` full
+static inline void tb_init(token_bucket_t *b, double burst, double now) {
+  b->tokens = burst;
+  b->last = now;
+}
+
+// Adds the tokens accrued since the last update
+static inline void tb_refill(token_bucket_t *b, double rate, double burst,
+                             double now) {
+  if (now > b->last) {
+    b->tokens += (now - b->last) * rate;
+    if (b->tokens > burst) {
+      b->tokens = burst;
+    }
+  }
+  b->last = now;
+}
+
+// Takes a token if one is available. Returns 1 if it did, 0 if not.
+static inline int tb_take(token_bucket_t *b, double rate, double burst,
+                          double now) {
+  tb_refill(b, rate, burst, now);
+  if (b->tokens < 1.0) {
+    return 0;
+  }
+  b->tokens -= 1.0;
+  return 1;
+}
+
+// Seconds, as of the last update, until an event queued behind `n` others
+// could take a token (0 if it could now)
+static inline double tb_wait(const token_bucket_t *b, double rate, double n) {
+  double missing = n + 1.0 - b->tokens;
+  return missing > 0 ? missing / rate : 0;
+}
+
+#endif // TOKENBUCKET_H
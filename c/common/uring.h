@@ -0,0 +1,329 @@
+#ifndef URING_H
+#define URING_H
+
+// Minimal io_uring wrapper built directly on the raw syscalls (no liburing
+// dependency). It covers exactly what the server's io_uring mode needs:
+// ring setup, SQE/CQE access, and a provided-buffer ring for multishot recv.
+// On non-Linux platforms URING_AVAILABLE is 0 and nothing here is compiled.
+//
+// Translation units including this header on Linux must define _GNU_SOURCE
+// (or _DEFAULT_SOURCE) before their first #include when built with -std=c11,
+// so that syscall() and MAP_ANONYMOUS are declared.
+
+#if defined(__linux__)
+#define URING_AVAILABLE 1
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+  int ring_fd;
+  unsigned features;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail; // Local tail: SQEs handed out but not yet published
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring_ptr;
+  size_t sq_ring_len;
+  void *cq_ring_ptr;
+  size_t cq_ring_len;
+  size_t sqes_len;
+} uring_t;
+
+// Kernel-shared ring of buffers the kernel picks from for BUFFER_SELECT recv
+typedef struct {
+  struct io_uring_buf_ring *ring;
+  size_t ring_len;
+  char *buffers;
+  unsigned entries; // Power of two
+  unsigned buf_size;
+  unsigned short bgid;
+  unsigned short tail;
+} uring_buf_ring_t;
+
+static inline int uring_sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_sys_enter(int fd, unsigned to_submit,
+                                  unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static inline int uring_sys_register(int fd, unsigned opcode, void *arg,
+                                     unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline void uring_close(uring_t *u) {
+  if (u->sqes != NULL && u->sqes != MAP_FAILED)
+    munmap(u->sqes, u->sqes_len);
+  if (u->cq_ring_ptr != NULL && u->cq_ring_ptr != MAP_FAILED &&
+      u->cq_ring_ptr != u->sq_ring_ptr)
+    munmap(u->cq_ring_ptr, u->cq_ring_len);
+  if (u->sq_ring_ptr != NULL && u->sq_ring_ptr != MAP_FAILED)
+    munmap(u->sq_ring_ptr, u->sq_ring_len);
+  if (u->ring_fd >= 0)
+    close(u->ring_fd);
+  memset(u, 0, sizeof(*u));
+  u->ring_fd = -1;
+}
+
+// Creates a ring with (at least) `entries` SQEs.
+// Returns 0 on success or a negative errno.
+static inline int uring_init(uring_t *u, unsigned entries) {
+  struct io_uring_params p;
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CLAMP;
+
+  u->ring_fd = uring_sys_setup(entries, &p);
+  if (u->ring_fd < 0) {
+    u->ring_fd = -1;
+    return -errno;
+  }
+  u->features = p.features;
+
+  u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_len > u->sq_ring_len)
+      u->sq_ring_len = u->cq_ring_len;
+    u->cq_ring_len = u->sq_ring_len;
+  }
+
+  u->sq_ring_ptr = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                        IORING_OFF_SQ_RING);
+  if (u->sq_ring_ptr == MAP_FAILED) {
+    int err = -errno;
+    uring_close(u);
+    return err;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring_ptr = u->sq_ring_ptr;
+  } else {
+    u->cq_ring_ptr = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                          IORING_OFF_CQ_RING);
+    if (u->cq_ring_ptr == MAP_FAILED) {
+      int err = -errno;
+      uring_close(u);
+      return err;
+    }
+  }
+
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, u->ring_fd,
+                                        IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    int err = -errno;
+    uring_close(u);
+    return err;
+  }
+
+  char *sq = (char *)u->sq_ring_ptr;
+  char *cq = (char *)u->cq_ring_ptr;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+  u->sqe_tail = *u->sq_tail;
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // Identity-map the SQ index array once; SQEs are always used in order.
+  unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < u->sq_entries; i++)
+    sq_array[i] = i;
+  return 0;
+}
+
+// Number of SQEs that can still be handed out before a submit is needed
+static inline unsigned uring_sq_space_left(const uring_t *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  return u->sq_entries - (u->sqe_tail - head);
+}
+
+// Returns a zeroed SQE, or NULL if the submission queue is full.
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+  if (uring_sq_space_left(u) == 0)
+    return NULL;
+  struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+  u->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// Publishes pending SQEs and optionally waits for `wait_nr` completions.
+// Returns the number of SQEs consumed or a negative errno.
+static inline int uring_submit(uring_t *u, unsigned wait_nr) {
+  unsigned published = *u->sq_tail;
+  unsigned to_submit = u->sqe_tail - published;
+  __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+  if (to_submit == 0 && wait_nr == 0)
+    return 0;
+  int ret = uring_sys_enter(u->ring_fd, to_submit, wait_nr,
+                            wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  return ret < 0 ? -errno : ret;
+}
+
+// Returns the next completion without consuming it, or NULL if none.
+static inline struct io_uring_cqe *uring_peek_cqe(uring_t *u) {
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return NULL;
+  return &u->cqes[head & u->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// --- SQE preparation helpers ---
+
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe,
+                                               int listen_fd) {
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+                                             unsigned short bgid) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bgid;
+}
+
+static inline void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd,
+                                             unsigned poll_mask) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = poll_mask;
+}
+
+// Completes with -ETIME once `ts` has elapsed. `ts` must stay valid until
+// the SQE is submitted.
+static inline void uring_prep_timeout(struct io_uring_sqe *sqe,
+                                      struct __kernel_timespec *ts) {
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long long)(uintptr_t)ts;
+  sqe->len = 1;
+}
+
+// `msg` and the buffers it lists must stay valid until the send completes
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                                      const struct msghdr *msg, int flags) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long long)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = (unsigned)flags;
+}
+
+// --- Provided buffer rings ---
+
+// Hands buffer `bid` back to the kernel. Call uring_buf_ring_publish() after
+// a batch of returns to make them visible.
+static inline void uring_buf_ring_add(uring_buf_ring_t *br,
+                                      unsigned short bid) {
+  struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+  buf->addr = (unsigned long long)(uintptr_t)(br->buffers +
+                                              (size_t)bid * br->buf_size);
+  buf->len = br->buf_size;
+  buf->bid = bid;
+  br->tail++;
+}
+
+static inline void uring_buf_ring_publish(uring_buf_ring_t *br) {
+  __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+static inline char *uring_buf_ring_data(const uring_buf_ring_t *br,
+                                        unsigned short bid) {
+  return br->buffers + (size_t)bid * br->buf_size;
+}
+
+// Allocates `entries` buffers of `buf_size` bytes and registers them with the
+// ring as buffer group `bgid` (Linux 5.19+). Returns 0 or a negative errno.
+static inline int uring_buf_ring_setup(uring_t *u, uring_buf_ring_t *br,
+                                       unsigned short bgid, unsigned entries,
+                                       unsigned buf_size) {
+  memset(br, 0, sizeof(*br));
+  br->ring_len = entries * sizeof(struct io_uring_buf);
+  void *mem = mmap(NULL, br->ring_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return -errno;
+  br->ring = (struct io_uring_buf_ring *)mem;
+  br->buffers = (char *)malloc((size_t)entries * buf_size);
+  if (br->buffers == NULL) {
+    munmap(mem, br->ring_len);
+    br->ring = NULL;
+    return -ENOMEM;
+  }
+  br->entries = entries;
+  br->buf_size = buf_size;
+  br->bgid = bgid;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long long)(uintptr_t)mem;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (uring_sys_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = -errno;
+    free(br->buffers);
+    munmap(mem, br->ring_len);
+    memset(br, 0, sizeof(*br));
+    return err;
+  }
+
+  for (unsigned i = 0; i < entries; i++)
+    uring_buf_ring_add(br, (unsigned short)i);
+  uring_buf_ring_publish(br);
+  return 0;
+}
+
+static inline void uring_buf_ring_free(uring_buf_ring_t *br) {
+  if (br->ring != NULL)
+    munmap(br->ring, br->ring_len);
+  free(br->buffers);
+  memset(br, 0, sizeof(*br));
+}
+
+#else
+#define URING_AVAILABLE 0
+#endif // __linux__
+
+#endif // URING_H
@@ -0,0 +1,88 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+// Binary framing, offered as an alternative to newline-terminated text.
+// After REQ_USERNAME the client sends "BINARY"; the server answers
+// "BINARY_OK" and from then on both sides exchange frames: a fixed header
+// (fields big-endian) followed by `len` bytes of payload.
+//
+//   uint32 len     Payload length, at most WIRE_MAX_PAYLOAD
+//   uint8  op      wire_op_t
+//   uint8  pad[3]  Zero
+//   uint32 id      User or group the op refers to, or WIRE_NO_ID
+//   uint64 seq     Chat log record number (server to client), or 0
+//
+// Payloads are text without a trailing newline and may contain newlines.
+// Users and groups are addressed by small ids the server assigns for the
+// lifetime of its process; WIRE_OP_LOOKUP_* map names to them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIRE_HEADER_SIZE 20
+#define WIRE_MAX_PAYLOAD 2048
+#define WIRE_NO_ID 0xFFFFFFFFu
+
+typedef enum {
+  WIRE_OP_LINE = 1,     // Both ways: one text-protocol line
+  WIRE_OP_LOGIN,        // Client: username
+  WIRE_OP_SAY,          // Client: message to everyone
+  WIRE_OP_DM,           // Client: direct message to user `id`
+  WIRE_OP_GROUPMSG,     // Client: message to group `id`
+  WIRE_OP_LOOKUP_USER,  // Client: username, answered by WIRE_OP_USER_ID
+  WIRE_OP_LOOKUP_GROUP, // Client: group name, answered by WIRE_OP_GROUP_ID
+  WIRE_OP_USER_ID,      // Server: `id` of the user named in the payload
+  WIRE_OP_GROUP_ID,     // Server: `id` of the group named in the payload
+} wire_op_t;
+
+typedef struct {
+  uint32_t len;
+  uint8_t op;
+  uint32_t id;
+  uint64_t seq;
+} wire_header_t;
+
+static inline void wire_put_u32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static inline uint32_t wire_get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+static inline void wire_encode_header(unsigned char *dst,
+                                      const wire_header_t *h) {
+  wire_put_u32(dst, h->len);
+  dst[4] = h->op;
+  dst[5] = dst[6] = dst[7] = 0;
+  wire_put_u32(dst + 8, h->id);
+  wire_put_u32(dst + 12, (uint32_t)(h->seq >> 32));
+  wire_put_u32(dst + 16, (uint32_t)h->seq);
+}
+
+static inline void wire_decode_header(const unsigned char *src,
+                                      wire_header_t *h) {
+  h->len = wire_get_u32(src);
+  h->op = src[4];
+  h->id = wire_get_u32(src + 8);
+  h->seq = (uint64_t)wire_get_u32(src + 12) << 32 | wire_get_u32(src + 16);
+}
+
+// Writes a whole frame into `dst`, which must hold WIRE_HEADER_SIZE + len
+// bytes. Returns its size.
+static inline size_t wire_encode_frame(unsigned char *dst, uint8_t op,
+                                       uint32_t id, uint64_t seq,
+                                       const char *payload, size_t len) {
+  wire_header_t h = {(uint32_t)len, op, id, seq};
+  wire_encode_header(dst, &h);
+  for (size_t k = 0; k < len; k++) {
+    dst[WIRE_HEADER_SIZE + k] = (unsigned char)payload[k];
+  }
+  return WIRE_HEADER_SIZE + len;
+}
+
+#endif // WIRE_H
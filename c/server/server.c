@@ -1,5 +1,24 @@
+#ifndef _WIN32
+#define _GNU_SOURCE // syscall(), MAP_ANONYMOUS etc. under -std=c11
+#endif
+
+#include "cmdparse.h" // Zero-copy command tokens
+#include "dmstore.h"  // Offline DM mailboxes
+#include "mphash.h"  // Allowlist and verb lookups
+#include "mpsc.h"    // Cross-shard mailboxes
+#include "reactor.h" // epoll on Linux, select() elsewhere
+#include "ringbuf.h" // Per-connection input buffering
+#include "seglog.h"  // Segmented chat log with a sparse index
 #include "sockets.h"
+#include "spsc.h"   // Chat log records to the writer thread
+#include "strmap.h" // Username lookups
+#include "thread.h"
+#include "timestamp.h" // Cached log/message stamps
+#include "tokenbucket.h" // Login admission control
+#include "uring.h" // Optional io_uring mode (Linux only)
+#include "wire.h"  // Binary framing
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,45 +27,350 @@
 #ifdef _WIN32
 // winsock2.h (included via sockets.h) should be sufficient for select on
 // Windows
+#include <io.h> // _commit()
 #else
-#include <sys/time.h> // For fd_set, select, FD_ZERO, FD_SET, FD_CLR, FD_ISSET
+#include <sys/resource.h> // getrlimit(RLIMIT_NOFILE)
 #include <sys/types.h>
-// #include <unistd.h> // Not strictly needed for this example yet
+#include <unistd.h> // fdatasync()
+#endif
+
+#if defined(__linux__)
+#include <poll.h>        // POLLIN for the io_uring mailbox poll
+#include <sys/eventfd.h> // Mailbox wakeups
+#endif
+
+// Several reactor threads need the kernel to spread connections over
+// per-thread listeners, i.e. SO_REUSEPORT.
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+#define SERVER_HAVE_SHARDS 1
+#else
+#define SERVER_HAVE_SHARDS 0
+#endif
+
+#ifdef MSG_NOSIGNAL
+// Don't die on SIGPIPE if a peer vanishes
+#define SERVER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SERVER_SEND_FLAGS 0
 #endif
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
-#define MAX_CLIENTS 30
+#define MESSAGE_MAX WIRE_MAX_PAYLOAD // Longest chat text; text lines stop
+                                     // at BUFFER_SIZE
+#define CLIENT_TABLE_INITIAL 32 // First allocation of a shard's client table
+#define FD_RESERVE 32 // Descriptors kept back for listeners, logs, etc.
 #define USERNAME_MAX_LEN 50
-#define CHAT_LOG_FILE "chat_log.txt"
+#define CHAT_LOG_DIR "chat_log"
+#define MAILBOX_DIR "mailboxes"
 #define MAX_HISTORY_LINES 20
+// Who a logged line is for, ahead of its stamp: "D<n>:<from><n>:<to> "
+#define LOG_SCOPE_MAX (2 * USERNAME_MAX_LEN + 16)
+// Longest logged line: scope, timestamp, the longest message format,
+// newline
+#define HISTORY_LINE_MAX                                                       \
+  (LOG_SCOPE_MAX + MESSAGE_MAX + 2 * USERNAME_MAX_LEN + GROUPNAME_MAX_LEN + 64)
 #define ALLOWED_USERS_FILE "confg/users.txt" // Using your filename
-#define MAX_ALLOWED_USERS 100
 #define GROUPS_FILE "config/groups.txt" // New
 #define MAX_GROUPS 20                   // Max number of groups
 #define MAX_MEMBERS_PER_GROUP 20        // Max members per group definition
 #define GROUPNAME_MAX_LEN 50 // Matches USERNAME_MAX_LEN for simplicity
+#define MAX_EVENTS 64        // Max readiness events handled per wakeup
+#define URING_ENTRIES 256    // io_uring submission queue size
+#define URING_NUM_BUFS 256   // Provided recv buffers (power of two)
+#define URING_BUF_GROUP 1    // Buffer group id for multishot recv
+#define URING_MAX_CHAIN 32   // Max linked sends per client per submit
+#define MAX_SHARDS 64        // Upper bound for --threads
+#define INBOUND_BUFFER_SIZE 4096 // Per-client input ring (power of two)
+#define SEND_HWM_DEFAULT (256 * 1024) // Default per-client output limit
+#define SEND_HARD_LIMIT_FACTOR 4 // Backlog (x limit) that always disconnects
+#define SLOW_TIMEOUT_DEFAULT 10  // Seconds over the limit before disconnect
+#define STATS_INTERVAL 10        // Seconds between counter reports
+#define LISTEN_BACKLOG_DEFAULT SOMAXCONN // The kernel may cap it further
+#define ACCEPT_BATCH_MAX 256 // Connections accepted per listener wakeup
+#define LOGIN_RATE_DEFAULT 100 // Logins per second over all shards
+#define LOGIN_BURST_DEFAULT 200
+#define LOGIN_QUEUE_DEFAULT 1024 // Logins waiting for a token, all shards
+#define IP_RATE_DEFAULT 20 // Connections per second from one address
+#define IP_BURST_DEFAULT 50
+#define IP_BUCKETS 4096   // Addresses tracked for --ip-rate (power of two)
+#define IP_BUCKET_PROBE 8 // Table slots an address may occupy
+#define TICK_INTERVAL_MS 1000    // Housekeeping wakeup period
+#define ADMIT_INTERVAL_MS 20 // Wakeup period while logins are queued or
+                             // RESUME replays wait for the log writer
+#define LOG_BUFFER_SIZE (64 * 1024) // Chat log stdio buffer
+#define LOG_RING_SIZE (1024 * 1024) // Per-shard queue to the log writer
+#define LOG_SYNC_INTERVAL_DEFAULT 1 // Seconds between periodic syncs
+#define LOG_BLOCK_SLEEP_MS 1        // Retry period with --log-full block
+#define STAMP_MAX_LEN 48 // Longest stamp: date, time, fraction, monotonic
+#define LOG_SEGMENT_SIZE_DEFAULT (16 * 1024 * 1024)
+#define HISTORY_MAX_COUNT 500     // Lines per HISTORY request
+#define HISTORY_STREAMS_MAX 16    // HISTORY requests served at once per shard
+#define HISTORY_CHUNK_BYTES 16384 // Sent per stream per loop pass
+#define HISTORY_PUMP_RECORDS 64   // Read per stream per loop pass
+#define SEQ_TAG_MAX 24 // "#<seq> " before logged lines, for want_seq clients
+#define OUT_PREFIX_MAX SEQ_TAG_MAX // Per-recipient bytes before a shared buf
+#define SEND_IOV_MAX 64 // Buffers gathered per send call (two per message)
+#define GROUP_HISTORY_SCAN 4096 // Records read at startup for group rings
+#define MAILBOX_SIZE_DEFAULT (64 * 1024) // Bytes of stored DMs per user
+#define MAILBOX_EXPIRE_DAYS_DEFAULT 30
+
+// A client's input ring never holds more than one partial line (at most
+// BUFFER_SIZE - 1 bytes), so a full recv buffer always fits behind it.
+_Static_assert(INBOUND_BUFFER_SIZE >= 2 * BUFFER_SIZE,
+               "inbound ring must hold a partial line plus one read");
+// Likewise for binary clients, with a partial frame
+_Static_assert(INBOUND_BUFFER_SIZE >=
+                   WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD + BUFFER_SIZE,
+               "inbound ring must hold a partial frame plus one read");
+_Static_assert(OUT_PREFIX_MAX >= WIRE_HEADER_SIZE,
+               "a queued message's prefix must hold a frame header");
+
+// Immutable payload shared by every queued send of the same message
+typedef struct {
+  int refs;
+  size_t len;
+  char data[];
+} send_buf_t;
+
+// One message waiting in (or, with io_uring, in flight from) a client's
+// outbound queue: a few bytes of its own (a record tag or frame header)
+// followed by the first `len` bytes of a shared buffer
+typedef struct out_msg {
+  struct out_msg *next;
+  struct out_msg *prev;         // While queued; NULL at the head
+  struct out_msg *next_chatter; // Next queued chatter, if this is chatter
+  send_buf_t *buf;
+  size_t len;
+  char prefix[OUT_PREFIX_MAX];
+  size_t prefix_len;
+  int slot;
+  unsigned generation;
+  int chatter; // Global/group traffic the slow-consumer policy may discard
+} out_msg_t;
+
+#if URING_AVAILABLE
+// io_uring mode: one IORING_OP_SENDMSG for `count` consecutive queued
+// messages, from `first` on through their `next` links
+typedef struct {
+  struct msghdr msg;
+  out_msg_t *first;
+  int count;
+  struct iovec iov[SEND_IOV_MAX];
+} uring_send_t;
+#endif
+
+// What to do with a client whose unsent output passes its limit
+typedef enum {
+  SLOW_POLICY_DISCONNECT,  // Keep queueing; disconnect after T seconds
+  SLOW_POLICY_DROP_OLDEST, // Drop the oldest queued chatter, keep DMs
+  SLOW_POLICY_COLLAPSE,    // Drop all chatter, later say how much was missed
+} slow_policy_t;
+
+// The most recent log lines, kept in memory so logins can replay them
+// without touching the log file. Guarded by g_log_mutex.
+typedef struct {
+  char lines[MAX_HISTORY_LINES][HISTORY_LINE_MAX];
+  size_t lens[MAX_HISTORY_LINES];
+  uint64_t seqs[MAX_HISTORY_LINES]; // Record numbers; 0 if never logged
+  int next;  // Slot the next line goes into
+  int count; // Lines held, up to MAX_HISTORY_LINES
+} history_ring_t;
+
+// Structure for group information
+typedef struct {
+  char name[GROUPNAME_MAX_LEN];
+  char members[MAX_MEMBERS_PER_GROUP][USERNAME_MAX_LEN];
+  int num_members;
+  history_ring_t history; // Recent messages to the group, replayed to
+                          // members at login
+} group_info_t;
+
+// The groups one user belongs to, built by load_groups()
+typedef struct {
+  char username[USERNAME_MAX_LEN]; // Key in g_member_groups
+  int num_groups;
+  int groups[MAX_GROUPS]; // Indices into g_groups
+} member_groups_t;
+
+// Logged-in sessions of one group's members on one shard
+typedef struct {
+  int *slots; // Sized like the client table, so adding never fails
+  int count;
+} group_online_t;
 
 // Structure to hold client information
 typedef struct {
+  int slot;      // Index in the shard's client table (the client's handle)
+  int next_free; // Next free slot while this one is unused, or -1
+  int active_pos; // Position in the shard's active_slots while active
+  int name_next;  // Next local session with the same username, or -1
+  const member_groups_t *groups; // Groups of this user while active, or NULL
+  int group_pos[MAX_GROUPS]; // Position in each of those groups' online list
   socket_t socket;
   char username[USERNAME_MAX_LEN];
   struct sockaddr_in address;
   int active; // 0 if slot is free/pending username, 1 if fully active
+  unsigned generation; // Bumped each time the slot is reused
+  ringbuf_t inbound;     // Received bytes not yet framed into lines
+  size_t inbound_scanned; // Leading bytes of `inbound` known to have no '\n'
+  int discarding_line;    // Dropping the rest of an over-long line
+  // Outbound queue. The reactor writes from the head as far as the socket
+  // allows; io_uring submits it as linked chains, one chain at a time.
+  out_msg_t *out_head;
+  out_msg_t *out_tail;
+  // The queued chatter, oldest first, so the slow-consumer policy can drop
+  // it without walking past the DMs and replies in between
+  out_msg_t *chatter_head;
+  out_msg_t *chatter_tail;
+  size_t out_offset;   // Bytes of out_head already written (reactor mode)
+  size_t out_bytes;    // Queued bytes not yet written, in-flight included
+  size_t out_limit;    // Backlog at which the slow-consumer policy kicks in
+  time_t over_limit_since; // When out_bytes passed out_limit, or 0
+  unsigned long missed;    // Chatter collapsed since the last marker
+  int out_overflow;    // To be disconnected as a slow consumer at next flush
+  int want_write;      // Registered for write readiness (reactor mode)
+  int sends_in_flight; // io_uring mode
+  int closing;     // Socket is closed once in-flight sends finish
+  int send_queued; // Listed in the shard's out_dirty
+  int corked;      // Assembling a burst (the login replies): queue, don't write
+  int login_pending; // Username accepted, waiting in the shard's login queue
+  // Record numbers (see log_message()). With want_seq every logged line
+  // is sent as "#<seq> <line>"; RESUME <seq> in the handshake turns it on
+  // and asks for what was logged after <seq> instead of recent history.
+  int want_seq;
+  int binary; // Exchanges wire.h frames instead of lines; implies want_seq
+  uint64_t resume_after; // 0: no RESUME position
+  // Records below this were replayed at login. UINT64_MAX while the RESUME
+  // replay streams: it goes on to cover what is logged meanwhile.
+  uint64_t seq_floor;
+  // HISTORY request being streamed from the log (history.file != NULL),
+  // or the RESUME replay (resuming; the file is opened once there is
+  // something flushed to read)
+  seglog_reader_t history;
+  uint64_t history_end; // Stream stops before this record
+  unsigned long history_skipped; // Records in it this client may not see
+  int resuming;
 } client_info_t;
 
-// Structure for group information
+// When the chat log is forced to stable storage. The writer thread hands
+// everything it drained in one pass to the kernel at once (group commit).
+typedef enum {
+  LOG_SYNC_NONE,     // Leave it to the OS
+  LOG_SYNC_PERIODIC, // fdatasync() every --log-sync-interval seconds
+  LOG_SYNC_BATCH,    // fdatasync() after every group commit
+} log_sync_t;
+
+// What a shard does with a log record when its ring to the writer is full
+typedef enum {
+  LOG_FULL_DROP,  // Count it and move on; it stays in the history ring
+  LOG_FULL_BLOCK, // Wait for the writer to make room
+  LOG_FULL_SPILL, // Park it in memory until there is room
+} log_full_t;
+
+// Header of a record on its way to the writer; the line follows it
 typedef struct {
-  char name[GROUPNAME_MAX_LEN];
-  char members[MAX_MEMBERS_PER_GROUP][USERNAME_MAX_LEN];
-  int num_members;
-} group_info_t;
+  uint64_t seq; // Its number in the log
+  int64_t time; // When it was logged
+} log_record_t;
+
+// A logged line's scope, split off by log_scope_parse()
+typedef struct {
+  char kind; // '*' (everyone), 'D' (a DM), 'G' (a group); 0 if it has none
+  const char *names[2]; // DM: sender and recipient; group: its name
+  size_t lens[2];
+  size_t body; // Offset of the stamp
+} log_scope_t;
+
+// A record parked by LOG_FULL_SPILL
+typedef struct log_spill {
+  struct log_spill *next;
+  size_t len;
+  char data[]; // log_record_t and line
+} log_spill_t;
+
+// The chat log writer thread. `seg` and the sync state belong to the
+// thread itself; `mutex` guards the wakeup handshake. Records are numbered
+// under g_log_mutex, which also guards `next_seq` and the spill list.
+typedef struct {
+  seglog_t seg;
+  uint64_t next_seq; // Number for the next record queued
+  log_spill_t *spill_head; // Waiting for ring space (LOG_FULL_SPILL)
+  log_spill_t *spill_tail;
+  atomic_size_t spill_bytes;
+  int unsynced; // Written but not yet synced
+  time_t last_sync;
+  thread_t thread;
+  mutex_t mutex;
+  cond_t wake;
+  int wake_pending; // Records were pushed since the writer last looked
+  int stop;
+} log_writer_t;
+
+// Work for the mailbox thread, which alone reads and writes the offline
+// DM mailboxes
+typedef enum {
+  MAIL_JOB_STORE, // Keep `text` for `user`, unless they came online
+  MAIL_JOB_TAKE,  // Send what is kept for `user` to their new session
+  MAIL_JOB_DROP,  // That was queued for them: delete the first `size` bytes
+} mail_job_type_t;
+
+typedef struct {
+  mpsc_node_t node; // Must stay first
+  mail_job_type_t type;
+  char user[USERNAME_MAX_LEN]; // Whose mailbox
+  // Session to answer: the sender of a STORE (shard -1: nobody), or the
+  // one a TAKE is for
+  int shard;
+  int slot;
+  unsigned generation;
+  uint64_t seq; // STORE: record number of `text`
+  long size;    // DROP: mailbox bytes delivered
+  char text[];  // STORE: the DM as the recipient would see it
+} mail_job_t;
+
+// The mailbox thread. Shards queue jobs on `jobs`; `mutex` guards the
+// wakeup handshake, as for the log writer.
+typedef struct {
+  mpsc_queue_t jobs;
+  thread_t thread;
+  mutex_t mutex;
+  cond_t wake;
+  int wake_pending;
+  int stop;
+} mail_worker_t;
 
 // Global arrays
-char g_allowed_usernames[MAX_ALLOWED_USERS][USERNAME_MAX_LEN];
-int g_num_allowed_users = 0;
+char *g_allowed_names = NULL; // Contents of the users file, NUL-separated
+mph_set_t g_allowed_users;     // Keys point into g_allowed_names
 group_info_t g_groups[MAX_GROUPS];
 int g_num_groups = 0;
+strmap_t g_group_index;   // Group name -> group_info_t
+strmap_t g_member_groups; // Username -> member_groups_t
+mutex_t g_log_mutex; // Guards the history ring and record numbering
+history_ring_t g_history;
+log_writer_t g_log;
+log_sync_t g_log_sync = LOG_SYNC_NONE;
+int g_log_sync_interval = LOG_SYNC_INTERVAL_DEFAULT;
+log_full_t g_log_full = LOG_FULL_SPILL;
+const char *g_log_dir = CHAT_LOG_DIR;
+long g_log_segment_size = LOG_SEGMENT_SIZE_DEFAULT;
+int g_log_rotate_daily = 0;
+int g_log_retain_segments = 0; // 0 = keep all
+int g_log_retain_days = 0;     // 0 = keep all
+dmstore_t g_mailboxes; // DMs waiting for offline users
+mail_worker_t g_mail;  // Alone touches g_mailboxes once started
+const char *g_mailbox_dir = MAILBOX_DIR;
+long g_mailbox_size = MAILBOX_SIZE_DEFAULT;
+int g_mailbox_expire_days = MAILBOX_EXPIRE_DAYS_DEFAULT; // 0 = never
+ts_precision_t g_stamp_precision = TS_PRECISION_SEC;
+int g_stamp_monotonic = 0;    // Append seconds since startup to stamps
+struct timespec g_mono_start; // Monotonic clock at startup
+_Thread_local ts_cache_t t_stamp_cache; // Each thread formats on its own
+size_t g_send_hwm = SEND_HWM_DEFAULT; // Default out_limit for new clients
+int g_listen_backlog = LISTEN_BACKLOG_DEFAULT;
+slow_policy_t g_slow_policy = SLOW_POLICY_DISCONNECT;
+int g_slow_timeout = SLOW_TIMEOUT_DEFAULT; // Seconds, for the disconnect policy
 
 // Helper function to duplicate a string (like POSIX strdup)
 char *my_strdup(const char *s) {
@@ -63,65 +387,302 @@ char *my_strdup(const char *s) {
   return new_s;
 }
 
-// Function to get current timestamp as string
-void get_timestamp(char *ts_buffer, size_t len) {
-  time_t rawtime;
-  struct tm *timeinfo;
-  time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  strftime(ts_buffer, len, "%Y-%m-%d %H:%M:%S", timeinfo);
+// Formats the current time for log lines and server-stamped messages:
+// local date and time at --stamp precision, plus " +SECS.USEC" since
+// startup with --stamp-monotonic. The date part is reformatted only when
+// the second changes. Returns the length.
+size_t format_stamp(const struct timespec *now, char *buf, size_t len) {
+  size_t n = ts_format(&t_stamp_cache, now, g_stamp_precision, buf, len);
+  if (g_stamp_monotonic && n < len) {
+    struct timespec mono;
+    ts_monotonic_now(&mono);
+    long sec = (long)(mono.tv_sec - g_mono_start.tv_sec);
+    long nsec = mono.tv_nsec - g_mono_start.tv_nsec;
+    if (nsec < 0) {
+      sec--;
+      nsec += 1000000000L;
+    }
+    int m = snprintf(buf + n, len - n, " +%ld.%06ld", sec, nsec / 1000L);
+    if (m > 0) {
+      n += (size_t)m < len - n ? (size_t)m : len - n - 1;
+    }
+  }
+  return n;
 }
 
-// Function to log a message to the chat file
-void log_message(const char *message) {
-  FILE *log_file = fopen(CHAT_LOG_FILE, "a");
-  if (log_file == NULL) {
-    perror("Error opening chat log file");
-    return;
+// Appends record `seq` to a history ring, overwriting the oldest when
+// full. Over-long lines are cut but keep their newline. Caller holds
+// g_log_mutex.
+void history_push(history_ring_t *ring, uint64_t seq, const char *line,
+                  size_t len) {
+  if (len >= HISTORY_LINE_MAX) {
+    len = HISTORY_LINE_MAX - 1;
+  }
+  char *dst = ring->lines[ring->next];
+  memcpy(dst, line, len);
+  if (len > 0 && dst[len - 1] != '\n') {
+    if (len == HISTORY_LINE_MAX - 1) {
+      len--;
+    }
+    dst[len++] = '\n';
+  }
+  dst[len] = '\0';
+  ring->lens[ring->next] = len;
+  ring->seqs[ring->next] = seq;
+  ring->next = (ring->next + 1) % MAX_HISTORY_LINES;
+  if (ring->count < MAX_HISTORY_LINES) {
+    ring->count++;
   }
-  char timestamp[30];
-  get_timestamp(timestamp, sizeof(timestamp));
-  fprintf(log_file, "[%s] %s", timestamp,
-          message); // Assume message has newline
-  fclose(log_file);
 }
 
-// Function to load allowed usernames from file
-void load_allowed_users() {
-  FILE *file = fopen(ALLOWED_USERS_FILE, "r");
+// Slot of the k-th oldest line in a history ring
+int history_slot(const history_ring_t *ring, int k) {
+  return (ring->next - ring->count + k + MAX_HISTORY_LINES) %
+         MAX_HISTORY_LINES;
+}
+
+// Reads the whole allowed users file into memory. Returns NULL on error.
+char *read_users_file(size_t *len) {
+  FILE *file = fopen(ALLOWED_USERS_FILE, "rb");
   if (file == NULL) {
+    return NULL;
+  }
+  char *data = NULL;
+  size_t cap = 0;
+  *len = 0;
+  for (;;) {
+    if (*len + 1 >= cap) {
+      cap = cap ? cap * 2 : 64 * 1024;
+      char *grown = (char *)realloc(data, cap);
+      if (grown == NULL) {
+        free(data);
+        fclose(file);
+        return NULL;
+      }
+      data = grown;
+    }
+    size_t n = fread(data + *len, 1, cap - *len - 1, file);
+    if (n == 0) {
+      break;
+    }
+    *len += n;
+  }
+  data[*len] = '\0';
+  fclose(file);
+  return data;
+}
+
+// Function to load allowed usernames from file. The names are kept in a
+// minimal perfect hash set, so there is no cap and checks are O(1).
+void load_allowed_users() {
+  clock_t start = clock();
+  size_t len;
+  char *data = read_users_file(&len);
+  if (data == NULL) {
     printf("Warning: Could not open %s. No users will be allowed by default.\n",
            ALLOWED_USERS_FILE);
     return;
   }
-  char line[USERNAME_MAX_LEN];
-  g_num_allowed_users = 0;
-  while (fgets(line, sizeof(line), file) != NULL &&
-         g_num_allowed_users < MAX_ALLOWED_USERS) {
-    line[strcspn(line, "\r\n")] = 0;
-    if (strlen(line) > 0) {
-      strncpy(g_allowed_usernames[g_num_allowed_users], line,
-              USERNAME_MAX_LEN - 1);
-      g_allowed_usernames[g_num_allowed_users][USERNAME_MAX_LEN - 1] = '\0';
-      g_num_allowed_users++;
+
+  const char **names = NULL;
+  size_t num_names = 0;
+  size_t names_cap = 0;
+  size_t skipped = 0;
+  for (char *line = data; line < data + len;) {
+    char *end = (char *)memchr(line, '\n', (size_t)(data + len - line));
+    if (end == NULL) {
+      end = data + len;
+    }
+    *end = '\0';
+    line[strcspn(line, "\r")] = '\0';
+    size_t name_len = strlen(line);
+    if (name_len >= USERNAME_MAX_LEN) {
+      skipped++;
+    } else if (name_len > 0) {
+      if (num_names == names_cap) {
+        names_cap = names_cap ? names_cap * 2 : 1024;
+        const char **grown =
+            (const char **)realloc((void *)names, names_cap * sizeof(char *));
+        if (grown == NULL) {
+          perror("load_allowed_users: realloc failed");
+          break;
+        }
+        names = grown;
+      }
+      names[num_names++] = line;
     }
+    line = end + 1;
   }
-  fclose(file);
-  printf("Loaded %d allowed usernames from %s.\n", g_num_allowed_users,
-         ALLOWED_USERS_FILE);
-  for (int i = 0; i < g_num_allowed_users; ++i) {
-    printf("  - %s\n", g_allowed_usernames[i]);
+
+  if (mph_build(&g_allowed_users, names, num_names) < 0) {
+    printf("Error: Could not index %s. No users will be allowed.\n",
+           ALLOWED_USERS_FILE);
+    free((void *)names);
+    free(data);
+    return;
+  }
+  free((void *)names);
+  free(g_allowed_names);
+  g_allowed_names = data;
+
+  printf("Loaded %u allowed usernames from %s in %.1f ms",
+         g_allowed_users.num_keys, ALLOWED_USERS_FILE,
+         (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+  if (skipped > 0) {
+    printf(" (%lu too long, ignored)", (unsigned long)skipped);
   }
+  printf(".\n");
 }
 
 // Function to check if a username is allowed
 int is_username_allowed(const char *username) {
-  for (int i = 0; i < g_num_allowed_users; i++) {
-    if (strcmp(g_allowed_usernames[i], username) == 0) {
-      return 1; // Allowed
+  return mph_contains(&g_allowed_users, username);
+}
+
+// Adds g_groups[g] to the name index and to each member's group list.
+// A name defined twice resolves to its first definition, as before.
+void index_group(int g) {
+  group_info_t *group = &g_groups[g];
+  if (strmap_get(&g_group_index, group->name) == NULL &&
+      strmap_put(&g_group_index, group->name, group) < 0) {
+    perror("index_group: out of memory");
+    return;
+  }
+  for (int m = 0; m < group->num_members; m++) {
+    member_groups_t *entry =
+        (member_groups_t *)strmap_get(&g_member_groups, group->members[m]);
+    if (entry == NULL) {
+      entry = (member_groups_t *)calloc(1, sizeof(member_groups_t));
+      if (entry == NULL) {
+        perror("index_group: calloc failed");
+        return;
+      }
+      strncpy(entry->username, group->members[m], USERNAME_MAX_LEN - 1);
+      if (strmap_put(&g_member_groups, entry->username, entry) < 0) {
+        perror("index_group: out of memory");
+        free(entry);
+        return;
+      }
+    }
+    // Listing a member twice must not deliver twice
+    if (entry->num_groups == 0 || entry->groups[entry->num_groups - 1] != g) {
+      entry->groups[entry->num_groups++] = g;
+    }
+  }
+}
+
+// Returns the index in g_groups of the group called `name`, or -1
+int find_group(const char *name) {
+  group_info_t *group = (group_info_t *)strmap_get(&g_group_index, name);
+  return group != NULL ? (int)(group - g_groups) : -1;
+}
+
+// --- Record scopes ---
+//
+// Every logged line starts with its scope, so that a replay shows a record
+// only to those it was sent to: "* " for everyone, "D<n>:<from><n>:<to> "
+// for a DM, "G<n>:<group> " for a message to a group's members. Names are
+// length-prefixed, as they may hold spaces. Lines logged before scopes
+// existed start with the stamp and are shown to nobody: they may be DMs.
+
+// Reads a "<n>:<name>" field at `p`. Returns what follows it, or NULL if
+// it is malformed.
+const char *scope_read_name(const char *p, const char *end,
+                            const char **name, size_t *len) {
+  size_t n = 0;
+  while (p < end && *p >= '0' && *p <= '9' && n < HISTORY_LINE_MAX) {
+    n = n * 10 + (size_t)(*p++ - '0');
+  }
+  if (p == end || *p != ':' || n == 0 || (size_t)(end - p - 1) < n) {
+    return NULL;
+  }
+  *name = p + 1;
+  *len = n;
+  return p + 1 + n;
+}
+
+// Splits the scope off a logged line. Returns its kind, or 0 (with a body
+// offset of 0) if the line has none.
+char log_scope_parse(const char *line, size_t len, log_scope_t *scope) {
+  const char *end = line + len;
+  const char *p = line + 1;
+  scope->kind = 0;
+  scope->body = 0;
+  if (len < 2) {
+    return 0;
+  }
+  switch (line[0]) {
+  case '*':
+    break;
+  case 'D':
+    p = scope_read_name(p, end, &scope->names[0], &scope->lens[0]);
+    if (p != NULL) {
+      p = scope_read_name(p, end, &scope->names[1], &scope->lens[1]);
+    }
+    break;
+  case 'G':
+    p = scope_read_name(p, end, &scope->names[0], &scope->lens[0]);
+    break;
+  default:
+    return 0;
+  }
+  if (p == NULL || p == end || *p != ' ') {
+    return 0;
+  }
+  scope->kind = line[0];
+  scope->body = (size_t)(p + 1 - line);
+  return scope->kind;
+}
+
+// Group a scoped line was sent to, or -1
+int log_scope_group(const log_scope_t *scope) {
+  char name[GROUPNAME_MAX_LEN];
+  if (scope->kind != 'G' || scope->lens[0] >= sizeof(name)) {
+    return -1;
+  }
+  memcpy(name, scope->names[0], scope->lens[0]);
+  name[scope->lens[0]] = '\0';
+  return find_group(name);
+}
+
+// Whether the k-th name in a scope is `username`
+int log_scope_is(const log_scope_t *scope, int k, const char *username) {
+  return strlen(username) == scope->lens[k] &&
+         memcmp(username, scope->names[k], scope->lens[k]) == 0;
+}
+
+// Seeds the history rings from the end of the log, so history survives a
+// restart: the last lines for the global ring, and group messages among
+// the last GROUP_HISTORY_SCAN records for the group rings. The index
+// takes the reader straight to them.
+void history_load_tail(void) {
+  uint64_t oldest, end;
+  seglog_bounds(&g_log.seg, &oldest, &end);
+  if (end == oldest) {
+    return;
+  }
+  uint64_t first = end - oldest > GROUP_HISTORY_SCAN ? end - GROUP_HISTORY_SCAN
+                                                     : oldest;
+  seglog_reader_t reader;
+  if (seglog_reader_open(&reader, &g_log.seg, first) < 0) {
+    return;
+  }
+  char line[HISTORY_LINE_MAX];
+  long len;
+  uint64_t seq = reader.seq;
+  while ((len = seglog_reader_next(&reader, line, sizeof(line))) >= 0) {
+    log_scope_t scope;
+    log_scope_parse(line, (size_t)len, &scope);
+    int group = log_scope_group(&scope);
+    if (group != -1) {
+      history_push(&g_groups[group].history, seq, line, (size_t)len);
+    }
+    if (end - seq <= MAX_HISTORY_LINES) {
+      history_push(&g_history, seq, line, (size_t)len);
     }
+    seq++;
   }
-  return 0; // Not allowed
+  seglog_reader_close(&reader);
 }
 
 // Function to load group definitions
@@ -163,6 +724,7 @@ void load_groups() {
         }
         member_token = strtok(NULL, ",");
       }
+      index_group(g_num_groups);
       g_num_groups++;
     }
   }
@@ -174,455 +736,4200 @@ void load_groups() {
   }
 }
 
-int main() {
-  socket_init();
-  load_allowed_users();
-  load_groups();
+// Kinds of cross-shard mailbox messages
+typedef enum {
+  SHARD_MSG_BROADCAST, // Deliver `text` to every active local client
+  SHARD_MSG_DIRECT,    // Deliver `text` to local sessions of `target`
+  SHARD_MSG_GROUP,     // Deliver `text` to local members of `group_idx`
+  SHARD_MSG_MAIL,      // Deliver kept DMs `text` to session `slot`
+  SHARD_MSG_NOTICE,    // Send `text` to session `slot`
+} shard_msg_type_t;
+
+typedef struct {
+  mpsc_node_t node; // Must stay first
+  shard_msg_type_t type;
+  char target[USERNAME_MAX_LEN];
+  int group_idx;
+  uint64_t seq; // Record number of `text`, 0 if not logged
+  int slot;     // SHARD_MSG_MAIL/NOTICE: the session, if the slot still
+  unsigned generation; // holds the same one
+  long mail_size;      // SHARD_MSG_MAIL: mailbox bytes `text` holds
+  size_t len;
+  char text[];
+} shard_msg_t;
+
+// A login waiting in a shard's queue; the slot may have been reused (or
+// the client gone) by the time it comes up, which `generation` detects
+typedef struct {
+  int slot;
+  unsigned generation;
+} pending_login_t;
 
+// One event-loop thread: its own listener (SO_REUSEPORT), its own slice of
+// the client table and its own reactor or io_uring instance. Other shards
+// reach it only through the lock-free mailbox.
+typedef struct {
+  int id;
   socket_t listen_socket;
-  client_info_t clients[MAX_CLIENTS];
-  fd_set read_fds;
-  fd_set master_fds;
-  socket_t max_sd;
-  struct sockaddr_in server_addr;
-  char buffer[BUFFER_SIZE];
-  char message_to_send_clients[BUFFER_SIZE + USERNAME_MAX_LEN +
-                               GROUPNAME_MAX_LEN + 30];
-  char system_message[USERNAME_MAX_LEN + 100];
+  // Client table, indexed by slot. Records are allocated one by one so
+  // their addresses (held by the reactor) survive growth of the table.
+  client_info_t **clients;
+  int clients_cap; // Slots allocated so far
+  int clients_max; // This shard's share of the connection limit
+  int free_head;   // First free slot, or -1
+  int *active_slots; // Dense list of logged-in slots, for fan-out
+  int num_active;
+  strmap_t by_name; // Username -> first active client_info_t of that name
+  group_online_t group_online[MAX_GROUPS]; // Indexed like g_groups
+  int use_uring; // io_uring mode requested and supported
+  reactor_t reactor;
+#if URING_AVAILABLE
+  uring_t uring;
+  uring_buf_ring_t uring_bufs;
+#endif
+  int *out_dirty;    // Slots with output queued since last flush
+  int *out_flushing; // Swapped with out_dirty while flushing
+  int num_out_dirty;
+  int history_streams[HISTORY_STREAMS_MAX]; // Slots with a HISTORY stream
+  int num_history_streams;
+  time_t last_tick;   // Last run of shard_tick()
+  time_t last_report; // Last report_stats() call (shard 0)
+  // Logins waiting for a token from g_login_bucket, oldest first. A
+  // circular FIFO of login_cap entries; stale ones are skipped on the way
+  // out.
+  pending_login_t *logins;
+  int login_cap;
+  int login_head;
+  int num_logins;
+#if URING_AVAILABLE
+  struct __kernel_timespec uring_tick_ts;
+#endif
+  // Slow-consumer counters, summed over all shards by report_stats()
+  atomic_ulong slow_dropped;     // Chatter dropped oldest-first
+  atomic_ulong slow_collapsed;   // Chatter folded into "missed" markers
+  atomic_ulong slow_markers;     // "You missed N messages" markers sent
+  atomic_ulong slow_disconnects; // Clients disconnected
+  // Connection counters, for watching reconnect storms
+  atomic_ulong accepted;        // Connections accepted
+  atomic_ulong accept_rejected; // Of those, turned away with SERVER_FULL
+  atomic_ulong accept_throttled; // Turned away by the per-address limit
+  atomic_ulong login_queued;     // Logins that had to wait for a token
+  atomic_ulong login_refused;    // Turned away with the login queue full
+  // Chat log records on their way to the writer thread (this shard is the
+  // ring's only producer)
+  spsc_ring_t log_ring;
+  int log_pushed;              // Pushed since the writer was last woken
+  atomic_size_t log_peak;      // Highest ring occupancy seen
+  atomic_ulong log_dropped;    // Records lost to a full ring
+  atomic_ulong log_spilled;    // Records that had to be parked
+  atomic_ulong log_blocked;    // Times the loop waited for the writer
+  mpsc_queue_t mailbox;
+  atomic_int mailbox_signaled; // A wakeup is already pending
+#if SERVER_HAVE_SHARDS
+  int wake_read_fd; // eventfd (or pipe read end) watched by the loop
+  int wake_write_fd;
+#endif
+  int pin_cpu; // CPU to pin the thread to, or -1
+  thread_t thread;
+} shard_t;
+
+// Server-wide connection state
+shard_t *g_shards = NULL;
+int g_num_shards = 1;
+_Thread_local shard_t *t_shard = NULL; // Shard owned by the calling thread
+
+// Which shards each logged-in user has sessions on, for routing DMs to
+// users connected to another thread and for the mailbox thread, which has
+// no clients of its own, to tell who is online.
+typedef struct {
+  char username[USERNAME_MAX_LEN]; // Key in g_presence
+  unsigned long long shard_mask;   // Bit s set while sessions[s] > 0
+  unsigned short sessions[MAX_SHARDS];
+} presence_entry_t;
+
+strmap_t g_presence; // Username -> presence_entry_t
+mutex_t g_presence_mutex;
+
+int g_max_clients = 0; // Connection limit over all shards; 0 = from rlimit
+
+// Admission control. Logins (the history replay, mailbox and join notice
+// they trigger are the expensive part of a reconnect storm) take a token
+// from one server-wide bucket, and wait in their shard's queue when there
+// is none. Each source address has its own bucket, checked at accept, so
+// one host cannot take the whole rate. A rate of 0 turns a limit off.
+typedef struct {
+  uint32_t addr; // IPv4 address in network order; 0 = unused
+  token_bucket_t bucket;
+} ip_bucket_t;
+
+double g_login_rate = LOGIN_RATE_DEFAULT;
+double g_login_burst = LOGIN_BURST_DEFAULT;
+int g_login_queue = LOGIN_QUEUE_DEFAULT;
+double g_ip_rate = IP_RATE_DEFAULT;
+double g_ip_burst = IP_BURST_DEFAULT;
+mutex_t g_admission_mutex; // Guards the buckets below
+token_bucket_t g_login_bucket;
+ip_bucket_t g_ip_buckets[IP_BUCKETS]; // Open addressing, see ip_bucket_find()
+
+#if URING_AVAILABLE
+// io_uring user_data tags. Sends carry a (malloc-aligned) out_msg_t
+// pointer, so the low three bits are free to hold the tag.
+#define URING_TAG_PROBE 0ULL
+#define URING_TAG_ACCEPT 1ULL
+#define URING_TAG_RECV 2ULL
+#define URING_TAG_SEND 3ULL
+#define URING_TAG_MAILBOX 4ULL
+#define URING_TAG_TICK 5ULL
+#define URING_TAG_MASK 7ULL
+#endif
 
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    clients[i].active = 0;
-    clients[i].socket = 0;
-    memset(clients[i].username, 0, USERNAME_MAX_LEN);
+// Allocates a shared send buffer holding one reference for the caller
+send_buf_t *send_buf_new(const char *data, size_t len) {
+  send_buf_t *buf = (send_buf_t *)malloc(sizeof(send_buf_t) + len);
+  if (buf == NULL) {
+    perror("send_buf_new: malloc failed");
+    return NULL;
   }
+  buf->refs = 1;
+  buf->len = len;
+  memcpy(buf->data, data, len);
+  return buf;
+}
 
-  listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_socket == INVALID_SOCKET) {
-    print_socket_error("Failed to create listening socket");
-    socket_cleanup();
-    return 1;
+void send_buf_release(send_buf_t *buf) {
+  if (--buf->refs == 0) {
+    free(buf);
   }
-  printf("Listening socket created.\n");
+}
 
-#ifndef _WIN32
-  int opt = 1;
-  if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt,
-                 sizeof(opt)) < 0) {
-    print_socket_error("setsockopt(SO_REUSEADDR) failed");
-    close_socket(listen_socket);
-    socket_cleanup();
-    return 1;
+// Writes the "#<seq> " tag that precedes logged lines for want_seq
+// clients. Returns its length.
+size_t format_seq_tag(uint64_t seq, char *buf, size_t cap) {
+  int n = snprintf(buf, cap, "#%llu ", (unsigned long long)seq);
+  return n > 0 && (size_t)n < cap ? (size_t)n : 0;
+}
+
+// Whether `text` has a line break before its final newline. Only binary
+// clients can send those.
+int text_has_breaks(const char *text, size_t len) {
+  const char *nl = (const char *)memchr(text, '\n', len);
+  return nl != NULL && nl + 1 < text + len;
+}
+
+// Copies `text` to `dst` (`cap` bytes, NUL included) with each line break
+// before its final newline spelled "\n", so it stays one line in the log,
+// in mailboxes and for text-protocol clients. Returns the length, cut to
+// fit.
+size_t flatten_text(char *dst, size_t cap, const char *text, size_t len) {
+  size_t out = 0;
+  for (size_t k = 0; k < len && out + 1 < cap; k++) {
+    if (text[k] == '\n' && k + 1 < len) {
+      if (out + 2 >= cap) {
+        break;
+      }
+      dst[out++] = '\\';
+      dst[out++] = 'n';
+    } else {
+      dst[out++] = text[k];
+    }
   }
-#endif
+  dst[out] = '\0';
+  return out;
+}
 
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(PORT);
+// A send buffer holding one frame
+send_buf_t *send_buf_new_frame(uint8_t op, uint32_t id, uint64_t seq,
+                               const char *payload, size_t len) {
+  send_buf_t *buf =
+      (send_buf_t *)malloc(sizeof(send_buf_t) + WIRE_HEADER_SIZE + len);
+  if (buf == NULL) {
+    perror("send_buf_new_frame: malloc failed");
+    return NULL;
+  }
+  buf->refs = 1;
+  buf->len = wire_encode_frame((unsigned char *)buf->data, op, id, seq,
+                               payload, len);
+  return buf;
+}
 
-  if (bind(listen_socket, (struct sockaddr *)&server_addr,
-           sizeof(server_addr)) < 0) {
-    print_socket_error("Bind failed");
-    close_socket(listen_socket);
-    socket_cleanup();
-    return 1;
+// Server text for a binary client: one WIRE_OP_LINE frame per line, with
+// a leading "#<seq> " tag moved into the header
+send_buf_t *send_buf_new_frames(const char *data, size_t len) {
+  size_t lines = 0;
+  for (const char *p = data; p < data + len; lines++) {
+    const char *nl = (const char *)memchr(p, '\n', (size_t)(data + len - p));
+    p = nl != NULL ? nl + 1 : data + len;
+  }
+  send_buf_t *buf = (send_buf_t *)malloc(sizeof(send_buf_t) + len +
+                                         lines * WIRE_HEADER_SIZE);
+  if (buf == NULL) {
+    perror("send_buf_new_frames: malloc failed");
+    return NULL;
   }
-  printf("Bind successful on port %d.\n", PORT);
+  buf->refs = 1;
+  buf->len = 0;
+  const char *p = data, *end = data + len;
+  while (p < end) {
+    const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+    const char *stop = nl != NULL ? nl : end;
+    uint64_t seq = 0;
+    if (*p == '#') {
+      char *rest;
+      unsigned long long tag = strtoull(p + 1, &rest, 10);
+      if (rest > p + 1 && rest < stop && *rest == ' ') {
+        seq = tag;
+        p = rest + 1;
+      }
+    }
+    buf->len += wire_encode_frame((unsigned char *)buf->data + buf->len,
+                                  WIRE_OP_LINE, WIRE_NO_ID, seq, p,
+                                  (size_t)(stop - p));
+    p = nl != NULL ? nl + 1 : end;
+  }
+  return buf;
+}
 
-  if (listen(listen_socket, 5) < 0) {
-    print_socket_error("Listen failed");
-    close_socket(listen_socket);
-    socket_cleanup();
-    return 1;
+#define STAT_ADD(counter, n)                                                   \
+  atomic_fetch_add_explicit(&t_shard->counter, (n), memory_order_relaxed)
+
+// --- Chat log writer ---
+//
+// log_message() formats a line, numbers it, adds it to the history ring
+// and pushes it onto the calling shard's lock-free ring. A dedicated thread
+// merges every shard's ring back into sequence order and appends to the
+// segmented log, so a slow disk never stalls a loop.
+
+// Opens the segmented chat log and carries on numbering where it left
+// off. Called once at startup, before any loop runs.
+int log_open(void) {
+  g_log.seg.max_size = (uint64_t)g_log_segment_size;
+  g_log.seg.daily = g_log_rotate_daily;
+  g_log.seg.retain_count = (size_t)g_log_retain_segments;
+  g_log.seg.retain_secs = (int64_t)g_log_retain_days * 24 * 60 * 60;
+  g_log.seg.buffer_size = LOG_BUFFER_SIZE;
+  if (seglog_open(&g_log.seg, g_log_dir) < 0) {
+    fprintf(stderr, "Error opening chat log in %s/\n", g_log_dir);
+    return -1;
   }
-  printf("Server listening for connections on port %d...\n", PORT);
+  g_log.next_seq = g_log.seg.next_seq;
+  g_log.last_sync = time(NULL);
+  return 0;
+}
 
-  FD_ZERO(&master_fds);
-  FD_ZERO(&read_fds);
-  FD_SET(listen_socket, &master_fds);
-  max_sd = listen_socket;
-  printf("Waiting for connections...\n");
+// Forces written log data to disk (data only, like fdatasync())
+void log_sync_file(void) {
+  seglog_sync(&g_log.seg);
+  g_log.unsynced = 0;
+  g_log.last_sync = time(NULL);
+}
 
-  while (1) {
-    read_fds = master_fds;
-    int activity = select(max_sd + 1, &read_fds, NULL, NULL, NULL);
+// Number of the record at the head of a ring, or UINT64_MAX if it is empty
+uint64_t log_peek_seq(spsc_ring_t *ring) {
+  log_record_t header;
+  if (spsc_peek(ring, &header, sizeof(header)) < 0) {
+    return UINT64_MAX;
+  }
+  return header.seq;
+}
 
-    if (activity < 0) {
-#ifdef _WIN32
-      if (socket_errno == WSAEINTR) {
-        continue;
-      }
-#else
-      if (socket_errno == EINTR) {
-        continue;
+// Appends one record to the current segment. Returns 0, or -1 on error.
+int log_write_record(const char *record, size_t len) {
+  log_record_t header;
+  memcpy(&header, record, sizeof(header));
+  return seglog_append(&g_log.seg, header.time, record + sizeof(header),
+                       len - sizeof(header));
+}
+
+// Moves every record queued so far into the log, then commits them with
+// one flush. Each shard's ring and the spill list are already in sequence
+// order, so this is a merge. Records numbered after the pass started stay
+// queued: a lower number may not have reached its ring yet. Returns the
+// number of records written.
+int log_drain(char *record) {
+  mutex_lock(&g_log_mutex);
+  uint64_t end = g_log.next_seq; // Everything below is in a ring or spilled
+  log_spill_t *spill = g_log.spill_head;
+  g_log.spill_head = NULL;
+  g_log.spill_tail = NULL;
+  mutex_unlock(&g_log_mutex);
+
+  uint64_t heads[MAX_SHARDS];
+  for (int s = 0; s < g_num_shards; s++) {
+    heads[s] = log_peek_seq(&g_shards[s].log_ring);
+  }
+  int written = 0;
+  int failed = 0;
+  for (;;) {
+    int from = -1; // Shard to take from, or -1 for the spill list
+    uint64_t low = UINT64_MAX;
+    if (spill != NULL) {
+      memcpy(&low, spill->data, sizeof(low)); // log_record_t.seq
+    }
+    for (int s = 0; s < g_num_shards; s++) {
+      if (heads[s] < low) {
+        low = heads[s];
+        from = s;
       }
-#endif
-      print_socket_error("select() error");
+    }
+    if (low >= end) {
       break;
     }
+    if (from >= 0) {
+      long n = spsc_pop(&g_shards[from].log_ring, record);
+      failed |= log_write_record(record, (size_t)n);
+      heads[from] = log_peek_seq(&g_shards[from].log_ring);
+    } else {
+      log_spill_t *next = spill->next;
+      failed |= log_write_record(spill->data, spill->len);
+      atomic_fetch_sub_explicit(&g_log.spill_bytes, spill->len,
+                                memory_order_relaxed);
+      free(spill);
+      spill = next;
+    }
+    written++;
+  }
+  if (written > 0) {
+    if (seglog_flush(&g_log.seg) < 0 || failed) {
+      perror("Error writing chat log");
+    }
+    g_log.unsynced = 1;
+    if (g_log_sync == LOG_SYNC_BATCH) {
+      log_sync_file();
+    }
+  }
+  return written;
+}
 
-    if (FD_ISSET(listen_socket, &read_fds)) {
-      struct sockaddr_in new_client_addr_temp;
-      socklen_t new_client_addr_len_temp = sizeof(new_client_addr_temp);
-      socket_t new_socket =
-          accept(listen_socket, (struct sockaddr *)&new_client_addr_temp,
-                 &new_client_addr_len_temp);
-
-      if (new_socket == INVALID_SOCKET) {
-        print_socket_error("accept() failed");
-      } else {
-        char client_ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &new_client_addr_temp.sin_addr, client_ip_str,
-                  INET_ADDRSTRLEN);
-        printf("New connection attempt from: %s, port: %d (socket %d)\n",
-               client_ip_str, ntohs(new_client_addr_temp.sin_port),
-               (int)new_socket);
-
-        int client_idx = -1;
-        for (int k = 0; k < MAX_CLIENTS; k++) {
-          if (clients[k].socket == 0) {
-            client_idx = k;
-            break;
-          }
-        }
+void *log_writer_thread(void *arg) {
+  (void)arg;
+  char *record = (char *)malloc(sizeof(log_record_t) + HISTORY_LINE_MAX);
+  if (record == NULL) {
+    perror("Log writer: malloc failed");
+    return NULL;
+  }
+  int stopping = 0;
+  for (;;) {
+    log_drain(record);
+    if (g_log_sync == LOG_SYNC_PERIODIC && g_log.unsynced &&
+        time(NULL) - g_log.last_sync >= g_log_sync_interval) {
+      log_sync_file();
+    }
+    if (stopping) {
+      break;
+    }
+    mutex_lock(&g_log.mutex);
+    if (!g_log.wake_pending && !g_log.stop) {
+      cond_wait_ms(&g_log.wake, &g_log.mutex, TICK_INTERVAL_MS);
+    }
+    g_log.wake_pending = 0;
+    stopping = g_log.stop; // One last drain before leaving
+    mutex_unlock(&g_log.mutex);
+  }
+  if (g_log.unsynced && g_log_sync != LOG_SYNC_NONE) {
+    log_sync_file();
+  }
+  seglog_close(&g_log.seg);
+  free(record);
+  return NULL;
+}
 
-        if (client_idx == -1) {
-          printf("Max clients reached. Rejecting new connection from %s.\n",
-                 client_ip_str);
-          send(new_socket, "SERVER_FULL\n", strlen("SERVER_FULL\n"), 0);
-          close_socket(new_socket);
-        } else {
-          clients[client_idx].socket = new_socket;
-          clients[client_idx].address = new_client_addr_temp;
-          clients[client_idx].active = 0;
-          memset(clients[client_idx].username, 0, USERNAME_MAX_LEN);
-
-          send(new_socket, "REQ_USERNAME\n", strlen("REQ_USERNAME\n"), 0);
-          FD_SET(new_socket, &master_fds);
-          if (new_socket > max_sd) {
-            max_sd = new_socket;
-          }
-          printf("Sent REQ_USERNAME to socket %d. Slot %d assigned.\n",
-                 (int)new_socket, client_idx);
-        }
-      }
+int log_writer_start(void) {
+  mutex_init(&g_log.mutex);
+  cond_init(&g_log.wake);
+  for (int s = 0; s < g_num_shards; s++) {
+    char *storage = (char *)malloc(LOG_RING_SIZE);
+    if (storage == NULL) {
+      perror("Failed to allocate log ring");
+      return -1;
     }
+    spsc_init(&g_shards[s].log_ring, storage, LOG_RING_SIZE);
+  }
+  if (thread_create(&g_log.thread, log_writer_thread, NULL) < 0) {
+    fprintf(stderr, "Failed to start the log writer thread.\n");
+    return -1;
+  }
+  return 0;
+}
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-      socket_t sender_socket = clients[i].socket;
-      if (sender_socket == 0 || !FD_ISSET(sender_socket, &read_fds)) {
-        continue;
-      }
+// Drains what is left and stops the writer
+void log_writer_stop(void) {
+  mutex_lock(&g_log.mutex);
+  g_log.stop = 1;
+  cond_signal(&g_log.wake);
+  mutex_unlock(&g_log.mutex);
+  thread_join(g_log.thread);
+  cond_destroy(&g_log.wake);
+  mutex_destroy(&g_log.mutex);
+}
 
-      if (!clients[i].active) { // Username reception phase
-        memset(buffer, 0, BUFFER_SIZE);
-        int recv_size = recv(sender_socket, buffer, USERNAME_MAX_LEN - 1, 0);
-
-        if (recv_size > 0) {
-          buffer[recv_size] = '\0';
-          buffer[strcspn(buffer, "\r\n")] = 0;
-
-          if (strlen(buffer) == 0) {
-            send(sender_socket, "BAD_USERNAME\nUsername cannot be empty.\n",
-                 strlen("BAD_USERNAME\nUsername cannot be empty.\n"), 0);
-            FD_CLR(sender_socket, &master_fds);
-            close_socket(sender_socket);
-            clients[i].socket = 0;
-            printf("Client on socket %d (slot %d) sent empty username. "
-                   "Connection closed.\n",
-                   (int)sender_socket, i);
-            continue;
-          }
+void log_wake_writer(void) {
+  mutex_lock(&g_log.mutex);
+  g_log.wake_pending = 1;
+  cond_signal(&g_log.wake);
+  mutex_unlock(&g_log.mutex);
+  t_shard->log_pushed = 0;
+}
 
-          if (!is_username_allowed(buffer)) {
-            printf("Username '%s' from socket %d (slot %d) is not allowed. "
-                   "Rejecting.\n",
-                   buffer, (int)sender_socket, i);
-            send(sender_socket, "NOT_ALLOWED\nUsername not on allowed list.\n",
-                 strlen("NOT_ALLOWED\nUsername not on allowed list.\n"), 0);
-            FD_CLR(sender_socket, &master_fds);
-            close_socket(sender_socket);
-            clients[i].socket = 0;
-            continue;
-          }
+// Pushes one record onto this shard's ring and tracks the high-water mark
+int log_push(const char *record, size_t len) {
+  if (spsc_push(&t_shard->log_ring, record, len) < 0) {
+    return -1;
+  }
+  t_shard->log_pushed = 1;
+  size_t used = spsc_used(&t_shard->log_ring);
+  if (used > atomic_load_explicit(&t_shard->log_peak, memory_order_relaxed)) {
+    atomic_store_explicit(&t_shard->log_peak, used, memory_order_relaxed);
+  }
+  return 0;
+}
 
-          strncpy(clients[i].username, buffer, USERNAME_MAX_LEN - 1);
-          clients[i].username[USERNAME_MAX_LEN - 1] = '\0';
-          clients[i].active = 1;
-
-          printf("Username '%s' (allowed) received for socket %d (slot %d).\n",
-                 clients[i].username, (int)sender_socket, i);
-
-          char welcome_msg[USERNAME_MAX_LEN + 50];
-          sprintf(welcome_msg, "Welcome, %s!\n", clients[i].username);
-          send(sender_socket, welcome_msg, strlen(welcome_msg), 0);
-
-          FILE *log_file_read = fopen(CHAT_LOG_FILE, "r");
-          if (log_file_read != NULL) {
-            char history_line_buffer[BUFFER_SIZE + USERNAME_MAX_LEN + 50];
-            char *history_lines_ptrs[MAX_HISTORY_LINES];
-            int history_line_count = 0;
-            int current_history_idx = 0;
-            for (int k = 0; k < MAX_HISTORY_LINES; ++k)
-              history_lines_ptrs[k] = NULL;
-            while (fgets(history_line_buffer, sizeof(history_line_buffer),
-                         log_file_read) != NULL) {
-              if (history_lines_ptrs[current_history_idx] != NULL)
-                free(history_lines_ptrs[current_history_idx]);
-              history_lines_ptrs[current_history_idx] =
-                  my_strdup(history_line_buffer);
-              if (history_lines_ptrs[current_history_idx] == NULL) {
-                fprintf(stderr,
-                        "Failed to duplicate history line for user %s\n",
-                        clients[i].username);
-                break;
-              }
-              current_history_idx =
-                  (current_history_idx + 1) % MAX_HISTORY_LINES;
-              if (history_line_count < MAX_HISTORY_LINES)
-                history_line_count++;
-            }
-            fclose(log_file_read);
-            if (history_line_count > 0) {
-              send(sender_socket, "--- Recent Chat History ---\n",
-                   strlen("--- Recent Chat History ---\n"), 0);
-              for (int k = 0; k < history_line_count; k++) {
-                int idx_to_send = (current_history_idx + k) % MAX_HISTORY_LINES;
-                if (history_lines_ptrs[idx_to_send] != NULL)
-                  send(sender_socket, history_lines_ptrs[idx_to_send],
-                       strlen(history_lines_ptrs[idx_to_send]), 0);
-              }
-              send(sender_socket, "--- End of History ---\n",
-                   strlen("--- End of History ---\n"), 0);
-            }
-            for (int k = 0; k < MAX_HISTORY_LINES; ++k)
-              if (history_lines_ptrs[k] != NULL)
-                free(history_lines_ptrs[k]);
-          }
-          snprintf(system_message, sizeof(system_message),
-                   "System: %s has joined the chat.\n", clients[i].username);
-          log_message(system_message);
-          for (int j = 0; j < MAX_CLIENTS; j++)
-            if (clients[j].active && clients[j].socket != sender_socket)
-              send(clients[j].socket, system_message, strlen(system_message),
-                   0);
-
-        } else {
-          printf("Failed to receive username or client disconnected from "
-                 "socket %d (slot %d).\n",
-                 (int)sender_socket, i);
-          FD_CLR(sender_socket, &master_fds);
-          close_socket(sender_socket);
-          clients[i].socket = 0;
-        }
-      } else { // clients[i].active is true: Chat message, DM, or GM phase
-        memset(buffer, 0, BUFFER_SIZE);
-        int recv_size = recv(sender_socket, buffer, BUFFER_SIZE - 1, 0);
-
-        if (recv_size > 0) {
-          buffer[recv_size] = '\0';
-
-          if (strncmp(buffer, "PRIVMSG ", 8) == 0) {
-            char recipient_username[USERNAME_MAX_LEN];
-            char *dm_text_start;
-            char *first_space = strchr(buffer + 8, ' ');
-
-            if (first_space != NULL) {
-              size_t recipient_len = first_space - (buffer + 8);
-              if (recipient_len < USERNAME_MAX_LEN && recipient_len > 0) {
-                strncpy(recipient_username, buffer + 8, recipient_len);
-                recipient_username[recipient_len] = '\0';
-                dm_text_start = first_space + 1;
-
-                int recipient_idx = -1;
-                for (int k = 0; k < MAX_CLIENTS; k++) {
-                  if (clients[k].active &&
-                      strcmp(clients[k].username, recipient_username) == 0) {
-                    recipient_idx = k;
-                    break;
-                  }
-                }
-
-                if (recipient_idx != -1) {
-                  snprintf(message_to_send_clients,
-                           sizeof(message_to_send_clients), "(DM from %s): %s",
-                           clients[i].username, dm_text_start);
-                  send(clients[recipient_idx].socket, message_to_send_clients,
-                       strlen(message_to_send_clients), 0);
-
-                  snprintf(message_to_send_clients,
-                           sizeof(message_to_send_clients), "(DM to %s): %s",
-                           recipient_username, dm_text_start);
-                  send(sender_socket, message_to_send_clients,
-                       strlen(message_to_send_clients), 0);
-
-                  char dm_log_buffer[BUFFER_SIZE + USERNAME_MAX_LEN * 2 + 20];
-                  char temp_dm_text[BUFFER_SIZE];
-                  strncpy(temp_dm_text, dm_text_start,
-                          sizeof(temp_dm_text) - 1);
-                  temp_dm_text[sizeof(temp_dm_text) - 1] = '\0';
-                  temp_dm_text[strcspn(temp_dm_text, "\r\n")] = 0;
-
-                  snprintf(dm_log_buffer, sizeof(dm_log_buffer),
-                           "DM from %s to %s: %s\n", clients[i].username,
-                           recipient_username, temp_dm_text);
-                  log_message(dm_log_buffer);
-                  printf("DM from %s to %s: %s\n", clients[i].username,
-                         recipient_username, temp_dm_text);
-
-                } else {
-                  snprintf(message_to_send_clients,
-                           sizeof(message_to_send_clients),
-                           "System: User '%s' not found or is offline.\n",
-                           recipient_username);
-                  send(sender_socket, message_to_send_clients,
-                       strlen(message_to_send_clients), 0);
-                  printf("User %s tried to DM non-existent/offline user %s\n",
-                         clients[i].username, recipient_username);
-                }
-              } else {
-                send(sender_socket,
-                     "System: Invalid recipient in DM command.\n",
-                     strlen("System: Invalid recipient in DM command.\n"), 0);
-              }
-            } else {
-              send(sender_socket,
-                   "System: Invalid DM command format from client.\n",
-                   strlen("System: Invalid DM command format from client.\n"),
-                   0);
-            }
-          } else if (strncmp(buffer, "GROUPMSG ", 9) == 0) {
-            char group_name_req[GROUPNAME_MAX_LEN];
-            char *gm_text_start;
-            char *first_space = strchr(buffer + 9, ' ');
-
-            if (first_space != NULL) {
-              size_t group_name_len = first_space - (buffer + 9);
-              if (group_name_len < GROUPNAME_MAX_LEN && group_name_len > 0) {
-                strncpy(group_name_req, buffer + 9, group_name_len);
-                group_name_req[group_name_len] = '\0';
-                gm_text_start = first_space + 1;
-
-                int group_idx = -1;
-                for (int g = 0; g < g_num_groups; g++) {
-                  if (strcmp(g_groups[g].name, group_name_req) == 0) {
-                    group_idx = g;
-                    break;
-                  }
-                }
-
-                if (group_idx != -1) {
-                  int members_messaged = 0;
-                  snprintf(message_to_send_clients,
-                           sizeof(message_to_send_clients), "(#%s from %s): %s",
-                           g_groups[group_idx].name, clients[i].username,
-                           gm_text_start);
-
-                  for (int m = 0; m < g_groups[group_idx].num_members; m++) {
-                    const char *member_username =
-                        g_groups[group_idx].members[m];
-                    for (int c_idx = 0; c_idx < MAX_CLIENTS; c_idx++) {
-                      if (clients[c_idx].active &&
-                          strcmp(clients[c_idx].username, member_username) ==
-                              0) {
-                        send(clients[c_idx].socket, message_to_send_clients,
-                             strlen(message_to_send_clients), 0);
-                        members_messaged++;
-                        break;
-                      }
-                    }
-                  }
-
-                  char confirmation_msg[GROUPNAME_MAX_LEN + BUFFER_SIZE + 30];
-                  snprintf(confirmation_msg, sizeof(confirmation_msg),
-                           "(To #%s): %s", g_groups[group_idx].name,
-                           gm_text_start);
-                  send(sender_socket, confirmation_msg,
-                       strlen(confirmation_msg), 0);
-
-                  char gm_log_buffer[BUFFER_SIZE + USERNAME_MAX_LEN +
-                                     GROUPNAME_MAX_LEN + 30];
-                  char temp_gm_text[BUFFER_SIZE];
-                  strncpy(temp_gm_text, gm_text_start,
-                          sizeof(temp_gm_text) - 1);
-                  temp_gm_text[sizeof(temp_gm_text) - 1] = '\0';
-                  temp_gm_text[strcspn(temp_gm_text, "\r\n")] = 0;
-
-                  snprintf(gm_log_buffer, sizeof(gm_log_buffer),
-                           "GROUPMSG to #%s from %s: %s\n",
-                           g_groups[group_idx].name, clients[i].username,
-                           temp_gm_text);
-                  log_message(gm_log_buffer);
-                  printf("GROUPMSG to #%s from %s: %s (%d members messaged)\n",
-                         g_groups[group_idx].name, clients[i].username,
-                         temp_gm_text, members_messaged);
-
-                } else {
-                  snprintf(message_to_send_clients,
-                           sizeof(message_to_send_clients),
-                           "System: Group '#%s' not found.\n", group_name_req);
-                  send(sender_socket, message_to_send_clients,
-                       strlen(message_to_send_clients), 0);
-                }
-              } else {
-                send(sender_socket,
-                     "System: Invalid group name in GM command.\n",
-                     strlen("System: Invalid group name in GM command.\n"), 0);
-              }
-            } else {
-              send(sender_socket,
-                   "System: Invalid GM command format from client.\n",
-                   strlen("System: Invalid GM command format from client.\n"),
-                   0);
-            }
-          } else { // Global chat message
-            printf("Received global from %s (socket %d): %s",
-                   clients[i].username, (int)sender_socket, buffer);
-
-            snprintf(message_to_send_clients, sizeof(message_to_send_clients),
-                     "%s: %s", clients[i].username, buffer);
-
-            log_message(message_to_send_clients);
-
-            printf("Broadcasting: %s", message_to_send_clients);
-            for (int j = 0; j < MAX_CLIENTS; j++) {
-              if (clients[j].active) {
-                send(clients[j].socket, message_to_send_clients,
-                     strlen(message_to_send_clients), 0);
-              }
-            }
-          }
-        } else { // recv_size <= 0: Disconnect or error
-          char client_ip_str[INET_ADDRSTRLEN];
-          inet_ntop(AF_INET, &clients[i].address.sin_addr, client_ip_str,
-                    INET_ADDRSTRLEN);
-          printf("%s (socket %d, ip %s, slot %d) disconnected.\n",
-                 clients[i].username, (int)sender_socket, client_ip_str, i);
-          snprintf(system_message, sizeof(system_message),
-                   "System: %s has left the chat.\n", clients[i].username);
-          log_message(system_message);
-          FD_CLR(sender_socket, &master_fds);
-          close_socket(sender_socket);
-          clients[i].active = 0;
-          clients[i].socket = 0;
-          memset(clients[i].username, 0, USERNAME_MAX_LEN);
-          printf("Broadcasting: %s", system_message);
-          for (int j = 0; j < MAX_CLIENTS; j++)
-            if (clients[j].active)
-              send(clients[j].socket, system_message, strlen(system_message),
-                   0);
-        }
-      }
-    }
+// Parks a record for the writer to pick up directly. Caller holds
+// g_log_mutex. Returns 0, or -1 if out of memory.
+int log_spill(const char *record, size_t len) {
+  log_spill_t *spill = (log_spill_t *)malloc(sizeof(log_spill_t) + len);
+  if (spill == NULL) {
+    return -1;
+  }
+  spill->next = NULL;
+  spill->len = len;
+  memcpy(spill->data, record, len);
+  if (g_log.spill_tail != NULL) {
+    g_log.spill_tail->next = spill;
+  } else {
+    g_log.spill_head = spill;
   }
+  g_log.spill_tail = spill;
+  atomic_fetch_add_explicit(&g_log.spill_bytes, len, memory_order_relaxed);
+  STAT_ADD(log_spilled, 1);
+  t_shard->log_pushed = 1;
+  return 0;
+}
 
-  // Cleanup (currently unreachable)
-  printf("Server shutting down.\n");
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (clients[i].socket != 0) {
-      close_socket(clients[i].socket);
+// Numbers a record and hands it to the writer, applying --log-full if this
+// shard's ring is full. Numbering and queueing happen together under
+// g_log_mutex, so each ring holds its records in sequence order. A record
+// only gets a number once it is queued, so the log has no gaps. Numbered
+// records also go into `group`'s history ring if not NULL. Returns the
+// number, or 0 if the record was dropped.
+uint64_t log_enqueue(char *record, size_t len, history_ring_t *group) {
+  const char *line = record + sizeof(log_record_t);
+  size_t line_len = len - sizeof(log_record_t);
+  int blocked = 0;
+  mutex_lock(&g_log_mutex);
+  for (;;) {
+    memcpy(record, &g_log.next_seq, sizeof(uint64_t)); // log_record_t.seq
+    // Once anything is spilled, later records queue behind it
+    if (g_log.spill_head == NULL && log_push(record, len) == 0) {
+      break;
+    }
+    if (g_log_full == LOG_FULL_SPILL && log_spill(record, len) == 0) {
+      break;
+    }
+    if (g_log_full != LOG_FULL_BLOCK) {
+      STAT_ADD(log_dropped, 1); // It only lives on in the history ring
+      history_push(&g_history, 0, line, line_len);
+      mutex_unlock(&g_log_mutex);
+      return 0;
     }
+    if (!blocked) {
+      STAT_ADD(log_blocked, 1);
+      blocked = 1;
+    }
+    mutex_unlock(&g_log_mutex);
+    log_wake_writer();
+    thread_sleep_ms(LOG_BLOCK_SLEEP_MS);
+    mutex_lock(&g_log_mutex);
+  }
+  uint64_t seq = g_log.next_seq++;
+  history_push(&g_history, seq, line, line_len);
+  if (group != NULL) {
+    history_push(group, seq, line, line_len);
+  }
+  mutex_unlock(&g_log_mutex);
+  return seq;
+}
+
+// Once per event-loop batch: wake the writer for whatever this batch
+// logged, so a burst is written as a group.
+void log_commit(void) {
+  if (t_shard->log_pushed) {
+    log_wake_writer();
+  }
+}
+
+// Stamps a message for those in `scope` (see log_scope_parse()) and queues
+// it for the log, also adding it to `group`'s history ring if not NULL.
+// See log_message().
+uint64_t log_line(const char *scope, const char *message,
+                  history_ring_t *group) {
+  struct timespec now;
+  ts_wall_now(&now);
+  char record[sizeof(log_record_t) + HISTORY_LINE_MAX];
+  char *line = record + sizeof(log_record_t);
+  char timestamp[STAMP_MAX_LEN];
+  format_stamp(&now, timestamp, sizeof(timestamp));
+  int len = snprintf(line, HISTORY_LINE_MAX, "%s[%s] ", scope, timestamp);
+  if (len < 0 || len >= HISTORY_LINE_MAX) {
+    return 0;
+  }
+  // Assume message has newline
+  len += (int)flatten_text(line + len, HISTORY_LINE_MAX - (size_t)len,
+                           message, strlen(message));
+  if (len == 0 || line[len - 1] != '\n') {
+    // Every record is exactly one line in the file
+    if (len == HISTORY_LINE_MAX - 1) {
+      len--;
+    }
+    line[len++] = '\n';
+  }
+  log_record_t header = {0, (int64_t)now.tv_sec}; // Numbered when queued
+  memcpy(record, &header, sizeof(header));
+  return log_enqueue(record, sizeof(header) + (size_t)len, group);
+}
+
+// Logs a message to the chat file. Returns its record number, which goes
+// out with it to clients that asked for numbers, or 0 if it was dropped.
+// It is replayed to everyone.
+uint64_t log_message(const char *message) {
+  return log_line("* ", message, NULL);
+}
+
+// Same, for a DM, which is only replayed to its sender and recipient
+uint64_t log_dm_message(const char *from, const char *to,
+                        const char *message) {
+  char scope[LOG_SCOPE_MAX];
+  snprintf(scope, sizeof(scope), "D%lu:%s%lu:%s ",
+           (unsigned long)strlen(from), from, (unsigned long)strlen(to), to);
+  return log_line(scope, message, NULL);
+}
+
+// Same, for a message to group `group_idx`, which is only replayed to its
+// members and is also kept in the group's own history ring
+uint64_t log_group_message(int group_idx, const char *message) {
+  char scope[LOG_SCOPE_MAX];
+  const char *name = g_groups[group_idx].name;
+  snprintf(scope, sizeof(scope), "G%lu:%.*s ", (unsigned long)strlen(name),
+           GROUPNAME_MAX_LEN - 1, name);
+  return log_line(scope, message, &g_groups[group_idx].history);
+}
+
+// --- Client table ---
+
+// Doubles the calling shard's client table, up to its limit. The new slots
+// go on the free list lowest first. Returns 0 on success, -1 if full.
+int client_table_grow(void) {
+  shard_t *shard = t_shard;
+  if (shard->clients_cap >= shard->clients_max) {
+    return -1;
+  }
+  int new_cap = shard->clients_cap ? shard->clients_cap * 2
+                                   : CLIENT_TABLE_INITIAL;
+  if (new_cap > shard->clients_max) {
+    new_cap = shard->clients_max;
+  }
+  client_info_t **clients = (client_info_t **)realloc(
+      shard->clients, (size_t)new_cap * sizeof(client_info_t *));
+  if (clients == NULL) {
+    return -1;
+  }
+  shard->clients = clients;
+  int **lists[] = {&shard->active_slots, &shard->out_dirty,
+                   &shard->out_flushing};
+  for (size_t l = 0; l < sizeof(lists) / sizeof(lists[0]); l++) {
+    int *grown = (int *)realloc(*lists[l], (size_t)new_cap * sizeof(int));
+    if (grown == NULL) {
+      return -1;
+    }
+    *lists[l] = grown;
+  }
+  for (int g = 0; g < g_num_groups; g++) {
+    int *grown = (int *)realloc(shard->group_online[g].slots,
+                                (size_t)new_cap * sizeof(int));
+    if (grown == NULL) {
+      return -1;
+    }
+    shard->group_online[g].slots = grown;
+  }
+  for (int k = new_cap - 1; k >= shard->clients_cap; k--) {
+    client_info_t *client = (client_info_t *)calloc(1, sizeof(client_info_t));
+    if (client == NULL) {
+      // Keep the slots that were allocated
+      for (int j = k + 1; j < new_cap; j++) {
+        free(clients[j]);
+      }
+      return -1;
+    }
+    client->slot = k;
+    client->next_free = k == new_cap - 1 ? shard->free_head : k + 1;
+    clients[k] = client;
+  }
+  shard->free_head = shard->clients_cap;
+  shard->clients_cap = new_cap;
+  return 0;
+}
+
+// Takes a free slot in O(1), growing the table when none is left.
+// Returns the slot, or -1 if the shard is at its connection limit.
+int client_slot_alloc(void) {
+  if (t_shard->free_head < 0 && client_table_grow() < 0) {
+    return -1;
+  }
+  int i = t_shard->free_head;
+  t_shard->free_head = t_shard->clients[i]->next_free;
+  return i;
+}
+
+void client_slot_free(int i) {
+  t_shard->clients[i]->next_free = t_shard->free_head;
+  t_shard->free_head = i;
+}
+
+// Marks a client logged in and adds it to the fan-out list and the
+// username index. Returns 0 on success, -1 if the index is out of memory.
+int client_set_active(int i) {
+  client_info_t *client = t_shard->clients[i];
+  client_info_t *same_name =
+      (client_info_t *)strmap_get(&t_shard->by_name, client->username);
+  if (same_name != NULL) {
+    // Further sessions of a name chain behind the first one
+    client->name_next = same_name->name_next;
+    same_name->name_next = i;
+  } else {
+    client->name_next = -1;
+    if (strmap_put(&t_shard->by_name, client->username, client) < 0) {
+      return -1;
+    }
+  }
+  client->active = 1;
+  client->active_pos = t_shard->num_active;
+  t_shard->active_slots[t_shard->num_active++] = i;
+
+  client->groups =
+      (const member_groups_t *)strmap_get(&g_member_groups, client->username);
+  if (client->groups != NULL) {
+    for (int k = 0; k < client->groups->num_groups; k++) {
+      int g = client->groups->groups[k];
+      group_online_t *online = &t_shard->group_online[g];
+      client->group_pos[k] = online->count;
+      online->slots[online->count++] = i;
+    }
+  }
+  return 0;
+}
+
+void client_clear_active(int i) {
+  client_info_t *client = t_shard->clients[i];
+  if (!client->active) {
+    return;
+  }
+  int last = t_shard->active_slots[--t_shard->num_active];
+  t_shard->active_slots[client->active_pos] = last;
+  t_shard->clients[last]->active_pos = client->active_pos;
+  client->active = 0;
+
+  if (client->groups != NULL) {
+    for (int k = 0; k < client->groups->num_groups; k++) {
+      int g = client->groups->groups[k];
+      group_online_t *online = &t_shard->group_online[g];
+      client_info_t *moved = t_shard->clients[online->slots[--online->count]];
+      online->slots[client->group_pos[k]] = moved->slot;
+      // Find which of the moved client's groups this is
+      for (int mk = 0; mk < moved->groups->num_groups; mk++) {
+        if (moved->groups->groups[mk] == g) {
+          moved->group_pos[mk] = client->group_pos[k];
+          break;
+        }
+      }
+    }
+    client->groups = NULL;
+  }
+
+  client_info_t *first =
+      (client_info_t *)strmap_get(&t_shard->by_name, client->username);
+  if (first == client) {
+    strmap_remove(&t_shard->by_name, client->username);
+    if (client->name_next != -1) {
+      client_info_t *next = t_shard->clients[client->name_next];
+      strmap_put(&t_shard->by_name, next->username, next); // Cannot grow
+    }
+  } else if (first != NULL) {
+    client_info_t *prev = first;
+    while (prev->name_next != -1 && prev->name_next != i) {
+      prev = t_shard->clients[prev->name_next];
+    }
+    prev->name_next = client->name_next;
+  }
+  client->name_next = -1;
+}
+
+void client_mark_dirty(int i) {
+  if (!t_shard->clients[i]->send_queued) {
+    t_shard->clients[i]->send_queued = 1;
+    t_shard->out_dirty[t_shard->num_out_dirty++] = i;
+  }
+}
+
+size_t out_msg_size(const out_msg_t *s) { return s->prefix_len + s->len; }
+
+// Takes the head message off a client's queue. Its `next` is left alone:
+// io_uring walks the messages of a send in flight through it.
+void client_pop_output(client_info_t *client) {
+  out_msg_t *s = client->out_head;
+  client->out_head = s->next;
+  if (client->out_head != NULL) {
+    client->out_head->prev = NULL;
+  } else {
+    client->out_tail = NULL;
+  }
+  if (s == client->chatter_head) {
+    client->chatter_head = s->next_chatter;
+    if (client->chatter_head == NULL) {
+      client->chatter_tail = NULL;
+    }
+  }
+}
+
+// Lists the unwritten part of up to SEND_IOV_MAX / 2 queued messages,
+// prefix and shared payload as separate buffers. Returns the number of
+// buffers; `count` (if set) gets the number of messages.
+int client_gather_output(client_info_t *client, socket_iov_t *iov,
+                         int *count) {
+  int n = 0, messages = 0;
+  size_t skip = client->out_offset;
+  for (out_msg_t *s = client->out_head; s != NULL && n + 2 <= SEND_IOV_MAX;
+       s = s->next) {
+    if (skip < s->prefix_len) {
+      socket_iov_set(&iov[n++], s->prefix + skip, s->prefix_len - skip);
+      skip = 0;
+    } else {
+      skip -= s->prefix_len;
+    }
+    if (skip < s->len) {
+      socket_iov_set(&iov[n++], s->buf->data + skip, s->len - skip);
+    }
+    skip = 0;
+    messages++;
+  }
+  if (count != NULL) {
+    *count = messages;
+  }
+  return n;
+}
+
+// Reactor mode: writes queued output until the socket would block, and
+// watches for write readiness only while something is left over. Queued
+// messages go out several per call, gathered straight from their shared
+// buffers. Returns 0 on success, -1 if the connection failed.
+int client_flush_output(int i) {
+  client_info_t *client = t_shard->clients[i];
+  while (client->out_head != NULL) {
+    socket_iov_t iov[SEND_IOV_MAX];
+    int n = client_gather_output(client, iov, NULL);
+    long sent = socket_sendv(client->socket, iov, n, SERVER_SEND_FLAGS);
+    if (sent > 0) {
+      size_t left = (size_t)sent;
+      client->out_bytes -= left;
+      while (client->out_head != NULL) {
+        out_msg_t *s = client->out_head;
+        size_t rest = out_msg_size(s) - client->out_offset;
+        if (rest > left) {
+          client->out_offset += left;
+          break;
+        }
+        left -= rest;
+        client_pop_output(client);
+        client->out_offset = 0;
+        send_buf_release(s->buf);
+        free(s);
+      }
+    } else if (sent < 0 && socket_interrupted()) {
+      continue;
+    } else if (sent < 0 && socket_would_block()) {
+      break;
+    } else {
+      return -1;
+    }
+  }
+
+  int want_write = client->out_head != NULL;
+  if (want_write != client->want_write) {
+    unsigned interest = REACTOR_READ | REACTOR_EDGE;
+    if (want_write) {
+      interest |= REACTOR_WRITE;
+    }
+    if (reactor_modify(&t_shard->reactor, client->socket, interest, client) <
+        0) {
+      return -1;
+    }
+    client->want_write = want_write;
+  }
+  return 0;
+}
+
+// Unlinks queued chatter, oldest first, until `need` more bytes fit under the
+// client's limit (SIZE_MAX: all of it). A partially written head stays.
+// Returns the number of messages dropped.
+unsigned long client_drop_chatter(int i, size_t need) {
+  client_info_t *client = t_shard->clients[i];
+  unsigned long dropped = 0;
+  out_msg_t **link = &client->chatter_head;
+  out_msg_t *kept = NULL;
+  if (client->out_offset > 0 && *link != NULL && *link == client->out_head) {
+    kept = *link;
+    link = &kept->next_chatter;
+  }
+  while (*link != NULL && (need == SIZE_MAX ||
+                           client->out_bytes + need > client->out_limit)) {
+    out_msg_t *s = *link;
+    *link = s->next_chatter;
+    if (s->prev != NULL) {
+      s->prev->next = s->next;
+    } else {
+      client->out_head = s->next;
+    }
+    if (s->next != NULL) {
+      s->next->prev = s->prev;
+    } else {
+      client->out_tail = s->prev;
+    }
+    client->out_bytes -= out_msg_size(s);
+    send_buf_release(s->buf);
+    free(s);
+    dropped++;
+  }
+  if (*link == NULL) {
+    client->chatter_tail = kept;
+  }
+  return dropped;
+}
+
+// Applies the slow-consumer policy to a message that would take the client
+// over its limit. Returns 1 if the message should still be queued.
+int slow_consumer_admit(int i, size_t len, int chatter) {
+  client_info_t *client = t_shard->clients[i];
+  unsigned long n;
+  switch (g_slow_policy) {
+  case SLOW_POLICY_DROP_OLDEST:
+    n = client_drop_chatter(i, len);
+    if (chatter && client->out_bytes + len > client->out_limit) {
+      n++; // Nothing older left to drop, so this one goes
+      STAT_ADD(slow_dropped, n);
+      return 0;
+    }
+    STAT_ADD(slow_dropped, n);
+    break;
+  case SLOW_POLICY_COLLAPSE:
+    n = client_drop_chatter(i, SIZE_MAX);
+    client->missed += n;
+    STAT_ADD(slow_collapsed, n);
+    if (chatter) {
+      client->missed++;
+      STAT_ADD(slow_collapsed, 1);
+      return 0;
+    }
+    break;
+  case SLOW_POLICY_DISCONNECT:
+    if (g_slow_timeout == 0) {
+      client->out_overflow = 1;
+      client_mark_dirty(i);
+      return 0;
+    }
+    break;
+  }
+  // DMs and replies are kept, but a backlog must not grow without bound
+  if (client->out_bytes + len > client->out_limit * SEND_HARD_LIMIT_FACTOR) {
+    client->out_overflow = 1;
+    client_mark_dirty(i);
+    return 0;
+  }
+  if (client->over_limit_since == 0 &&
+      client->out_bytes + len > client->out_limit) {
+    client->over_limit_since = time(NULL);
+  }
+  return 1;
+}
+
+// Queues `prefix` followed by the first `len` bytes of a shared buffer for
+// a client; they go out at the end of the current event loop iteration.
+// The buffer is referenced, not copied. `chatter` marks global/group
+// traffic, which the slow-consumer policy may discard once the client's
+// backlog is over its limit; everything else is always delivered (or the
+// client dropped).
+void client_queue_prefixed(int i, const char *prefix, size_t prefix_len,
+                           send_buf_t *buf, size_t len, int chatter) {
+  client_info_t *client = t_shard->clients[i];
+  size_t size = prefix_len + len;
+  if (client->out_overflow || client->closing || size == 0) {
+    return;
+  }
+  if (client->out_bytes + size > client->out_limit && !t_shard->use_uring) {
+    client_flush_output(i); // The peer may have caught up since the last try
+  }
+  if (client->out_bytes + size > client->out_limit &&
+      !slow_consumer_admit(i, size, chatter)) {
+    return;
+  }
+  out_msg_t *s = (out_msg_t *)malloc(sizeof(out_msg_t));
+  if (s == NULL) {
+    perror("client_queue_send: malloc failed");
+    return;
+  }
+  s->next = NULL;
+  s->prev = client->out_tail;
+  s->next_chatter = NULL;
+  s->buf = buf;
+  s->len = len;
+  if (prefix_len > 0) {
+    memcpy(s->prefix, prefix, prefix_len);
+  }
+  s->prefix_len = prefix_len;
+  s->slot = i;
+  s->generation = client->generation;
+  s->chatter = chatter;
+  buf->refs++;
+
+  int was_idle = client->out_head == NULL;
+  if (client->out_tail != NULL) {
+    client->out_tail->next = s;
+  } else {
+    client->out_head = s;
+  }
+  client->out_tail = s;
+  if (chatter) {
+    if (client->chatter_tail != NULL) {
+      client->chatter_tail->next_chatter = s;
+    } else {
+      client->chatter_head = s;
+    }
+    client->chatter_tail = s;
+  }
+  client->out_bytes += size;
+
+  // In reactor mode an idle connection is written straight through, so one
+  // long burst of input can't pile output up until the end of the batch.
+  // Whatever doesn't fit (or fails) is dealt with at the next flush.
+  if (!t_shard->use_uring && !client->corked && was_idle &&
+      client_flush_output(i) == 0 && client->out_head == NULL) {
+    return;
+  }
+  client_mark_dirty(i);
+}
+
+// Queues all of a shared buffer for a client
+void client_queue_send(int i, send_buf_t *buf, int chatter) {
+  client_queue_prefixed(i, NULL, 0, buf, buf->len, chatter);
+}
+
+// Discards everything still queued (but not in flight) for a client
+void client_drop_output(int i) {
+  client_info_t *client = t_shard->clients[i];
+  while (client->out_head != NULL) {
+    out_msg_t *s = client->out_head;
+    client->out_head = s->next;
+    client->out_bytes -= out_msg_size(s) - client->out_offset;
+    client->out_offset = 0;
+    send_buf_release(s->buf);
+    free(s);
+  }
+  client->out_tail = NULL;
+  client->chatter_head = NULL;
+  client->chatter_tail = NULL;
+}
+
+#if URING_AVAILABLE
+// Turns a client's queued sends into one chain of linked SQEs, each a
+// sendmsg() gathering several messages. Only one chain per client is in
+// flight at a time, which keeps its output ordered; everything queued
+// meanwhile goes out in the next chain.
+void uring_submit_output(int i) {
+  client_info_t *client = t_shard->clients[i];
+  if (client->sends_in_flight > 0 || client->out_head == NULL) {
+    return; // Resubmitted when the current chain completes
+  }
+  // A chain must not straddle two io_uring_enter() calls
+  if (uring_sq_space_left(&t_shard->uring) < URING_MAX_CHAIN) {
+    uring_submit(&t_shard->uring, 0);
+  }
+  struct io_uring_sqe *prev = NULL;
+  while (client->out_head != NULL &&
+         client->sends_in_flight < URING_MAX_CHAIN &&
+         uring_sq_space_left(&t_shard->uring) > 0) {
+    uring_send_t *send = (uring_send_t *)malloc(sizeof(uring_send_t));
+    if (send == NULL) {
+      perror("uring_submit_output: malloc failed");
+      break;
+    }
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen =
+        (size_t)client_gather_output(client, send->iov, &send->count);
+    send->first = client->out_head;
+    for (int k = 0; k < send->count; k++) {
+      client_pop_output(client);
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&t_shard->uring);
+    uring_prep_sendmsg(sqe, client->socket, &send->msg,
+                       MSG_NOSIGNAL | MSG_WAITALL);
+    sqe->user_data = (unsigned long long)(uintptr_t)send | URING_TAG_SEND;
+    if (prev != NULL) {
+      prev->flags |= IOSQE_IO_LINK;
+    }
+    prev = sqe;
+    client->sends_in_flight++;
+  }
+}
+#endif
+
+// Queues data for one client. Returns 0 on success, -1 on error.
+int client_send(int i, const char *data, size_t len) {
+  send_buf_t *buf = t_shard->clients[i]->binary ? send_buf_new_frames(data, len)
+                                                : send_buf_new(data, len);
+  if (buf == NULL) {
+    return -1;
+  }
+  client_queue_send(i, buf, 0);
+  send_buf_release(buf);
+  return 0;
+}
+
+int client_send_str(int i, const char *str) {
+  return client_send(i, str, strlen(str));
+}
+
+// Called whenever a client's backlog may have shrunk: ends its time over
+// the limit and, once it has mostly caught up, tells it what it missed.
+void slow_consumer_check_drained(int i) {
+  client_info_t *client = t_shard->clients[i];
+  if (client->out_bytes > client->out_limit / 2 || client->closing) {
+    return;
+  }
+  client->over_limit_since = 0;
+  if (client->missed > 0) {
+    char marker[100];
+    snprintf(marker, sizeof(marker),
+             "System: You missed %lu messages while your connection was "
+             "backed up.\n",
+             client->missed);
+    client->missed = 0;
+    STAT_ADD(slow_markers, 1);
+    client_send_str(i, marker);
+  }
+}
+
+// One message on its way to many local clients, formatted once: every
+// recipient queues a reference to the same buffer, behind its own record
+// tag or frame header. Built on first use.
+typedef struct {
+  const char *text;
+  uint64_t seq; // 0 if not logged: never tagged
+  send_buf_t *buf;  // `text`
+  send_buf_t *flat; // `text` with its line breaks spelled out, if it has any
+  char tag[SEQ_TAG_MAX]; // "#<seq> " for want_seq clients
+  size_t tag_len;
+  unsigned char header[WIRE_HEADER_SIZE]; // WIRE_OP_LINE for binary clients
+} fanout_t;
+
+// Builds the shared buffers and prefixes. Returns -1 if out of memory.
+int fanout_prepare(fanout_t *out) {
+  size_t len = strlen(out->text);
+  if (out->flat == NULL && text_has_breaks(out->text, len)) {
+    char *flat = (char *)malloc(2 * len + 1);
+    if (flat == NULL) {
+      return -1;
+    }
+    size_t flat_len = flatten_text(flat, 2 * len + 1, out->text, len);
+    out->flat = send_buf_new(flat, flat_len);
+    free(flat);
+    if (out->flat == NULL) {
+      return -1;
+    }
+  }
+  out->buf = send_buf_new(out->text, len);
+  if (out->buf == NULL) {
+    return -1;
+  }
+  if (out->seq != 0) {
+    out->tag_len = format_seq_tag(out->seq, out->tag, sizeof(out->tag));
+  }
+  size_t body = len > 0 && out->text[len - 1] == '\n' ? len - 1 : len;
+  wire_header_t h = {(uint32_t)body, WIRE_OP_LINE, WIRE_NO_ID, out->seq};
+  wire_encode_header(out->header, &h);
+  return 0;
+}
+
+// Queues the message for client `j`. Returns 0 if it was skipped: the
+// client already got this record in its login replay, or memory ran out.
+int fanout_queue(fanout_t *out, int j, int chatter) {
+  client_info_t *client = t_shard->clients[j];
+  if (out->seq != 0 && out->seq < client->seq_floor) {
+    return 0;
+  }
+  if (out->buf == NULL && fanout_prepare(out) < 0) {
+    return 0;
+  }
+  if (client->binary) {
+    // The frame carries the payload without its newline
+    size_t len = out->buf->len;
+    if (len > 0 && out->buf->data[len - 1] == '\n') {
+      len--;
+    }
+    client_queue_prefixed(j, (const char *)out->header, WIRE_HEADER_SIZE,
+                          out->buf, len, chatter);
+    return 1;
+  }
+  send_buf_t *buf = out->flat != NULL ? out->flat : out->buf;
+  size_t tag_len = client->want_seq ? out->tag_len : 0;
+  client_queue_prefixed(j, out->tag, tag_len, buf, buf->len, chatter);
+  return 1;
+}
+
+void fanout_release(fanout_t *out) {
+  if (out->buf != NULL) {
+    send_buf_release(out->buf);
+  }
+  if (out->flat != NULL) {
+    send_buf_release(out->flat);
+  }
+}
+
+// Sends logged record `seq` (0 if none) to one client
+void client_send_logged(int i, const char *text, uint64_t seq) {
+  fanout_t out = {text, seq, NULL, NULL, {0}, 0, {0}};
+  fanout_queue(&out, i, 0);
+  fanout_release(&out);
+}
+
+// Sends a message to every active client of this shard except slot
+// `exclude_idx` (-1 for none). All recipients share a single copy of it.
+void deliver_local_broadcast(const char *message, int exclude_idx,
+                             uint64_t seq) {
+  fanout_t out = {message, seq, NULL, NULL, {0}, 0, {0}};
+  for (int a = 0; a < t_shard->num_active; a++) {
+    int j = t_shard->active_slots[a];
+    if (j != exclude_idx) {
+      fanout_queue(&out, j, 1);
+    }
+  }
+  fanout_release(&out);
+}
+
+// Returns the local slot of an active client, or -1
+int find_local_client(const char *username) {
+  client_info_t *client =
+      (client_info_t *)strmap_get(&t_shard->by_name, username);
+  return client != NULL ? client->slot : -1;
+}
+
+// Sends `text` (record `seq`) to every active local client of `group_idx`.
+// Returns the number of members messaged.
+int deliver_local_group(int group_idx, const char *text, uint64_t seq) {
+  int members_messaged = 0;
+  fanout_t out = {text, seq, NULL, NULL, {0}, 0, {0}};
+  group_online_t *online = &t_shard->group_online[group_idx];
+  for (int k = 0; k < online->count; k++) {
+    members_messaged += fanout_queue(&out, online->slots[k], 1);
+  }
+  fanout_release(&out);
+  return members_messaged;
+}
+
+// --- Presence directory ---
+
+void presence_add(const char *username, int shard_id) {
+  mutex_lock(&g_presence_mutex);
+  presence_entry_t *entry =
+      (presence_entry_t *)strmap_get(&g_presence, username);
+  if (entry == NULL) {
+    entry = (presence_entry_t *)calloc(1, sizeof(presence_entry_t));
+    if (entry == NULL) {
+      perror("presence_add: calloc failed");
+      mutex_unlock(&g_presence_mutex);
+      return;
+    }
+    strncpy(entry->username, username, USERNAME_MAX_LEN - 1);
+    if (strmap_put(&g_presence, entry->username, entry) < 0) {
+      perror("presence_add: out of memory");
+      free(entry);
+      mutex_unlock(&g_presence_mutex);
+      return;
+    }
+  }
+  entry->sessions[shard_id]++;
+  entry->shard_mask |= 1ULL << shard_id;
+  mutex_unlock(&g_presence_mutex);
+}
+
+void presence_remove(const char *username, int shard_id) {
+  mutex_lock(&g_presence_mutex);
+  presence_entry_t *entry =
+      (presence_entry_t *)strmap_get(&g_presence, username);
+  if (entry != NULL && entry->sessions[shard_id] > 0 &&
+      --entry->sessions[shard_id] == 0) {
+    entry->shard_mask &= ~(1ULL << shard_id);
+    if (entry->shard_mask == 0) {
+      strmap_remove(&g_presence, entry->username);
+      free(entry);
+    }
+  }
+  mutex_unlock(&g_presence_mutex);
+}
+
+// Returns a shard other than `exclude_shard` (-1: any shard) where
+// `username` is online, or -1
+int presence_find_remote(const char *username, int exclude_shard) {
+  int found = -1;
+  mutex_lock(&g_presence_mutex);
+  presence_entry_t *entry =
+      (presence_entry_t *)strmap_get(&g_presence, username);
+  if (entry != NULL) {
+    unsigned long long others = entry->shard_mask;
+    if (exclude_shard >= 0) {
+      others &= ~(1ULL << exclude_shard);
+    }
+    for (int s = 0; others != 0; s++, others >>= 1) {
+      if (others & 1) {
+        found = s;
+        break;
+      }
+    }
+  }
+  mutex_unlock(&g_presence_mutex);
+  return found;
+}
+
+// --- Cross-shard mailboxes ---
+
+// A message for a shard, carrying a copy of `text`. Returns NULL if out
+// of memory.
+shard_msg_t *shard_msg_new(shard_msg_type_t type, const char *target,
+                           const char *text) {
+  size_t len = strlen(text);
+  shard_msg_t *msg = (shard_msg_t *)malloc(sizeof(shard_msg_t) + len + 1);
+  if (msg == NULL) {
+    perror("shard_msg_new: malloc failed");
+    return NULL;
+  }
+  msg->type = type;
+  msg->target[0] = '\0';
+  if (target != NULL) {
+    strncpy(msg->target, target, USERNAME_MAX_LEN - 1);
+    msg->target[USERNAME_MAX_LEN - 1] = '\0';
+  }
+  msg->group_idx = -1;
+  msg->seq = 0;
+  msg->slot = -1;
+  msg->generation = 0;
+  msg->mail_size = 0;
+  msg->len = len;
+  memcpy(msg->text, text, len + 1);
+  return msg;
+}
+
+// Hands a message to a shard and wakes its event loop. Any thread may call
+// this.
+void shard_push(int shard_id, shard_msg_t *msg) {
+  shard_t *dest = &g_shards[shard_id];
+  mpsc_push(&dest->mailbox, &msg->node);
+#if SERVER_HAVE_SHARDS
+  // Only the first post after the consumer re-armed needs a syscall
+  if (!atomic_exchange(&dest->mailbox_signaled, 1)) {
+    unsigned long long one = 1;
+    if (write(dest->wake_write_fd, &one, sizeof(one)) < 0) {
+      perror("shard_push: wakeup write failed");
+    }
+  }
+#endif
+}
+
+// Queues a message for another shard
+void shard_post(int shard_id, shard_msg_type_t type, const char *target,
+                int group_idx, const char *text, uint64_t seq) {
+  shard_msg_t *msg = shard_msg_new(type, target, text);
+  if (msg == NULL) {
+    return;
+  }
+  msg->group_idx = group_idx;
+  msg->seq = seq;
+  shard_push(shard_id, msg);
+}
+
+void shard_post_others(shard_msg_type_t type, const char *target,
+                       int group_idx, const char *text, uint64_t seq) {
+  for (int k = 0; k < g_num_shards; k++) {
+    if (k != t_shard->id) {
+      shard_post(k, type, target, group_idx, text, seq);
+    }
+  }
+}
+
+// --- Offline DM mailboxes ---
+//
+// DMs for offline users are kept in files (dmstore.h) that only the
+// mailbox thread touches, so compacting a full mailbox never holds up a
+// loop. Shards queue jobs for it and it answers through their cross-shard
+// mailboxes. Jobs run in the order they were queued, and a login shows up
+// in the presence directory before it queues its TAKE, so a STORE racing
+// that login either runs first (and is taken) or finds the user online
+// and forwards the DM instead.
+
+void mail_wake(void) {
+  mutex_lock(&g_mail.mutex);
+  g_mail.wake_pending = 1;
+  cond_signal(&g_mail.wake);
+  mutex_unlock(&g_mail.mutex);
+}
+
+// A job for the mailbox thread carrying a copy of `text` (NULL: none).
+// Returns NULL if out of memory.
+mail_job_t *mail_job_new(mail_job_type_t type, const char *user,
+                         const char *text) {
+  size_t len = text != NULL ? strlen(text) : 0;
+  mail_job_t *job = (mail_job_t *)malloc(sizeof(mail_job_t) + len + 1);
+  if (job == NULL) {
+    perror("mail_job_new: malloc failed");
+    return NULL;
+  }
+  job->type = type;
+  strncpy(job->user, user, USERNAME_MAX_LEN - 1);
+  job->user[USERNAME_MAX_LEN - 1] = '\0';
+  job->shard = -1;
+  job->slot = -1;
+  job->generation = 0;
+  job->seq = 0;
+  job->size = 0;
+  memcpy(job->text, text != NULL ? text : "", len + 1);
+  return job;
+}
+
+// Queues a job, naming local client `i` (-1: nobody) as the one to answer
+void mail_post(mail_job_t *job, int i) {
+  if (i >= 0) {
+    job->shard = t_shard->id;
+    job->slot = i;
+    job->generation = t_shard->clients[i]->generation;
+  }
+  mpsc_push(&g_mail.jobs, &job->node);
+  mail_wake();
+}
+
+// Has `text` (logged as record `seq`) kept for `recipient`, found offline.
+// Sender `i` (-1: none) hears about it if that fails.
+void mailbox_store(const char *recipient, const char *text, uint64_t seq,
+                   int i) {
+  mail_job_t *job = mail_job_new(MAIL_JOB_STORE, recipient, text);
+  if (job == NULL) {
+    if (i >= 0) {
+      client_send_str(i, "System: Your DM could not be saved.\n");
+    }
+    return;
+  }
+  job->seq = seq;
+  mail_post(job, i);
+}
+
+// Has the DMs kept for client `i`, which just logged in, sent to it
+void mailbox_take(int i) {
+  mail_job_t *job =
+      mail_job_new(MAIL_JOB_TAKE, t_shard->clients[i]->username, NULL);
+  if (job != NULL) {
+    mail_post(job, i);
+  }
+}
+
+// Deletes the first `size` bytes of `user`'s mailbox, now delivered
+void mailbox_drop(const char *user, long size) {
+  mail_job_t *job = mail_job_new(MAIL_JOB_DROP, user, NULL);
+  if (job != NULL) {
+    job->size = size;
+    mail_post(job, -1);
+  }
+}
+
+// Mailbox thread: sends the session named in `job` a message, if any
+void mail_answer(const mail_job_t *job, shard_msg_type_t type,
+                 const char *text, long mail_size) {
+  if (job->shard < 0) {
+    return;
+  }
+  shard_msg_t *msg = shard_msg_new(type, job->user, text);
+  if (msg == NULL) {
+    return;
+  }
+  msg->slot = job->slot;
+  msg->generation = job->generation;
+  msg->mail_size = mail_size;
+  shard_push(job->shard, msg);
+}
+
+// Mailbox thread: keeps a DM, or forwards it if its recipient has come
+// online since it was queued
+void mail_run_store(const mail_job_t *job) {
+  int online = presence_find_remote(job->user, -1);
+  if (online != -1) {
+    shard_post(online, SHARD_MSG_DIRECT, job->user, -1, job->text, job->seq);
+    return;
+  }
+  size_t len = strlen(job->text);
+  char *flat = (char *)malloc(2 * len + 1);
+  int ret = -1;
+  if (flat != NULL) {
+    len = flatten_text(flat, 2 * len + 1, job->text, len);
+    ret = dmstore_put(&g_mailboxes, job->user, (int64_t)time(NULL), flat,
+                      len);
+    free(flat);
+  }
+  if (ret == 0) {
+    return;
+  }
+  const char *why =
+      ret > 0 ? "their mailbox is full" : "it could not be saved";
+  printf("Dropped DM for offline user %s: %s.\n", job->user, why);
+  char notice[USERNAME_MAX_LEN + 100];
+  snprintf(notice, sizeof(notice),
+           "System: Your DM to %s was not kept: %s.\n", job->user, why);
+  mail_answer(job, SHARD_MSG_NOTICE, notice, 0);
+}
+
+// Mailbox thread: formats `count` records from dmstore_get(), stamped with
+// when they were sent. Returns a malloc()ed string, or NULL.
+char *mail_format(const char *records, size_t len, long count) {
+  static const char footer[] = "--- End of Messages ---\n";
+  size_t cap = len + (size_t)count * (STAMP_MAX_LEN + 4) + 64 + sizeof(footer);
+  char *buf = (char *)malloc(cap);
+  if (buf == NULL) {
+    return NULL;
+  }
+  size_t out = (size_t)snprintf(buf, cap,
+                                "--- %ld message%s while you were away ---\n",
+                                count, count == 1 ? "" : "s");
+  ts_cache_t cache = {0};
+  const char *p = records, *end = records + len;
+  int64_t when;
+  const char *text;
+  size_t n;
+  while ((p = dmstore_next(p, end, &when, &text, &n)) != NULL) {
+    struct timespec sent = {(time_t)when, 0};
+    buf[out++] = '[';
+    out += ts_format(&cache, &sent, TS_PRECISION_SEC, buf + out, cap - out);
+    buf[out++] = ']';
+    buf[out++] = ' ';
+    memcpy(buf + out, text, n);
+    out += n;
+    buf[out++] = '\n';
+  }
+  memcpy(buf + out, footer, sizeof(footer));
+  return buf;
+}
+
+// Mailbox thread: sends a new session what was kept for it. The mailbox
+// is only emptied once the session has it queued (MAIL_JOB_DROP).
+void mail_run_take(const mail_job_t *job) {
+  char *records;
+  size_t len;
+  long size;
+  long count = dmstore_get(&g_mailboxes, job->user, (int64_t)time(NULL),
+                           &records, &len, &size);
+  if (count < 0) {
+    fprintf(stderr, "Could not read the mailbox of %s\n", job->user);
+  }
+  if (count > 0) {
+    char *text = mail_format(records, len, count);
+    if (text == NULL) {
+      perror("mail_run_take: malloc failed");
+    } else {
+      mail_answer(job, SHARD_MSG_MAIL, text, size);
+      free(text);
+    }
+  }
+  free(records);
+}
+
+void *mail_thread(void *arg) {
+  (void)arg;
+  int stopping = 0;
+  for (;;) {
+    mpsc_node_t *node;
+    while ((node = mpsc_pop(&g_mail.jobs)) != NULL) {
+      mail_job_t *job = (mail_job_t *)node;
+      switch (job->type) {
+      case MAIL_JOB_STORE:
+        mail_run_store(job);
+        break;
+      case MAIL_JOB_TAKE:
+        mail_run_take(job);
+        break;
+      case MAIL_JOB_DROP:
+        if (dmstore_drop(&g_mailboxes, job->user, job->size) < 0) {
+          fprintf(stderr, "Could not empty the mailbox of %s\n", job->user);
+        }
+        break;
+      }
+      free(job);
+    }
+    if (stopping) {
+      break;
+    }
+    mutex_lock(&g_mail.mutex);
+    if (!g_mail.wake_pending && !g_mail.stop) {
+      cond_wait_ms(&g_mail.wake, &g_mail.mutex, TICK_INTERVAL_MS);
+    }
+    g_mail.wake_pending = 0;
+    stopping = g_mail.stop; // One last pass before leaving
+    mutex_unlock(&g_mail.mutex);
+  }
+  return NULL;
+}
+
+int mail_thread_start(void) {
+  mpsc_init(&g_mail.jobs);
+  mutex_init(&g_mail.mutex);
+  cond_init(&g_mail.wake);
+  if (thread_create(&g_mail.thread, mail_thread, NULL) < 0) {
+    fprintf(stderr, "Failed to start the mailbox thread.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Runs the jobs still queued and stops the mailbox thread
+void mail_thread_stop(void) {
+  mutex_lock(&g_mail.mutex);
+  g_mail.stop = 1;
+  cond_signal(&g_mail.wake);
+  mutex_unlock(&g_mail.mutex);
+  thread_join(g_mail.thread);
+  cond_destroy(&g_mail.wake);
+  mutex_destroy(&g_mail.mutex);
+}
+
+// Whether slot `i` still holds the logged-in session it held at
+// `generation`
+int session_current(int i, unsigned generation) {
+  client_info_t *client = t_shard->clients[i];
+  return client->socket != 0 && client->active &&
+         client->generation == generation;
+}
+
+// Delivers everything other shards (and the mailbox thread) have posted to
+// this one
+void shard_drain_mailbox(void) {
+#if SERVER_HAVE_SHARDS
+  unsigned long long counter;
+  while (read(t_shard->wake_read_fd, &counter, sizeof(counter)) > 0) {
+  }
+#endif
+  // Re-arm before draining so a post racing with us still signals
+  atomic_store(&t_shard->mailbox_signaled, 0);
+
+  mpsc_node_t *node;
+  while ((node = mpsc_pop(&t_shard->mailbox)) != NULL) {
+    shard_msg_t *msg = (shard_msg_t *)node;
+    switch (msg->type) {
+    case SHARD_MSG_BROADCAST:
+      deliver_local_broadcast(msg->text, -1, msg->seq);
+      break;
+    case SHARD_MSG_DIRECT: {
+      int k = find_local_client(msg->target);
+      if (k != -1) {
+        client_send_logged(k, msg->text, msg->seq);
+      } else {
+        mailbox_store(msg->target, msg->text, msg->seq, -1); // Went offline
+      }
+      break;
+    }
+    case SHARD_MSG_GROUP:
+      deliver_local_group(msg->group_idx, msg->text, msg->seq);
+      break;
+    case SHARD_MSG_MAIL:
+      // Kept until it is queued for its session; otherwise for next time
+      if (session_current(msg->slot, msg->generation) &&
+          client_send(msg->slot, msg->text, msg->len) == 0 &&
+          !t_shard->clients[msg->slot]->out_overflow) {
+        mailbox_drop(msg->target, msg->mail_size);
+      }
+      break;
+    case SHARD_MSG_NOTICE:
+      if (session_current(msg->slot, msg->generation)) {
+        client_send(msg->slot, msg->text, msg->len);
+      }
+      break;
+    }
+    free(msg);
+  }
+}
+
+// Sends a message (logged as record `seq`, or 0) to every active client on
+// every shard except local slot `exclude_idx` (-1 for none)
+void broadcast_message(const char *message, int exclude_idx, uint64_t seq) {
+  deliver_local_broadcast(message, exclude_idx, seq);
+  if (g_num_shards > 1) {
+    shard_post_others(SHARD_MSG_BROADCAST, NULL, -1, message, seq);
+  }
+}
+
+#if URING_AVAILABLE
+void uring_finish_close(int i) {
+  close_socket(t_shard->clients[i]->socket);
+  t_shard->clients[i]->socket = 0;
+  t_shard->clients[i]->closing = 0;
+  memset(t_shard->clients[i]->username, 0, USERNAME_MAX_LEN);
+  client_slot_free(i);
+}
+#endif
+
+// --- HISTORY streams ---
+//
+// HISTORY <before> <count> replays older log lines on demand. The range is
+// found through the log's index, then read in chunks of at most
+// HISTORY_CHUNK_BYTES per loop pass while the client keeps up, so a deep
+// scroll-back costs a bounded amount per pass and can be cancelled midway.
+
+// Parses "YYYY-MM-DD", "YYYY-MM-DDTHH:MM[:SS]" or the log's
+// "YYYY-MM-DD HH:MM:SS" as local time. Returns -1 if malformed.
+int64_t parse_local_time(const char *text) {
+  struct tm at;
+  memset(&at, 0, sizeof(at));
+  char sep = 0;
+  int n = sscanf(text, "%4d-%2d-%2d%c%2d:%2d:%2d", &at.tm_year, &at.tm_mon,
+                 &at.tm_mday, &sep, &at.tm_hour, &at.tm_min, &at.tm_sec);
+  if (n != 3 && (n < 6 || (sep != 'T' && sep != ' '))) {
+    return -1;
+  }
+  at.tm_year -= 1900;
+  at.tm_mon -= 1;
+  at.tm_isdst = -1;
+  time_t t = mktime(&at);
+  return t == (time_t)-1 ? -1 : (int64_t)t;
+}
+
+// Where the part of a logged line that client `i` is shown starts (past
+// the scope), or 0 if the client may not see it: only its own DMs and
+// messages to its own groups are replayed to it.
+size_t history_visible(int i, const char *line, size_t len) {
+  const client_info_t *client = t_shard->clients[i];
+  log_scope_t scope;
+  int group;
+  switch (log_scope_parse(line, len, &scope)) {
+  case '*':
+    return scope.body;
+  case 'D':
+    return log_scope_is(&scope, 0, client->username) ||
+                   log_scope_is(&scope, 1, client->username)
+               ? scope.body
+               : 0;
+  case 'G':
+    group = log_scope_group(&scope);
+    for (int g = 0; client->groups != NULL && g < client->groups->num_groups;
+         g++) {
+      if (client->groups->groups[g] == group) {
+        return scope.body;
+      }
+    }
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+// Number of the first record logged at or after `when`. The index narrows
+// it down to one interval, which is scanned for the first later stamp.
+uint64_t history_seq_at_time(int64_t when) {
+  uint64_t oldest, end;
+  seglog_bounds(&g_log.seg, &oldest, &end);
+  seglog_entry_t entry;
+  seglog_reader_t reader;
+  if (seglog_locate_time(&g_log.seg, when, &entry) < 0 ||
+      seglog_reader_open(&reader, &g_log.seg,
+                         entry.seq > oldest ? entry.seq : oldest) < 0) {
+    return end;
+  }
+  char line[HISTORY_LINE_MAX];
+  uint64_t seq = reader.seq;
+  long len;
+  log_scope_t scope;
+  while ((len = seglog_reader_next(&reader, line, sizeof(line))) >= 0) {
+    log_scope_parse(line, (size_t)len, &scope);
+    if (parse_local_time(line + scope.body + 1) >= when) { // Skip the '['
+      break;
+    }
+    seq = reader.seq;
+  }
+  seglog_reader_close(&reader);
+  return seq;
+}
+
+// Ends a client's HISTORY stream or RESUME replay. `notice`, if set, is
+// sent as "--- <notice> #<first record not sent> ---", with how many
+// records in between were left out as not the client's.
+void history_stop(int i, const char *notice) {
+  client_info_t *client = t_shard->clients[i];
+  if (client->history.file == NULL && !client->resuming) {
+    return;
+  }
+  if (notice != NULL) {
+    char msg[128];
+    if (client->history_skipped > 0) {
+      snprintf(msg, sizeof(msg), "--- %s #%llu (%lu private skipped) ---\n",
+               notice, (unsigned long long)client->history.seq,
+               client->history_skipped);
+    } else {
+      snprintf(msg, sizeof(msg), "--- %s #%llu ---\n", notice,
+               (unsigned long long)client->history.seq);
+    }
+    client_send_str(i, msg);
+  }
+  seglog_reader_close(&client->history);
+  client->resuming = 0;
+  for (int k = 0; k < t_shard->num_history_streams; k++) {
+    if (t_shard->history_streams[k] == i) {
+      t_shard->history_streams[k] =
+          t_shard->history_streams[--t_shard->num_history_streams];
+      break;
+    }
+  }
+}
+
+// True if a stream's client has drained enough of its earlier output
+int history_ready(int i) {
+  client_info_t *client = t_shard->clients[i];
+  return client->out_bytes <= client->out_limit / 2 && !client->closing;
+}
+
+// True if a RESUME replay has read all the writer has flushed, and is
+// waiting for it
+int resume_waiting(int i) {
+  client_info_t *client = t_shard->clients[i];
+  return client->resuming &&
+         client->history.seq >= atomic_load_explicit(&g_log.seg.committed,
+                                                      memory_order_acquire);
+}
+
+// True if a stream can send right now, i.e. the loop must not sleep
+int history_pending(void) {
+  for (int k = 0; k < t_shard->num_history_streams; k++) {
+    int i = t_shard->history_streams[k];
+    if (history_ready(i) && !resume_waiting(i)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// True if a RESUME replay is streaming, so the loop should come back soon
+// to see whether the writer has caught up
+int resume_pending(void) {
+  for (int k = 0; k < t_shard->num_history_streams; k++) {
+    if (t_shard->clients[t_shard->history_streams[k]]->resuming) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Reads client `i`'s stream into `chunk` until it is full, the stream
+// ends or HISTORY_PUMP_RECORDS records were read, leaving out those the
+// client may not see. Returns the bytes read; *n is negative if the
+// reader ran out first.
+size_t history_read(int i, char *chunk, size_t cap, long *n) {
+  static _Thread_local char line[HISTORY_LINE_MAX];
+  client_info_t *client = t_shard->clients[i];
+  size_t len = 0;
+  *n = 0;
+  for (int read = 0; read < HISTORY_PUMP_RECORDS &&
+                     client->history.seq < client->history_end &&
+                     len + SEQ_TAG_MAX + HISTORY_LINE_MAX <= cap;
+       read++) {
+    uint64_t seq = client->history.seq;
+    *n = seglog_reader_next(&client->history, line, sizeof(line));
+    if (*n < 0) {
+      break;
+    }
+    size_t body = history_visible(i, line, (size_t)*n);
+    if (body == 0) {
+      client->history_skipped++;
+      continue;
+    }
+    if (client->want_seq) {
+      len += format_seq_tag(seq, chunk + len, SEQ_TAG_MAX);
+    }
+    memcpy(chunk + len, line + body, (size_t)*n - body);
+    len += (size_t)*n - body;
+  }
+  return len;
+}
+
+// First record a RESUME after `after` replays, when the log ends before
+// `end`: the newest HISTORY_MAX_COUNT at most, and none that retention
+// has deleted
+uint64_t resume_first(uint64_t after, uint64_t oldest, uint64_t end) {
+  uint64_t first = after + 1;
+  if (end - first > HISTORY_MAX_COUNT) {
+    first = end - HISTORY_MAX_COUNT;
+  }
+  return first > oldest ? first : oldest;
+}
+
+// Whether a RESUME replay can be finished from record `from` on without a
+// hole: every record the writer has not flushed yet (from `flushed` on)
+// must still be in the history ring. When the writer falls further behind
+// than the ring is long, the records in between are only in its queues.
+// Call with g_log_mutex held.
+int resume_replayable(uint64_t from, uint64_t flushed) {
+  if (from < flushed) {
+    from = flushed;
+  }
+  int oldest = (g_history.next - g_history.count + MAX_HISTORY_LINES) %
+               MAX_HISTORY_LINES;
+  for (int k = 0; k < g_history.count; k++) {
+    uint64_t seq = g_history.seqs[(oldest + k) % MAX_HISTORY_LINES];
+    if (seq != 0) { // Every record numbered since is in the ring too
+      return seq <= from;
+    }
+  }
+  return from >= g_log.next_seq;
+}
+
+// Ends client `i`'s RESUME replay once it has read all the writer has
+// flushed: the records numbered since come from the history ring, and
+// from then on logged messages reach the client live. Returns 0, or -1 if
+// the writer is too far behind for that yet.
+int resume_finish(int i, uint64_t flushed) {
+  static _Thread_local char
+      tail[MAX_HISTORY_LINES * (SEQ_TAG_MAX + HISTORY_LINE_MAX)];
+  client_info_t *client = t_shard->clients[i];
+  uint64_t from = client->history.seq;
+  size_t len = 0;
+  mutex_lock(&g_log_mutex);
+  if (!resume_replayable(from, flushed)) {
+    mutex_unlock(&g_log_mutex);
+    return -1;
+  }
+  for (int k = 0; k < g_history.count; k++) {
+    int slot = history_slot(&g_history, k);
+    uint64_t seq = g_history.seqs[slot];
+    if (seq == 0 || seq < from) {
+      continue;
+    }
+    size_t body =
+        history_visible(i, g_history.lines[slot], g_history.lens[slot]);
+    if (body == 0) {
+      client->history_skipped++;
+      continue;
+    }
+    len += format_seq_tag(seq, tail + len, SEQ_TAG_MAX);
+    memcpy(tail + len, g_history.lines[slot] + body,
+           g_history.lens[slot] - body);
+    len += g_history.lens[slot] - body;
+  }
+  client->history.seq = g_log.next_seq;
+  client->seq_floor = g_log.next_seq;
+  mutex_unlock(&g_log_mutex);
+  if (len > 0) {
+    client_send(i, tail, len);
+  }
+  history_stop(i, "End of Missed before");
+  mailbox_take(i);
+  return 0;
+}
+
+// Ends a RESUME replay that cannot go on: the client is told where it
+// stopped, and gets logged messages live from there
+void resume_cut_short(int i) {
+  t_shard->clients[i]->seq_floor = t_shard->clients[i]->history.seq;
+  history_stop(i, "Missed cut short at");
+  mailbox_take(i);
+}
+
+// Sends the next part of client `i`'s RESUME replay: what the writer has
+// flushed, straight from the log, then the rest from the history ring.
+// Until then logged messages are held back from the client (see
+// seq_floor), so the replay stays in order ahead of them.
+void resume_pump(int i, char *chunk, size_t cap) {
+  client_info_t *client = t_shard->clients[i];
+  uint64_t oldest, flushed;
+  seglog_bounds(&g_log.seg, &oldest, &flushed);
+  if (client->history.file == NULL && client->history.seq < flushed &&
+      seglog_reader_open(&client->history, &g_log.seg,
+                         client->history.seq) < 0) {
+    resume_cut_short(i);
+    return;
+  }
+  long n = 0;
+  size_t len = client->history.file != NULL
+                   ? history_read(i, chunk, cap, &n)
+                   : 0;
+  if (len > 0) {
+    client_send(i, chunk, len);
+  }
+  if (n < 0 && client->history.seq < flushed) {
+    resume_cut_short(i);
+  } else if (client->history.seq >= flushed && resume_finish(i, flushed) < 0) {
+    log_wake_writer();
+  }
+}
+
+// Sends the next chunk of every stream whose client has drained enough of
+// its earlier output, leaving out records the client may not see. Once per
+// loop pass.
+void history_pump(void) {
+  static _Thread_local char chunk[HISTORY_CHUNK_BYTES];
+  for (int k = t_shard->num_history_streams - 1; k >= 0; k--) {
+    int i = t_shard->history_streams[k];
+    client_info_t *client = t_shard->clients[i];
+    if (!history_ready(i)) {
+      continue;
+    }
+    if (client->resuming) {
+      resume_pump(i, chunk, sizeof(chunk));
+      continue;
+    }
+    long n;
+    size_t len = history_read(i, chunk, sizeof(chunk), &n);
+    if (len > 0) {
+      client_send(i, chunk, len);
+    }
+    if (client->history.seq >= client->history_end) {
+      history_stop(i, "End of History before");
+    } else if (n < 0) {
+      history_stop(i, "History cut short at");
+    }
+  }
+}
+
+void history_usage(int i) {
+  client_send_str(i, "System: Usage: HISTORY <before-seq|before-time> "
+                     "<count>, or HISTORY CANCEL. Time is "
+                     "YYYY-MM-DD[THH:MM[:SS]], seq 0 means now.\n");
+}
+
+// HISTORY <before> <count>: starts streaming the `count` lines logged
+// before record number `before` (0: the newest) or before a local time.
+// A new request replaces one still running; HISTORY CANCEL stops it.
+void handle_history_request(int i, char *line, cmd_token_t args) {
+  (void)line;
+  client_info_t *client = t_shard->clients[i];
+  char arg[32];
+  int count = 0;
+  int n = args.len > 0 ? sscanf(args.ptr, " %31s %d", arg, &count) : 0;
+  if (n == 1 && strcmp(arg, "CANCEL") == 0) {
+    if (client->history.file == NULL) {
+      client_send_str(i, "System: No history request in progress.\n");
+    }
+    history_stop(i, "History cancelled at");
+    return;
+  }
+  if (n != 2 || count <= 0) {
+    history_usage(i);
+    return;
+  }
+  if (count > HISTORY_MAX_COUNT) {
+    count = HISTORY_MAX_COUNT;
+  }
+  if (client->resuming) {
+    client_send_str(i, "System: History is busy; try again shortly.\n");
+    return;
+  }
+  uint64_t oldest, end, before;
+  seglog_bounds(&g_log.seg, &oldest, &end);
+  if (strchr(arg, '-') != NULL) {
+    int64_t when = parse_local_time(arg);
+    if (when < 0) {
+      history_usage(i);
+      return;
+    }
+    before = history_seq_at_time(when);
+  } else {
+    char *rest;
+    unsigned long long seq = strtoull(arg, &rest, 10);
+    if (*rest != '\0') {
+      history_usage(i);
+      return;
+    }
+    before = seq == 0 || seq > end ? end : (uint64_t)seq;
+  }
+  history_stop(i, "History cancelled at");
+  uint64_t first = before > oldest + (uint64_t)count ? before - (uint64_t)count
+                                                     : oldest;
+  char msg[96];
+  if (first >= before ||
+      t_shard->num_history_streams == HISTORY_STREAMS_MAX ||
+      seglog_reader_open(&client->history, &g_log.seg, first) < 0) {
+    if (first < before) {
+      client_send_str(i, "System: History is busy; try again shortly.\n");
+      return;
+    }
+    snprintf(msg, sizeof(msg), "--- No History before #%llu ---\n",
+             (unsigned long long)before);
+    client_send_str(i, msg);
+    return;
+  }
+  client->history_end = before;
+  client->history_skipped = 0;
+  t_shard->history_streams[t_shard->num_history_streams++] = i;
+  snprintf(msg, sizeof(msg), "--- History #%llu-#%llu ---\n",
+           (unsigned long long)first, (unsigned long long)(before - 1));
+  client_send_str(i, msg);
+}
+
+// Stops watching and closes a client socket, freeing its slot.
+// Already queued replies (e.g. a NOT_ALLOWED notice) are still written: in
+// io_uring mode the close waits for them, in reactor mode they get one
+// non-blocking attempt.
+void release_client_slot(int i) {
+  history_stop(i, NULL);
+  free(t_shard->clients[i]->inbound.data);
+  ringbuf_init(&t_shard->clients[i]->inbound, NULL, 0);
+  client_clear_active(i);
+  t_shard->clients[i]->login_pending = 0; // Its queue entry goes stale
+#if URING_AVAILABLE
+  if (t_shard->use_uring) {
+    t_shard->clients[i]->closing = 1;
+    shutdown(t_shard->clients[i]->socket, SHUT_RD); // Ends the multishot recv
+    if (t_shard->clients[i]->sends_in_flight == 0 &&
+        t_shard->clients[i]->out_head == NULL) {
+      uring_finish_close(i);
+    }
+    return;
+  }
+#endif
+  if (!t_shard->clients[i]->out_overflow) {
+    client_flush_output(i);
+  }
+  client_drop_output(i);
+  reactor_remove(&t_shard->reactor, t_shard->clients[i]->socket);
+  close_socket(t_shard->clients[i]->socket);
+  t_shard->clients[i]->socket = 0;
+  memset(t_shard->clients[i]->username, 0, USERNAME_MAX_LEN);
+  client_slot_free(i);
+}
+
+#if URING_AVAILABLE
+// Arms a multishot recv for a client slot; data lands in provided buffers
+int uring_arm_recv(int i) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&t_shard->uring);
+  if (sqe == NULL) {
+    uring_submit(&t_shard->uring, 0);
+    sqe = uring_get_sqe(&t_shard->uring);
+    if (sqe == NULL) {
+      return -1;
+    }
+  }
+  uring_prep_recv_multishot(sqe, t_shard->clients[i]->socket, URING_BUF_GROUP);
+  sqe->user_data = ((unsigned long long)t_shard->clients[i]->generation << 32) |
+                   ((unsigned long long)i << 8) | URING_TAG_RECV;
+  return 0;
+}
+
+int uring_arm_accept(void) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&t_shard->uring);
+  if (sqe == NULL) {
+    uring_submit(&t_shard->uring, 0);
+    sqe = uring_get_sqe(&t_shard->uring);
+    if (sqe == NULL) {
+      return -1;
+    }
+  }
+  uring_prep_accept_multishot(sqe, t_shard->listen_socket);
+  sqe->user_data = URING_TAG_ACCEPT;
+  return 0;
+}
+#endif
+
+// Seconds on the monotonic clock, for the admission buckets
+double admission_now(void) {
+  struct timespec ts;
+  ts_monotonic_now(&ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Bucket of `addr`, claiming one if it has none: a free slot in its probe
+// window, or else the one there that has been idle longest. An evicted
+// address starts over with a full bucket, so a crowded table errs towards
+// letting connections in. Call with g_admission_mutex held.
+ip_bucket_t *ip_bucket_find(uint32_t addr, double now) {
+  uint32_t h = addr * 2654435761u;
+  h ^= h >> 16;
+  ip_bucket_t *victim = NULL;
+  for (int k = 0; k < IP_BUCKET_PROBE; k++) {
+    ip_bucket_t *b = &g_ip_buckets[(h + (uint32_t)k) & (IP_BUCKETS - 1)];
+    if (b->addr == addr) {
+      return b;
+    }
+    if (victim == NULL ||
+        (victim->addr != 0 &&
+         (b->addr == 0 || b->bucket.last < victim->bucket.last))) {
+      victim = b;
+    }
+  }
+  victim->addr = addr;
+  tb_init(&victim->bucket, g_ip_burst, now);
+  return victim;
+}
+
+// Charges a connection from `addr` (network order) to its bucket. Returns
+// 0 if it may proceed, otherwise the seconds until it could.
+double admission_check_ip(uint32_t addr) {
+  if (g_ip_rate <= 0) {
+    return 0;
+  }
+  double wait = 0;
+  mutex_lock(&g_admission_mutex);
+  double now = admission_now();
+  ip_bucket_t *b = ip_bucket_find(addr, now);
+  if (!tb_take(&b->bucket, g_ip_rate, g_ip_burst, now)) {
+    wait = tb_wait(&b->bucket, g_ip_rate, 0);
+  }
+  mutex_unlock(&g_admission_mutex);
+  return wait;
+}
+
+// Takes a token from the server-wide login bucket. Returns 1 if a login
+// may go ahead now.
+int login_take_token(void) {
+  if (g_login_rate <= 0) {
+    return 1;
+  }
+  mutex_lock(&g_admission_mutex);
+  int ok = tb_take(&g_login_bucket, g_login_rate, g_login_burst,
+                   admission_now());
+  mutex_unlock(&g_admission_mutex);
+  return ok;
+}
+
+// Whole seconds (at least 1) after which a login turned away behind
+// `waiting` others should be let in, for the RETRY_AFTER hint
+int login_retry_after(int waiting) {
+  double wait = 0;
+  if (g_login_rate > 0) {
+    mutex_lock(&g_admission_mutex);
+    tb_refill(&g_login_bucket, g_login_rate, g_login_burst, admission_now());
+    wait = tb_wait(&g_login_bucket, g_login_rate, waiting);
+    mutex_unlock(&g_admission_mutex);
+  }
+  return (int)wait + 1;
+}
+
+// Takes ownership of a freshly accepted socket and assigns it a client slot
+void register_client(socket_t new_socket,
+                     const struct sockaddr_in *new_client_addr) {
+  char client_ip_str[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &new_client_addr->sin_addr, client_ip_str,
+            INET_ADDRSTRLEN);
+  printf("New connection attempt from: %s, port: %d (socket %d)\n",
+         client_ip_str, ntohs(new_client_addr->sin_port), (int)new_socket);
+  STAT_ADD(accepted, 1);
+
+  // Turned away before it costs a slot. RETRY_AFTER tells well-behaved
+  // clients how long to back off instead of reconnecting at once.
+  double wait = admission_check_ip(new_client_addr->sin_addr.s_addr);
+  if (wait > 0) {
+    char notice[128];
+    int secs = (int)wait + 1;
+    snprintf(notice, sizeof(notice),
+             "RETRY_AFTER %d\nToo many connections from your address; try "
+             "again in %d s.\n",
+             secs, secs);
+    printf("Throttling %s: over the per-address connection rate.\n",
+           client_ip_str);
+    STAT_ADD(accept_throttled, 1);
+    send(new_socket, notice, strlen(notice), SERVER_SEND_FLAGS);
+    close_socket(new_socket);
+    return;
+  }
+
+  int client_idx = client_slot_alloc();
+  if (client_idx == -1) {
+    printf("Max clients reached. Rejecting new connection from %s.\n",
+           client_ip_str);
+    STAT_ADD(accept_rejected, 1);
+    send(new_socket, "SERVER_FULL\n", strlen("SERVER_FULL\n"),
+         SERVER_SEND_FLAGS);
+    close_socket(new_socket);
+    return;
+  }
+
+  // Output is already coalesced per loop pass (and per login burst), so
+  // Nagle would only hold back the next interactive message
+  if (socket_set_nodelay(new_socket) < 0) {
+    print_socket_error("Failed to set TCP_NODELAY");
+  }
+
+  char *inbound_storage = (char *)malloc(INBOUND_BUFFER_SIZE);
+  if (inbound_storage == NULL) {
+    perror("Failed to allocate client input buffer");
+    close_socket(new_socket);
+    client_slot_free(client_idx);
+    return;
+  }
+
+  client_info_t *client = t_shard->clients[client_idx];
+  client->socket = new_socket;
+  client->address = *new_client_addr;
+  client->active = 0;
+  client->generation++;
+  memset(client->username, 0, USERNAME_MAX_LEN);
+  ringbuf_init(&client->inbound, inbound_storage, INBOUND_BUFFER_SIZE);
+  client->inbound_scanned = 0;
+  client->discarding_line = 0;
+  client->out_offset = 0;
+  client->out_bytes = 0;
+  client->out_limit = g_send_hwm;
+  client->over_limit_since = 0;
+  client->missed = 0;
+  client->out_overflow = 0;
+  client->want_write = 0;
+  client->corked = 0;
+  client->login_pending = 0;
+  client->want_seq = 0;
+  client->binary = 0;
+  client->resume_after = 0;
+  client->seq_floor = 0;
+  client->resuming = 0;
+
+#if URING_AVAILABLE
+  if (t_shard->use_uring) {
+    if (uring_arm_recv(client_idx) < 0) {
+      fprintf(stderr, "Failed to arm io_uring recv for socket %d\n",
+              (int)new_socket);
+      close_socket(new_socket);
+      client->socket = 0;
+      free(inbound_storage);
+      client->inbound.data = NULL;
+      client_slot_free(client_idx);
+      return;
+    }
+  } else
+#endif
+      if (reactor_add(&t_shard->reactor, new_socket,
+                      REACTOR_READ | REACTOR_EDGE, client) < 0) {
+    print_socket_error("Failed to register client socket");
+    close_socket(new_socket);
+    client->socket = 0;
+    free(inbound_storage);
+    client->inbound.data = NULL;
+    client_slot_free(client_idx);
+    return;
+  }
+
+  client_send_str(client_idx, "REQ_USERNAME\n");
+  printf("Sent REQ_USERNAME to socket %d. Slot %d assigned.\n",
+         (int)new_socket, client_idx);
+}
+
+// Takes one connection off the listener's queue, already non-blocking and
+// close-on-exec where accept4() does both in the same call. Returns
+// INVALID_SOCKET if none is waiting or on error.
+socket_t accept_nonblocking(struct sockaddr_in *addr) {
+  socklen_t addr_len = sizeof(*addr);
+#if defined(__linux__)
+  return accept4(t_shard->listen_socket, (struct sockaddr *)addr, &addr_len,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  socket_t new_socket =
+      accept(t_shard->listen_socket, (struct sockaddr *)addr, &addr_len);
+  if (new_socket != INVALID_SOCKET &&
+      socket_set_nonblocking(new_socket) < 0) {
+    print_socket_error("Failed to make client socket non-blocking");
+    close_socket(new_socket);
+    return INVALID_SOCKET;
+  }
+  return new_socket;
+#endif
+}
+
+// Reactor mode: drains the listener's accept queue, so a burst of
+// reconnects is taken in one wakeup rather than one per loop pass. At most
+// ACCEPT_BATCH_MAX at a time, to keep serving connected clients; the
+// level-triggered listener fires again for the rest.
+void accept_new_clients(void) {
+  for (int n = 0; n < ACCEPT_BATCH_MAX; n++) {
+    struct sockaddr_in new_client_addr;
+    socket_t new_socket = accept_nonblocking(&new_client_addr);
+    if (new_socket == INVALID_SOCKET) {
+      if (socket_interrupted()) {
+        continue;
+      }
+      if (!socket_would_block()) {
+        print_socket_error("accept() failed");
+      }
+      return;
+    }
+    register_client(new_socket, &new_client_addr);
+  }
+}
+
+// Appends `len` bytes to a growing replay buffer. Returns -1 if out of
+// memory.
+int replay_append(char **buf, size_t *len, size_t *cap, const char *data,
+                  size_t n) {
+  if (*len + n > *cap) {
+    size_t grown = *cap ? *cap * 2 : HISTORY_CHUNK_BYTES;
+    while (grown < *len + n) {
+      grown *= 2;
+    }
+    char *p = (char *)realloc(*buf, grown);
+    if (p == NULL) {
+      return -1;
+    }
+    *buf = p;
+    *cap = grown;
+  }
+  memcpy(*buf + *len, data, n);
+  *len += n;
+  return 0;
+}
+
+// Sends client `i` the history ring merged with the rings of its groups,
+// by record number, as a single write: header, lines oldest first,
+// footer. Lines the client may not see are left out, and nothing is sent
+// when there is no history.
+void send_history(int i) {
+  static const char header[] = "--- Recent Chat History ---\n";
+  static const char footer[] = "--- End of History ---\n";
+  client_info_t *client = t_shard->clients[i];
+  // Rings of the user's groups and how far each has been merged
+  const history_ring_t *rings[MAX_GROUPS];
+  int merged[MAX_GROUPS];
+  int num_rings = 0;
+  for (int g = 0; client->groups != NULL && g < client->groups->num_groups;
+       g++) {
+    rings[num_rings] = &g_groups[client->groups->groups[g]].history;
+    merged[num_rings++] = 0;
+  }
+
+  char *buf = NULL;
+  size_t len = 0, cap = 0;
+  char tag[SEQ_TAG_MAX];
+  mutex_lock(&g_log_mutex);
+  client->seq_floor = g_log.next_seq; // Anything older is replayed or gone
+  replay_append(&buf, &len, &cap, header, sizeof(header) - 1);
+  for (int k = 0; k <= g_history.count; k++) {
+    int slot = k < g_history.count ? history_slot(&g_history, k) : -1;
+    uint64_t seq = slot != -1 ? g_history.seqs[slot] : UINT64_MAX;
+    // Group lines older than this global one go first, and lines in both
+    // are sent once. Unnumbered global lines stay where they are.
+    while (seq != 0) {
+      int next = -1;
+      uint64_t next_seq = seq;
+      for (int r = 0; r < num_rings; r++) {
+        if (merged[r] < rings[r]->count) {
+          uint64_t s = rings[r]->seqs[history_slot(rings[r], merged[r])];
+          if (s <= next_seq) {
+            next = r;
+            next_seq = s;
+          }
+        }
+      }
+      if (next == -1) {
+        break;
+      }
+      int gslot = history_slot(rings[next], merged[next]++);
+      size_t body = history_visible(i, rings[next]->lines[gslot],
+                                    rings[next]->lens[gslot]);
+      if (next_seq == seq || body == 0) {
+        continue; // Also in the global ring, or not the client's
+      }
+      if (client->want_seq) {
+        replay_append(&buf, &len, &cap, tag,
+                      format_seq_tag(next_seq, tag, sizeof(tag)));
+      }
+      replay_append(&buf, &len, &cap, rings[next]->lines[gslot] + body,
+                    rings[next]->lens[gslot] - body);
+    }
+    if (slot == -1) {
+      break;
+    }
+    size_t body =
+        history_visible(i, g_history.lines[slot], g_history.lens[slot]);
+    if (body == 0) {
+      continue;
+    }
+    if (client->want_seq && seq != 0) {
+      replay_append(&buf, &len, &cap, tag,
+                    format_seq_tag(seq, tag, sizeof(tag)));
+    }
+    replay_append(&buf, &len, &cap, g_history.lines[slot] + body,
+                  g_history.lens[slot] - body);
+  }
+  mutex_unlock(&g_log_mutex);
+  if (buf != NULL && len > sizeof(header) - 1 &&
+      replay_append(&buf, &len, &cap, footer, sizeof(footer) - 1) == 0) {
+    client_send(i, buf, len);
+  }
+  free(buf);
+}
+
+// Whether client `i` can log in now: a RESUME replay needs a free stream.
+// Logins that cannot wait in the login queue.
+int resume_ready(int i) {
+  return t_shard->clients[i]->resume_after == 0 ||
+         t_shard->num_history_streams < HISTORY_STREAMS_MAX;
+}
+
+// Starts the login replay for RESUME <after>: the records logged since,
+// up to the newest HISTORY_MAX_COUNT of them, all tagged, streamed by
+// history_pump() as the client takes them. Records it may not see are
+// left out and counted at the end. Returns 0, or 1 if `after` is a
+// position the log has not reached, to send the usual recent history
+// instead.
+int resume_start(int i, uint64_t after) {
+  client_info_t *client = t_shard->clients[i];
+  uint64_t oldest, flushed;
+  seglog_bounds(&g_log.seg, &oldest, &flushed);
+  mutex_lock(&g_log_mutex);
+  uint64_t end = g_log.next_seq;
+  mutex_unlock(&g_log_mutex);
+  if (after >= end) {
+    return 1;
+  }
+  uint64_t first = resume_first(after, oldest, end);
+  char msg[64];
+  if (first >= end) {
+    client->seq_floor = end;
+    client_send_str(i, "--- Missed nothing ---\n");
+    mailbox_take(i);
+    return 0;
+  }
+  // Opened by resume_pump() once the writer has flushed `first`
+  client->history.log = &g_log.seg;
+  client->history.file = NULL;
+  client->history.seq = first;
+  client->history_end = UINT64_MAX;
+  client->history_skipped = 0;
+  client->resuming = 1;
+  client->seq_floor = UINT64_MAX;
+  t_shard->history_streams[t_shard->num_history_streams++] = i;
+  snprintf(msg, sizeof(msg), "--- Missed since #%llu ---\n",
+           (unsigned long long)first);
+  client_send_str(i, msg);
+  return 0;
+}
+
+// RESUME <seq>, sent before the username: number every logged line from
+// now on and replay only what was logged after <seq> (0: recent history).
+void handle_resume(int i, char *line, cmd_token_t args) {
+  (void)line;
+  char *rest;
+  unsigned long long after = strtoull(args.ptr, &rest, 10);
+  if (args.len == 0 || rest != args.ptr + args.len) {
+    return; // Malformed: carry on without numbers
+  }
+  t_shard->clients[i]->want_seq = 1;
+  t_shard->clients[i]->resume_after = (uint64_t)after;
+}
+
+// Second half of the handshake, once the username is accepted and a login
+// token taken: the client goes active, gets the welcome burst and is
+// announced. Returns 0 if the client stays connected.
+int complete_login(int i) {
+  socket_t sender_socket = t_shard->clients[i]->socket;
+  char system_message[USERNAME_MAX_LEN + 100];
+
+  if (client_set_active(i) < 0) {
+    perror("Failed to index username");
+    release_client_slot(i);
+    return -1;
+  }
+  presence_add(t_shard->clients[i]->username, t_shard->id);
+
+  printf("Username '%s' (allowed) received for socket %d (slot %d).\n",
+         t_shard->clients[i]->username, (int)sender_socket, i);
+
+  // The welcome and history go out together at the end of this loop pass,
+  // as one gathered write. A RESUME replay streams from there. Kept DMs
+  // follow from the mailbox thread, after the replay.
+  t_shard->clients[i]->corked = 1;
+  char welcome_msg[USERNAME_MAX_LEN + 50];
+  sprintf(welcome_msg, "Welcome, %s!\n", t_shard->clients[i]->username);
+  client_send_str(i, welcome_msg);
+
+  if (t_shard->clients[i]->resume_after == 0 ||
+      resume_start(i, t_shard->clients[i]->resume_after) != 0) {
+    send_history(i);
+    mailbox_take(i);
+  }
+  t_shard->clients[i]->corked = 0;
+  snprintf(system_message, sizeof(system_message),
+           "System: %s has joined the chat.\n", t_shard->clients[i]->username);
+  broadcast_message(system_message, i, log_message(system_message));
+  return 0;
+}
+
+// Parks a login in the shard's queue until a token is free. When the queue
+// is full the client is told when to come back, and closed. Returns 0 if
+// the client stays connected.
+int queue_login(int i) {
+  client_info_t *client = t_shard->clients[i];
+  char notice[128];
+  if (t_shard->num_logins == t_shard->login_cap) {
+    // Every shard's queue is about as long as this one
+    int secs = login_retry_after(t_shard->num_logins * g_num_shards);
+    snprintf(notice, sizeof(notice),
+             "RETRY_AFTER %d\nServer busy; try again in %d s.\n", secs,
+             secs);
+    client_send_str(i, notice);
+    printf("Login queue full; told '%s' (slot %d) to retry in %d s.\n",
+           client->username, i, secs);
+    STAT_ADD(login_refused, 1);
+    release_client_slot(i);
+    return -1;
+  }
+  int tail = (t_shard->login_head + t_shard->num_logins) % t_shard->login_cap;
+  t_shard->logins[tail].slot = i;
+  t_shard->logins[tail].generation = client->generation;
+  t_shard->num_logins++;
+  client->login_pending = 1;
+  STAT_ADD(login_queued, 1);
+  snprintf(notice, sizeof(notice),
+           "System: Server busy; your login is queued (position %d).\n",
+           t_shard->num_logins);
+  client_send_str(i, notice);
+  return 0;
+}
+
+// Username reception phase. Returns 0 if the client stays connected.
+int handle_username(int i, char *buffer) {
+  socket_t sender_socket = t_shard->clients[i]->socket;
+
+  buffer[strcspn(buffer, "\r\n")] = 0;
+
+  if (strlen(buffer) == 0) {
+    client_send_str(i, "BAD_USERNAME\nUsername cannot be empty.\n");
+    release_client_slot(i);
+    printf("Client on socket %d (slot %d) sent empty username. "
+           "Connection closed.\n",
+           (int)sender_socket, i);
+    return -1;
+  }
+
+  if (strlen(buffer) >= USERNAME_MAX_LEN) {
+    client_send_str(i, "BAD_USERNAME\nUsername too long.\n");
+    release_client_slot(i);
+    printf("Client on socket %d (slot %d) sent an over-long username. "
+           "Connection closed.\n",
+           (int)sender_socket, i);
+    return -1;
+  }
+
+  if (!is_username_allowed(buffer)) {
+    printf("Username '%s' from socket %d (slot %d) is not allowed. "
+           "Rejecting.\n",
+           buffer, (int)sender_socket, i);
+    client_send_str(i, "NOT_ALLOWED\nUsername not on allowed list.\n");
+    release_client_slot(i);
+    return -1;
+  }
+
+  strncpy(t_shard->clients[i]->username, buffer, USERNAME_MAX_LEN - 1);
+  t_shard->clients[i]->username[USERNAME_MAX_LEN - 1] = '\0';
+  // Queued logins keep their order: nobody overtakes them for a token
+  if (t_shard->num_logins > 0 || !resume_ready(i) || !login_take_token()) {
+    return queue_login(i);
+  }
+  return complete_login(i);
+}
+
+// Lets queued logins in, oldest first, while tokens last (and, for a
+// RESUME, once its replay can be had in full). Called every loop pass.
+void admit_pending_logins(void) {
+  while (t_shard->num_logins > 0) {
+    pending_login_t next = t_shard->logins[t_shard->login_head];
+    client_info_t *client = t_shard->clients[next.slot];
+    int current =
+        client->generation == next.generation && client->login_pending;
+    if (current && (!resume_ready(next.slot) || !login_take_token())) {
+      return;
+    }
+    t_shard->login_head = (t_shard->login_head + 1) % t_shard->login_cap;
+    t_shard->num_logins--;
+    if (current) {
+      client->login_pending = 0;
+      complete_login(next.slot);
+    }
+  }
+}
+
+// Answers input from a client whose login is queued. Returns 1 if it was
+// discarded. Reading carries on meanwhile: the inbound ring is too small
+// to hold a client's input for long.
+int login_still_pending(int i) {
+  if (!t_shard->clients[i]->login_pending) {
+    return 0;
+  }
+  client_send_str(i, "System: Still waiting to log in; message discarded.\n");
+  return 1;
+}
+
+// Length of `text` without its line ending
+int text_body_len(const char *text) {
+  size_t len = strlen(text);
+  while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+    len--;
+  }
+  return (int)len;
+}
+
+// Sends a DM from client `i`. `dm_text_start` ends with a newline.
+void send_private_message(int i, const char *recipient_username,
+                          const char *dm_text_start) {
+  char message_to_send_clients[MESSAGE_MAX + USERNAME_MAX_LEN +
+                               GROUPNAME_MAX_LEN + 30];
+  int recipient_idx = find_local_client(recipient_username);
+  int remote_shard = -1;
+  if (recipient_idx == -1) {
+    remote_shard = presence_find_remote(recipient_username, t_shard->id);
+  }
+
+  if (recipient_idx == -1 && remote_shard == -1 &&
+      !is_username_allowed(recipient_username)) {
+    snprintf(message_to_send_clients, sizeof(message_to_send_clients),
+             "System: User '%s' not found.\n", recipient_username);
+    client_send_str(i, message_to_send_clients);
+    printf("User %s tried to DM non-existent user %s\n",
+           t_shard->clients[i]->username, recipient_username);
+    return;
+  }
+
+  // Offline: kept for their next login
+  int stored = recipient_idx == -1 && remote_shard == -1;
+  snprintf(message_to_send_clients, sizeof(message_to_send_clients),
+           "(DM from %s): %s", t_shard->clients[i]->username, dm_text_start);
+
+  // Logged first, so both sides can be sent its record number
+  char dm_log_buffer[MESSAGE_MAX + USERNAME_MAX_LEN * 2 + 20];
+  int text_len = text_body_len(dm_text_start);
+  snprintf(dm_log_buffer, sizeof(dm_log_buffer), "DM from %s to %s: %.*s\n",
+           t_shard->clients[i]->username, recipient_username, text_len,
+           dm_text_start);
+  uint64_t seq = log_dm_message(t_shard->clients[i]->username,
+                                recipient_username, dm_log_buffer);
+
+  if (recipient_idx != -1) {
+    client_send_logged(recipient_idx, message_to_send_clients, seq);
+  } else if (stored) {
+    mailbox_store(recipient_username, message_to_send_clients, seq, i);
+  } else {
+    shard_post(remote_shard, SHARD_MSG_DIRECT, recipient_username, -1,
+               message_to_send_clients, seq);
+  }
+
+  snprintf(message_to_send_clients, sizeof(message_to_send_clients),
+           "(DM to %s): %s", recipient_username, dm_text_start);
+  client_send_logged(i, message_to_send_clients, seq);
+  if (stored) {
+    snprintf(message_to_send_clients, sizeof(message_to_send_clients),
+             "System: %s is offline; they will get it when they log in.\n",
+             recipient_username);
+    client_send_str(i, message_to_send_clients);
+  }
+
+  printf("DM from %s to %s: %.*s\n", t_shard->clients[i]->username,
+         recipient_username, text_len, dm_text_start);
+}
+
+// PRIVMSG <user> <text>. The name is terminated in place, not copied.
+void handle_private_message(int i, char *line, cmd_token_t args) {
+  cmd_token_t recipient = cmd_next_token(&args);
+
+  if (recipient.ptr[recipient.len] != ' ') {
+    client_send_str(i, "System: Invalid DM command format from client.\n");
+    return;
+  }
+  if (recipient.len >= USERNAME_MAX_LEN || recipient.len == 0) {
+    client_send_str(i, "System: Invalid recipient in DM command.\n");
+    return;
+  }
+  line[recipient.ptr + recipient.len - line] = '\0';
+  send_private_message(i, recipient.ptr, args.ptr);
+}
+
+// Sends a message from client `i` to group `group_idx`. `gm_text_start`
+// ends with a newline.
+void send_group_message(int i, int group_idx, const char *gm_text_start) {
+  char message_to_send_clients[MESSAGE_MAX + USERNAME_MAX_LEN +
+                               GROUPNAME_MAX_LEN + 30];
+
+  // Logged first, so members can be sent its record number
+  char gm_log_buffer[MESSAGE_MAX + USERNAME_MAX_LEN + GROUPNAME_MAX_LEN + 30];
+  int text_len = text_body_len(gm_text_start);
+  snprintf(gm_log_buffer, sizeof(gm_log_buffer),
+           "GROUPMSG to #%s from %s: %.*s\n", g_groups[group_idx].name,
+           t_shard->clients[i]->username, text_len, gm_text_start);
+  uint64_t seq = log_group_message(group_idx, gm_log_buffer);
+
+  snprintf(message_to_send_clients, sizeof(message_to_send_clients),
+           "(#%s from %s): %s", g_groups[group_idx].name,
+           t_shard->clients[i]->username, gm_text_start);
+
+  // Members on other shards are counted by their own shard, not here
+  int members_messaged =
+      deliver_local_group(group_idx, message_to_send_clients, seq);
+  if (g_num_shards > 1) {
+    shard_post_others(SHARD_MSG_GROUP, NULL, group_idx,
+                      message_to_send_clients, seq);
+  }
+
+  char confirmation_msg[GROUPNAME_MAX_LEN + MESSAGE_MAX + 30];
+  snprintf(confirmation_msg, sizeof(confirmation_msg), "(To #%s): %s",
+           g_groups[group_idx].name, gm_text_start);
+  client_send_logged(i, confirmation_msg, seq);
+
+  printf("GROUPMSG to #%s from %s: %.*s (%d members messaged)\n",
+         g_groups[group_idx].name, t_shard->clients[i]->username, text_len,
+         gm_text_start, members_messaged);
+}
+
+// GROUPMSG <group> <text>. The name is terminated in place, not copied.
+void handle_group_message(int i, char *line, cmd_token_t args) {
+  char message_to_send_clients[GROUPNAME_MAX_LEN + 40];
+  cmd_token_t group_name = cmd_next_token(&args);
+
+  if (group_name.ptr[group_name.len] != ' ') {
+    client_send_str(i, "System: Invalid GM command format from client.\n");
+    return;
+  }
+  if (group_name.len >= GROUPNAME_MAX_LEN || group_name.len == 0) {
+    client_send_str(i, "System: Invalid group name in GM command.\n");
+    return;
+  }
+  line[group_name.ptr + group_name.len - line] = '\0';
+
+  int group_idx = find_group(group_name.ptr);
+  if (group_idx == -1) {
+    snprintf(message_to_send_clients, sizeof(message_to_send_clients),
+             "System: Group '#%s' not found.\n", group_name.ptr);
+    client_send_str(i, message_to_send_clients);
+    return;
+  }
+  send_group_message(i, group_idx, args.ptr);
+}
+
+void handle_global_message(int i, const char *buffer) {
+  char message_to_send_clients[MESSAGE_MAX + USERNAME_MAX_LEN +
+                               GROUPNAME_MAX_LEN + 30];
+  printf("Received global from %s (socket %d): %s",
+         t_shard->clients[i]->username, (int)t_shard->clients[i]->socket,
+         buffer);
+
+  snprintf(message_to_send_clients, sizeof(message_to_send_clients), "%s: %s",
+           t_shard->clients[i]->username, buffer);
+
+  uint64_t seq = log_message(message_to_send_clients);
+
+  printf("Broadcasting: %s", message_to_send_clients);
+  broadcast_message(message_to_send_clients, -1, seq);
+}
+
+// BINARY, sent before the username: frames both ways from here on, with
+// record numbers in the frame header. Acknowledged in text.
+void handle_binary(int i, char *line, cmd_token_t args) {
+  (void)line;
+  if (args.len != 0) {
+    return; // Malformed: stay with text
+  }
+  client_send_str(i, "BINARY_OK\n");
+  t_shard->clients[i]->binary = 1;
+  t_shard->clients[i]->want_seq = 1;
+}
+
+// Handles one verb: `line` is the whole received line, still ending with
+// its newline, and `args` a view of what follows the verb and its space.
+typedef void (*verb_handler_t)(int i, char *line, cmd_token_t args);
+
+typedef struct {
+  const char *name;
+  verb_handler_t handler;
+  int before_login; // Only accepted before the username, else only after
+} verb_t;
+
+// Verbs of the text protocol. Anything else is a username before login and
+// a global message after it. Looked up through a perfect hash of the first
+// token, so adding verbs does not slow down the rest.
+const verb_t g_verb_list[] = {
+    {"RESUME", handle_resume, 1},
+    {"BINARY", handle_binary, 1},
+    {"PRIVMSG", handle_private_message, 0},
+    {"GROUPMSG", handle_group_message, 0},
+    {"HISTORY", handle_history_request, 0},
+};
+#define NUM_VERBS (sizeof(g_verb_list) / sizeof(g_verb_list[0]))
+mph_set_t g_verb_set;
+const verb_t *g_verbs[NUM_VERBS]; // By slot in g_verb_set
+
+// Indexes g_verb_list. Returns 0 on success, -1 if out of memory.
+int load_verbs(void) {
+  const char *names[NUM_VERBS];
+  for (size_t k = 0; k < NUM_VERBS; k++) {
+    names[k] = g_verb_list[k].name;
+  }
+  if (mph_build(&g_verb_set, names, NUM_VERBS) < 0) {
+    return -1;
+  }
+  for (size_t k = 0; k < NUM_VERBS; k++) {
+    g_verbs[mph_index(&g_verb_set, names[k])] = &g_verb_list[k];
+  }
+  return 0;
+}
+
+// Verb `line` starts with (NULL if none), with `args` set to the rest
+const verb_t *find_verb(const char *line, cmd_token_t *args) {
+  *args = cmd_line(line);
+  cmd_token_t verb = cmd_next_token(args);
+  long slot = mph_index_n(&g_verb_set, verb.ptr, verb.len);
+  return slot >= 0 ? g_verbs[slot] : NULL;
+}
+
+// Chat message, DM, or GM phase
+void handle_chat_message(int i, char *buffer) {
+  cmd_token_t args;
+  const verb_t *verb = find_verb(buffer, &args);
+  if (verb != NULL && !verb->before_login) {
+    verb->handler(i, buffer, args);
+  } else { // Global chat message
+    handle_global_message(i, buffer);
+  }
+}
+
+void handle_disconnect(int i) {
+  char system_message[USERNAME_MAX_LEN + 100];
+  socket_t sender_socket = t_shard->clients[i]->socket;
+
+  if (!t_shard->clients[i]->active) {
+    printf("Failed to receive username or client disconnected from "
+           "socket %d (slot %d).\n",
+           (int)sender_socket, i);
+    release_client_slot(i);
+    return;
+  }
+
+  char client_ip_str[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &t_shard->clients[i]->address.sin_addr,
+            client_ip_str, INET_ADDRSTRLEN);
+  printf("%s (socket %d, ip %s, slot %d) disconnected.\n",
+         t_shard->clients[i]->username, (int)sender_socket, client_ip_str, i);
+  snprintf(system_message, sizeof(system_message),
+           "System: %s has left the chat.\n", t_shard->clients[i]->username);
+  uint64_t seq = log_message(system_message);
+  presence_remove(t_shard->clients[i]->username, t_shard->id);
+  release_client_slot(i);
+  printf("Broadcasting: %s", system_message);
+  broadcast_message(system_message, -1, seq);
+}
+
+// Dispatches one complete '\n'-terminated line. Returns -1 if the client
+// was closed.
+int handle_client_line(int i, char *line) {
+  if (!t_shard->clients[i]->active) {
+    if (login_still_pending(i)) {
+      return 0;
+    }
+    cmd_token_t args;
+    const verb_t *verb = find_verb(line, &args);
+    if (verb != NULL && verb->before_login) {
+      verb->handler(i, line, args);
+      return 0;
+    }
+    return handle_username(i, line);
+  }
+  handle_chat_message(i, line);
+  return 0;
+}
+
+// Answers a WIRE_OP_LOOKUP_* with the id for `name` (WIRE_NO_ID if none)
+void client_send_id(int i, uint8_t op, long id, const char *name) {
+  send_buf_t *buf = send_buf_new_frame(
+      op, id < 0 ? WIRE_NO_ID : (uint32_t)id, 0, name, strlen(name));
+  if (buf != NULL) {
+    client_queue_send(i, buf, 0);
+    send_buf_release(buf);
+  }
+}
+
+// Dispatches one frame from a binary client; `payload` is NUL-terminated.
+// Users are addressed by their allowlist slot, groups by their index in
+// g_groups. Returns -1 if the client was closed.
+int handle_client_frame(int i, const wire_header_t *h, const char *payload) {
+  // Handlers take text ending with a newline, like a received line
+  char text[MESSAGE_MAX + 2];
+  size_t len = strlen(payload);
+  memcpy(text, payload, len);
+  if (len == 0 || text[len - 1] != '\n') {
+    text[len++] = '\n';
+  }
+  text[len] = '\0';
+
+  if (!t_shard->clients[i]->active) {
+    if (login_still_pending(i)) {
+      return 0;
+    }
+    if (h->op == WIRE_OP_LOGIN) {
+      return handle_username(i, text);
+    }
+    return h->op == WIRE_OP_LINE ? handle_client_line(i, text) : 0;
+  }
+  switch (h->op) {
+  case WIRE_OP_LINE:
+    handle_chat_message(i, text);
+    break;
+  case WIRE_OP_SAY:
+    handle_global_message(i, text);
+    break;
+  case WIRE_OP_DM:
+    if (h->id < g_allowed_users.num_keys) {
+      send_private_message(i, g_allowed_users.slots[h->id], text);
+    } else {
+      client_send_str(i, "System: Unknown user id.\n");
+    }
+    break;
+  case WIRE_OP_GROUPMSG:
+    if (h->id < (uint32_t)g_num_groups) {
+      send_group_message(i, (int)h->id, text);
+    } else {
+      client_send_str(i, "System: Unknown group id.\n");
+    }
+    break;
+  case WIRE_OP_LOOKUP_USER:
+    client_send_id(i, WIRE_OP_USER_ID, mph_index(&g_allowed_users, payload),
+                   payload);
+    break;
+  case WIRE_OP_LOOKUP_GROUP:
+    client_send_id(i, WIRE_OP_GROUP_ID, find_group(payload), payload);
+    break;
+  default:
+    client_send_str(i, "System: Unknown frame type.\n");
+    break;
+  }
+  return 0;
+}
+
+// Decodes and dispatches every complete frame buffered for a binary
+// client: a fixed-size header read, then the payload in place. Returns -1
+// if the client was closed.
+int client_process_frames(int i) {
+  client_info_t *client = t_shard->clients[i];
+  unsigned char frame[WIRE_HEADER_SIZE + WIRE_MAX_PAYLOAD + 1];
+
+  while (1) {
+    size_t used = ringbuf_used(&client->inbound);
+    if (used < WIRE_HEADER_SIZE) {
+      return 0;
+    }
+    wire_header_t h;
+    ringbuf_peek(&client->inbound, (char *)frame, WIRE_HEADER_SIZE);
+    wire_decode_header(frame, &h);
+    if (h.len > WIRE_MAX_PAYLOAD) {
+      printf("Client on socket %d (slot %d) sent a %u-byte frame. "
+             "Connection closed.\n",
+             (int)client->socket, i, (unsigned)h.len);
+      if (client->active) {
+        handle_disconnect(i);
+      } else {
+        release_client_slot(i);
+      }
+      return -1;
+    }
+    if (used < WIRE_HEADER_SIZE + h.len) {
+      return 0;
+    }
+    ringbuf_peek(&client->inbound, (char *)frame, WIRE_HEADER_SIZE + h.len);
+    ringbuf_consume(&client->inbound, WIRE_HEADER_SIZE + h.len);
+    frame[WIRE_HEADER_SIZE + h.len] = '\0';
+    if (handle_client_frame(i, &h, (const char *)frame + WIRE_HEADER_SIZE) !=
+        0) {
+      return -1;
+    }
+  }
+}
+
+// Frames and dispatches every complete line buffered for a client, so any
+// number of pipelined commands per read is handled and a line split over
+// several reads is reassembled. Returns -1 if the client was closed.
+int client_process_input(int i) {
+  client_info_t *client = t_shard->clients[i];
+  char line[BUFFER_SIZE];
+
+  while (1) {
+    if (client->binary) { // Switched by a BINARY line in this batch
+      return client_process_frames(i);
+    }
+    // Longest acceptable line including "\r\n". Only a username is held
+    // to its own limit: a client whose login is queued already sent one,
+    // and its input is discarded like any over-long line.
+    int want_username = !client->active && !client->login_pending;
+    size_t max_line = want_username ? USERNAME_MAX_LEN + 1 : BUFFER_SIZE - 1;
+    long nl = ringbuf_find(&client->inbound, client->inbound_scanned, '\n');
+    size_t used = ringbuf_used(&client->inbound);
+    size_t len = nl < 0 ? used : (size_t)nl + 1; // Including the '\n'
+
+    if (len > max_line || (nl < 0 && used == max_line)) {
+      // Can't fit in a line buffer: drop it, and the rest of it as it arrives
+      ringbuf_consume(&client->inbound, len);
+      client->inbound_scanned = 0;
+      client->discarding_line = nl < 0;
+      if (want_username) {
+        client_send_str(i, "BAD_USERNAME\nUsername too long.\n");
+        printf("Client on socket %d (slot %d) sent an over-long username. "
+               "Connection closed.\n",
+               (int)client->socket, i);
+        release_client_slot(i);
+        return -1;
+      }
+      if (nl >= 0) {
+        client_send_str(i, "System: Message too long; discarded.\n");
+      }
+      continue;
+    }
+    if (nl < 0) {
+      client->inbound_scanned = used;
+      return 0;
+    }
+
+    client->inbound_scanned = 0;
+    if (client->discarding_line) { // Tail of an over-long line
+      ringbuf_consume(&client->inbound, len);
+      client->discarding_line = 0;
+      client_send_str(i, "System: Message too long; discarded.\n");
+      continue;
+    }
+    ringbuf_peek(&client->inbound, line, len);
+    line[len] = '\0';
+    ringbuf_consume(&client->inbound, len);
+    if (handle_client_line(i, line) != 0) {
+      return -1;
+    }
+  }
+}
+
+// Reads everything currently available on a client socket. The sockets are
+// registered edge-triggered, so we must keep reading until recv() would block.
+void handle_client_readable(int i) {
+  client_info_t *client = t_shard->clients[i];
+
+  while (client->socket != 0) {
+    size_t space;
+    char *dst = ringbuf_write_ptr(&client->inbound, &space);
+    int recv_size = recv(client->socket, dst, (int)space, 0);
+
+    if (recv_size > 0) {
+      ringbuf_commit(&client->inbound, (size_t)recv_size);
+      if (client_process_input(i) != 0) {
+        return;
+      }
+    } else if (recv_size < 0 && socket_would_block()) {
+      return; // Drained
+    } else if (recv_size < 0 && socket_interrupted()) {
+      continue;
+    } else { // recv_size == 0 or hard error: Disconnect
+      handle_disconnect(i);
+      return;
+    }
+  }
+}
+
+void disconnect_slow_consumer(int i) {
+  printf("Client on socket %d (slot %d) has %zu bytes of unsent output; "
+         "disconnecting slow consumer.\n",
+         (int)t_shard->clients[i]->socket, i, t_shard->clients[i]->out_bytes);
+  STAT_ADD(slow_disconnects, 1);
+  client_drop_output(i);
+  handle_disconnect(i);
+}
+
+// Prints the server-wide counters when they changed. Shard 0 only.
+void report_stats(void) {
+  static unsigned long last[4];
+  unsigned long now[4] = {0, 0, 0, 0};
+  for (int k = 0; k < g_num_shards; k++) {
+    now[0] += atomic_load_explicit(&g_shards[k].slow_dropped,
+                                   memory_order_relaxed);
+    now[1] += atomic_load_explicit(&g_shards[k].slow_collapsed,
+                                   memory_order_relaxed);
+    now[2] += atomic_load_explicit(&g_shards[k].slow_markers,
+                                   memory_order_relaxed);
+    now[3] += atomic_load_explicit(&g_shards[k].slow_disconnects,
+                                   memory_order_relaxed);
+  }
+  if (memcmp(now, last, sizeof(now)) != 0) {
+    printf("Stats: slow consumers: %lu dropped, %lu collapsed, %lu markers, "
+           "%lu disconnected\n",
+           now[0], now[1], now[2], now[3]);
+    memcpy(last, now, sizeof(now));
+  }
+
+  // Accept rate since the last report
+  static unsigned long last_accepts[3];
+  static time_t last_accept_report;
+  unsigned long accepts[3] = {0, 0, 0};
+  for (int k = 0; k < g_num_shards; k++) {
+    accepts[0] +=
+        atomic_load_explicit(&g_shards[k].accepted, memory_order_relaxed);
+    accepts[1] += atomic_load_explicit(&g_shards[k].accept_rejected,
+                                       memory_order_relaxed);
+    accepts[2] += atomic_load_explicit(&g_shards[k].accept_throttled,
+                                       memory_order_relaxed);
+  }
+  time_t now_sec = time(NULL);
+  if (accepts[0] != last_accepts[0]) {
+    long secs = last_accept_report != 0 ? (long)(now_sec - last_accept_report)
+                                        : STATS_INTERVAL;
+    if (secs <= 0) {
+      secs = 1;
+    }
+    unsigned long n = accepts[0] - last_accepts[0];
+    printf("Stats: accepts: %lu in the last %ld s (%.1f/s); %lu total, %lu "
+           "turned away as full, %lu throttled per address\n",
+           n, secs, (double)n / (double)secs, accepts[0], accepts[1],
+           accepts[2]);
+    memcpy(last_accepts, accepts, sizeof(accepts));
+  }
+  last_accept_report = now_sec;
+
+  // Admission: logins that waited for a token, and those told to retry
+  static unsigned long last_logins[2];
+  unsigned long logins[2] = {0, 0};
+  for (int k = 0; k < g_num_shards; k++) {
+    logins[0] +=
+        atomic_load_explicit(&g_shards[k].login_queued, memory_order_relaxed);
+    logins[1] += atomic_load_explicit(&g_shards[k].login_refused,
+                                      memory_order_relaxed);
+  }
+  if (memcmp(logins, last_logins, sizeof(logins)) != 0) {
+    printf("Stats: logins: %lu queued for a token, %lu told to retry with "
+           "the queue full\n",
+           logins[0], logins[1]);
+    memcpy(last_logins, logins, sizeof(logins));
+  }
+
+  // Log rings: current and peak occupancy, and what --log-full did
+  static unsigned long last_log[5];
+  unsigned long log_now[5] = {0, 0, 0, 0, 0};
+  size_t used = 0;
+  for (int k = 0; k < g_num_shards; k++) {
+    shard_t *shard = &g_shards[k];
+    used += spsc_used(&shard->log_ring);
+    log_now[0] += (unsigned long)atomic_load_explicit(&shard->log_peak,
+                                                      memory_order_relaxed);
+    log_now[2] +=
+        atomic_load_explicit(&shard->log_dropped, memory_order_relaxed);
+    log_now[3] +=
+        atomic_load_explicit(&shard->log_spilled, memory_order_relaxed);
+    log_now[4] +=
+        atomic_load_explicit(&shard->log_blocked, memory_order_relaxed);
+  }
+  log_now[1] = (unsigned long)atomic_load_explicit(&g_log.spill_bytes,
+                                                   memory_order_relaxed);
+  if (used > 0 || memcmp(log_now, last_log, sizeof(log_now)) != 0) {
+    printf("Stats: log rings: %zu of %lu bytes in use (peak %lu), %lu bytes "
+           "spilled; %lu dropped, %lu spilled, %lu blocked\n",
+           used, (unsigned long)LOG_RING_SIZE * (unsigned long)g_num_shards,
+           log_now[0], log_now[1], log_now[2], log_now[3], log_now[4]);
+    memcpy(last_log, log_now, sizeof(log_now));
+  }
+}
+
+// Once-a-second housekeeping: enforces the slow-consumer timeout and has
+// shard 0 report the counters.
+void shard_tick(void) {
+  time_t now = time(NULL);
+  if (now == t_shard->last_tick) {
+    return;
+  }
+  t_shard->last_tick = now;
+  if (g_slow_policy == SLOW_POLICY_DISCONNECT) {
+    for (int i = 0; i < t_shard->clients_cap; i++) {
+      client_info_t *client = t_shard->clients[i];
+      if (client->socket != 0 && client->over_limit_since != 0 &&
+          now - client->over_limit_since >= g_slow_timeout &&
+          !client->out_overflow) {
+        client->out_overflow = 1;
+        client_mark_dirty(i);
+      }
+    }
+  }
+  // Ticks can skip seconds under load, so report on elapsed time rather
+  // than on multiples of STATS_INTERVAL
+  if (t_shard->id == 0) {
+    if (t_shard->last_report == 0) {
+      t_shard->last_report = now;
+    } else if (now - t_shard->last_report >= STATS_INTERVAL) {
+      t_shard->last_report = now;
+      report_stats();
+    }
+  }
+}
+
+// Pushes out everything queued since the last call: straight to the socket
+// in reactor mode, as submission chains in io_uring mode.
+void flush_dirty_clients(void) {
+  // Disconnects below queue "has left" notices, so repeat until quiet
+  while (t_shard->num_out_dirty > 0) {
+    int *dirty = t_shard->out_dirty;
+    int num_dirty = t_shard->num_out_dirty;
+    t_shard->out_dirty = t_shard->out_flushing;
+    t_shard->out_flushing = dirty;
+    t_shard->num_out_dirty = 0;
+
+    for (int d = 0; d < num_dirty; d++) {
+      int i = dirty[d];
+      client_info_t *client = t_shard->clients[i];
+      client->send_queued = 0;
+      if (client->socket == 0) {
+        continue;
+      }
+      if (client->out_overflow) {
+        disconnect_slow_consumer(i);
+        continue;
+      }
+#if URING_AVAILABLE
+      if (t_shard->use_uring) {
+        uring_submit_output(i);
+        continue;
+      }
+#endif
+      if (client_flush_output(i) < 0) {
+        handle_disconnect(i);
+      } else {
+        slow_consumer_check_drained(i);
+      }
+    }
+  }
+}
+
+void run_reactor_loop(void) {
+  reactor_event_t events[MAX_EVENTS];
+  while (1) {
+    // Don't sleep while a HISTORY stream has a chunk to send, nor for
+    // long while logins wait for tokens or replays for the writer
+    int timeout = history_pending() ? 0
+                  : t_shard->num_logins > 0 || resume_pending()
+                      ? ADMIT_INTERVAL_MS
+                      : TICK_INTERVAL_MS;
+    int num_events =
+        reactor_wait(&t_shard->reactor, events, MAX_EVENTS, timeout);
+
+    if (num_events < 0) {
+      if (socket_interrupted()) {
+        continue;
+      }
+      print_socket_error("reactor_wait() error");
+      break;
+    }
+
+    for (int e = 0; e < num_events; e++) {
+      if (events[e].udata == NULL) {
+        accept_new_clients();
+        continue;
+      }
+      if (events[e].udata == &t_shard->mailbox) {
+        shard_drain_mailbox();
+        continue;
+      }
+      client_info_t *client = (client_info_t *)events[e].udata;
+      int i = client->slot;
+      if (client->socket == 0) {
+        continue; // Closed earlier in this batch
+      }
+      if (events[e].events & REACTOR_WRITE) {
+        if (client_flush_output(i) < 0) {
+          handle_disconnect(i);
+          continue;
+        }
+        slow_consumer_check_drained(i);
+      }
+      if (events[e].events & REACTOR_READ) {
+        handle_client_readable(i);
+      }
+    }
+#if !SERVER_HAVE_SHARDS
+    shard_drain_mailbox(); // No wakeup fd: posts wait for the next pass
+#endif
+    shard_tick();
+    admit_pending_logins();
+    history_pump();
+    flush_dirty_clients();
+    log_commit();
+  }
+}
+
+#if URING_AVAILABLE
+void uring_recycle_buffer(unsigned flags) {
+  if (flags & IORING_CQE_F_BUFFER) {
+    uring_buf_ring_add(&t_shard->uring_bufs,
+                       (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT));
+    uring_buf_ring_publish(&t_shard->uring_bufs);
+  }
+}
+
+void uring_on_accept(const struct io_uring_cqe *cqe) {
+  if (cqe->res >= 0) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    getpeername(cqe->res, (struct sockaddr *)&addr, &addr_len);
+    register_client(cqe->res, &addr);
+  } else {
+    fprintf(stderr, "io_uring accept failed: %s\n", strerror(-cqe->res));
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_arm_accept(); // Multishot accept was terminated; re-arm it
+  }
+}
+
+void uring_on_recv(const struct io_uring_cqe *cqe) {
+  int i = (int)((cqe->user_data >> 8) & 0xFFFFFF);
+  unsigned generation = (unsigned)(cqe->user_data >> 32);
+  client_info_t *client = t_shard->clients[i];
+#define URING_RECV_IS_CURRENT()                                                \
+  (client->socket != 0 && !client->closing && client->generation == generation)
+
+  if (!URING_RECV_IS_CURRENT()) {
+    uring_recycle_buffer(cqe->flags); // Stale completion for a closed slot
+    return;
+  }
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned short bid =
+        (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    // Provided buffers are smaller than the ring's guaranteed free space
+    ringbuf_write(&client->inbound,
+                  uring_buf_ring_data(&t_shard->uring_bufs, bid),
+                  (size_t)cqe->res);
+    uring_recycle_buffer(cqe->flags);
+    if (client_process_input(i) != 0 || !URING_RECV_IS_CURRENT()) {
+      return;
+    }
+  } else if (cqe->res == 0 || cqe->res != -ENOBUFS) {
+    uring_recycle_buffer(cqe->flags);
+    handle_disconnect(i);
+    return;
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_arm_recv(i); // Out of buffers or terminated; re-arm
+  }
+#undef URING_RECV_IS_CURRENT
+}
+
+void uring_on_send(const struct io_uring_cqe *cqe) {
+  uring_send_t *send =
+      (uring_send_t *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+  int i = send->first->slot;
+  unsigned generation = send->first->generation;
+  client_info_t *client = t_shard->clients[i];
+  size_t send_len = 0;
+  out_msg_t *s = send->first;
+  for (int k = 0; k < send->count; k++) {
+    out_msg_t *next = s->next;
+    send_len += out_msg_size(s);
+    send_buf_release(s->buf);
+    free(s);
+    s = next;
+  }
+  free(send);
+  int failed = cqe->res < 0 || (size_t)cqe->res < send_len;
+  int current = client->socket != 0 && client->generation == generation;
+  if (!current) {
+    return;
+  }
+
+  client->sends_in_flight--;
+  client->out_bytes -= send_len;
+  if (!failed) {
+    slow_consumer_check_drained(i);
+  }
+  if (failed) {
+    // The rest of the chain completes with -ECANCELED; nothing else queued
+    // for this peer can be delivered either.
+    client_drop_output(i);
+    if (!client->closing) {
+      handle_disconnect(i);
+    }
+  }
+  if (client->sends_in_flight > 0) {
+    return;
+  }
+  if (client->closing && client->out_head == NULL) {
+    uring_finish_close(i);
+  } else if (client->out_head != NULL) {
+    client_mark_dirty(i);
+  }
+}
+
+// Watches the shard's wakeup fd so mailbox posts interrupt io_uring_enter()
+int uring_arm_mailbox(void) {
+#if SERVER_HAVE_SHARDS
+  struct io_uring_sqe *sqe = uring_get_sqe(&t_shard->uring);
+  if (sqe == NULL) {
+    return -EBUSY;
+  }
+  uring_prep_poll_multishot(sqe, t_shard->wake_read_fd, POLLIN);
+  sqe->user_data = URING_TAG_MAILBOX;
+#endif
+  return 0;
+}
+
+// Wakes the loop for shard_tick() even when no I/O completes, and more
+// often while logins are queued or replays wait for the writer (from the
+// tick after the first one)
+int uring_arm_tick(void) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&t_shard->uring);
+  if (sqe == NULL) {
+    return -EBUSY;
+  }
+  int ms = t_shard->num_logins > 0 || resume_pending() ? ADMIT_INTERVAL_MS
+                                                       : TICK_INTERVAL_MS;
+  t_shard->uring_tick_ts.tv_sec = ms / 1000;
+  t_shard->uring_tick_ts.tv_nsec = (ms % 1000) * 1000000L;
+  uring_prep_timeout(sqe, &t_shard->uring_tick_ts);
+  sqe->user_data = URING_TAG_TICK;
+  return 0;
+}
+
+void run_uring_loop(void) {
+  while (1) {
+    shard_tick();
+    admit_pending_logins();
+    history_pump();
+    flush_dirty_clients();
+    log_commit();
+    int ret = uring_submit(&t_shard->uring, history_pending() ? 0 : 1);
+    if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+      fprintf(stderr, "io_uring_enter() error: %s\n", strerror(-ret));
+      break;
+    }
+
+    // Take a bounded batch so queued output is submitted between batches
+    struct io_uring_cqe *cqe;
+    for (int n = 0;
+         n < MAX_EVENTS && (cqe = uring_peek_cqe(&t_shard->uring)) != NULL;
+         n++) {
+      struct io_uring_cqe done = *cqe;
+      uring_cqe_seen(&t_shard->uring);
+      switch (done.user_data & URING_TAG_MASK) {
+      case URING_TAG_ACCEPT:
+        uring_on_accept(&done);
+        break;
+      case URING_TAG_RECV:
+        uring_on_recv(&done);
+        break;
+      case URING_TAG_SEND:
+        uring_on_send(&done);
+        break;
+      case URING_TAG_MAILBOX:
+        shard_drain_mailbox();
+        if (!(done.flags & IORING_CQE_F_MORE) && uring_arm_mailbox() < 0) {
+          fprintf(stderr, "Failed to re-arm the shard mailbox poll.\n");
+        }
+        break;
+      case URING_TAG_TICK:
+        if (uring_arm_tick() < 0) {
+          fprintf(stderr, "Failed to re-arm the io_uring tick.\n");
+        }
+        break;
+      default: // Startup probe
+        uring_recycle_buffer(done.flags);
+        break;
+      }
+    }
+  }
+}
+
+// Multishot recv needs Linux 6.0, which ring setup alone does not reveal, so
+// try one on a socketpair. Returns 0 if supported, otherwise a negative errno.
+int uring_probe_multishot_recv(void) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return -errno;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&t_shard->uring);
+  uring_prep_recv_multishot(sqe, sv[0], URING_BUF_GROUP);
+  sqe->user_data = URING_TAG_PROBE;
+  int result = -EINVAL;
+  if (send(sv[1], "x", 1, MSG_NOSIGNAL) == 1 &&
+      uring_submit(&t_shard->uring, 1) >= 0) {
+    struct io_uring_cqe *cqe = uring_peek_cqe(&t_shard->uring);
+    if (cqe != NULL) {
+      if (cqe->res < 0) {
+        result = cqe->res;
+      } else if (cqe->flags & IORING_CQE_F_MORE) {
+        result = 0;
+      }
+      uring_recycle_buffer(cqe->flags);
+      uring_cqe_seen(&t_shard->uring);
+    }
+  }
+  // Any final completion from the probe is discarded by the main loop
+  close(sv[0]);
+  close(sv[1]);
+  return result;
+}
+
+// Sets up the calling shard's ring, the provided buffers, the multishot
+// accept and the mailbox poll.
+// Returns 0 on success or a negative errno (the caller falls back).
+int uring_server_init(void) {
+  int ret = uring_init(&t_shard->uring, URING_ENTRIES);
+  if (ret < 0) {
+    return ret;
+  }
+  ret = uring_buf_ring_setup(&t_shard->uring, &t_shard->uring_bufs,
+                             URING_BUF_GROUP, URING_NUM_BUFS, BUFFER_SIZE - 1);
+  if (ret == 0) {
+    ret = uring_probe_multishot_recv();
+  }
+  if (ret == 0) {
+    ret = uring_arm_accept();
+  }
+  if (ret == 0) {
+    ret = uring_arm_mailbox();
+  }
+  if (ret == 0) {
+    ret = uring_arm_tick();
+  }
+  if (ret < 0) {
+    uring_buf_ring_free(&t_shard->uring_bufs);
+    uring_close(&t_shard->uring);
+  }
+  return ret;
+}
+#endif
+
+void print_usage(const char *prog) {
+  printf("Usage: %s [--io-uring] [--select] [--threads N] [--pin-cpus]\n"
+         "          [--max-clients N] [--send-hwm BYTES] "
+         "[--slow-policy POLICY]\n          [--slow-timeout SECS] "
+         "[--log-sync none|periodic|batch]\n          "
+         "[--log-sync-interval SECS] [--log-full drop|block|spill]\n"
+         "          [--stamp sec|ms|us] [--stamp-monotonic] [--log-dir DIR]\n"
+         "          [--log-segment-size BYTES] [--log-rotate size|daily]\n"
+         "          [--log-retain-segments N] [--log-retain-days N]\n"
+         "          [--mailbox-dir DIR] [--mailbox-size BYTES]\n"
+         "          [--mailbox-expire-days N] [--backlog N]\n"
+         "          [--login-rate N] [--login-burst N] [--login-queue N]\n"
+         "          [--ip-rate N] [--ip-burst N]\n",
+         prog);
+  printf("  --io-uring  Use io_uring for accept/recv/send (Linux 6.0+); falls "
+         "back to the\n              event loop if the kernel lacks support\n");
+  printf("  --select    Force the portable select() event loop backend\n");
+  printf("  --threads N Run N event-loop shards that share the port via "
+         "SO_REUSEPORT\n              (0 = one per CPU, default 1)\n");
+  printf("  --pin-cpus  Pin each shard thread to its own CPU\n");
+  printf("  --max-clients N\n              Connection limit (default: as "
+         "many as RLIMIT_NOFILE allows)\n");
+  printf("  --backlog N Connections the kernel may queue before they are "
+         "accepted\n              (default %d)\n",
+         LISTEN_BACKLOG_DEFAULT);
+  printf("  --login-rate N\n              Logins per second over all "
+         "shards; others wait in a queue\n              (default %d, 0 = "
+         "no limit)\n",
+         LOGIN_RATE_DEFAULT);
+  printf("  --login-burst N\n              Logins allowed at once before "
+         "--login-rate applies (default %d)\n",
+         LOGIN_BURST_DEFAULT);
+  printf("  --login-queue N\n              Logins that may wait; more are "
+         "told to retry later (default %d)\n",
+         LOGIN_QUEUE_DEFAULT);
+  printf("  --ip-rate N Connections per second from one address (default "
+         "%d, 0 = no limit)\n",
+         IP_RATE_DEFAULT);
+  printf("  --ip-burst N\n              Connections from one address at "
+         "once before --ip-rate applies\n              (default %d)\n",
+         IP_BURST_DEFAULT);
+  printf("  --send-hwm BYTES\n              Unsent output a client may "
+         "accumulate before the slow-consumer\n              policy applies "
+         "(default %d)\n",
+         SEND_HWM_DEFAULT);
+  printf("  --slow-policy disconnect|drop-oldest|collapse\n"
+         "              disconnect: keep queueing, disconnect after "
+         "--slow-timeout (default)\n"
+         "              drop-oldest: drop the oldest global/group messages, "
+         "keep DMs\n"
+         "              collapse: drop global/group messages, then send a "
+         "\"you missed N\n              messages\" notice\n");
+  printf("  --slow-timeout SECS\n              Seconds over the limit before "
+         "a disconnect (default %d, 0 = at once)\n",
+         SLOW_TIMEOUT_DEFAULT);
+  printf("  --log-sync none|periodic|batch\n"
+         "              When chat log writes are forced to disk: never "
+         "(default),\n              every --log-sync-interval seconds, or "
+         "after every batch\n");
+  printf("  --log-sync-interval SECS\n              Period for "
+         "--log-sync periodic (default %d)\n",
+         LOG_SYNC_INTERVAL_DEFAULT);
+  printf("  --log-full drop|block|spill\n"
+         "              When a loop's queue to the log writer is full: drop "
+         "the line,\n              wait for the writer, or keep it in memory "
+         "(default)\n");
+  printf("  --log-dir DIR\n              Directory for chat log segments "
+         "(default %s)\n",
+         CHAT_LOG_DIR);
+  printf("  --log-segment-size BYTES\n              Start a new segment "
+         "before one grows past this (default %d)\n",
+         LOG_SEGMENT_SIZE_DEFAULT);
+  printf("  --log-rotate size|daily\n              Start new segments only "
+         "by size (default), or also daily\n");
+  printf("  --log-retain-segments N\n              Delete the oldest "
+         "segments beyond N (default 0 = keep all)\n");
+  printf("  --log-retain-days N\n              Delete segments older than "
+         "N days (default 0 = keep all)\n");
+  printf("  --stamp sec|ms|us\n              Precision of log and message "
+         "timestamps (default sec)\n");
+  printf("  --stamp-monotonic\n              Add seconds since startup "
+         "from the monotonic clock to stamps\n");
+  printf("  --mailbox-dir DIR\n              Directory for DMs kept for "
+         "offline users (default %s)\n",
+         MAILBOX_DIR);
+  printf("  --mailbox-size BYTES\n              Stored DMs per user before "
+         "new ones are refused (default %d)\n",
+         MAILBOX_SIZE_DEFAULT);
+  printf("  --mailbox-expire-days N\n              Discard stored DMs older "
+         "than N days (default %d, 0 = never)\n",
+         MAILBOX_EXPIRE_DAYS_DEFAULT);
+}
+
+// Creates the shard's listening socket. With several shards every listener
+// binds the same port and the kernel load-balances new connections.
+// Returns 0 on success, -1 on error.
+int shard_open_listener(shard_t *shard) {
+  int verbose = shard->id == 0;
+  struct sockaddr_in server_addr;
+
+  shard->listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (shard->listen_socket == INVALID_SOCKET) {
+    print_socket_error("Failed to create listening socket");
+    return -1;
+  }
+  if (verbose) {
+    printf("Listening socket created.\n");
+  }
+
+#ifndef _WIN32
+  int opt = 1;
+  if (setsockopt(shard->listen_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt,
+                 sizeof(opt)) < 0) {
+    print_socket_error("setsockopt(SO_REUSEADDR) failed");
+    close_socket(shard->listen_socket);
+    return -1;
+  }
+#endif
+#if SERVER_HAVE_SHARDS
+  if (g_num_shards > 1 &&
+      setsockopt(shard->listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt,
+                 sizeof(opt)) < 0) {
+    print_socket_error("setsockopt(SO_REUSEPORT) failed");
+    close_socket(shard->listen_socket);
+    return -1;
+  }
+#endif
+
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(PORT);
+
+  if (bind(shard->listen_socket, (struct sockaddr *)&server_addr,
+           sizeof(server_addr)) < 0) {
+    print_socket_error("Bind failed");
+    close_socket(shard->listen_socket);
+    return -1;
+  }
+  if (verbose) {
+    printf("Bind successful on port %d.\n", PORT);
+  }
+
+  if (listen(shard->listen_socket, g_listen_backlog) < 0) {
+    print_socket_error("Listen failed");
+    close_socket(shard->listen_socket);
+    return -1;
+  }
+  if (verbose) {
+    printf("Server listening for connections on port %d...\n", PORT);
+  }
+  return 0;
+}
+
+// Creates the fd other shards and the mailbox thread write to when they
+// post to this one.
+// Returns 0 on success, -1 on error.
+int shard_open_wakeup(shard_t *shard) {
+#if SERVER_HAVE_SHARDS
+#if defined(__linux__)
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    perror("eventfd() failed");
+    return -1;
+  }
+  shard->wake_read_fd = fd;
+  shard->wake_write_fd = fd;
+#else
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe() failed");
+    return -1;
+  }
+  socket_set_nonblocking(fds[0]);
+  socket_set_nonblocking(fds[1]);
+  shard->wake_read_fd = fds[0];
+  shard->wake_write_fd = fds[1];
+#endif
+#else
+  (void)shard;
+#endif
+  return 0;
+}
+
+// Brings up one shard's listener, mailbox and event loop backend.
+// Runs on the main thread before any shard thread starts.
+// Returns 0 on success, -1 on error.
+int shard_init(shard_t *shard, int want_uring, reactor_backend_t backend) {
+  int verbose = shard->id == 0;
+  mpsc_init(&shard->mailbox);
+  atomic_init(&shard->mailbox_signaled, 0);
+  if (shard->login_cap > 0) {
+    shard->logins = (pending_login_t *)malloc((size_t)shard->login_cap *
+                                              sizeof(pending_login_t));
+    if (shard->logins == NULL) {
+      perror("Failed to allocate the login queue");
+      return -1;
+    }
+  }
+  if (shard_open_listener(shard) < 0) {
+    free(shard->logins);
+    return -1;
+  }
+  if (shard_open_wakeup(shard) < 0) {
+    close_socket(shard->listen_socket);
+    return -1;
+  }
+
+  t_shard = shard; // The init helpers below operate on t_shard
+#if URING_AVAILABLE
+  if (want_uring) {
+    int ret = uring_server_init();
+    if (ret == 0) {
+      shard->use_uring = 1;
+      if (verbose) {
+        printf("Event loop backend: io_uring (multishot accept/recv, %d "
+               "provided buffers per shard)\n",
+               URING_NUM_BUFS);
+      }
+    } else {
+      printf("Shard %d: io_uring unavailable (%s); falling back to the "
+             "event loop.\n",
+             shard->id, strerror(-ret));
+    }
+  }
+#else
+  if (want_uring && verbose) {
+    printf("io_uring is not available on this platform; using the event "
+           "loop.\n");
+  }
+#endif
+
+  if (!shard->use_uring) {
+    // The listener stays level-triggered, so connections left after a
+    // wakeup's batch of accepts wake the loop again. A NULL udata marks it
+    // apart from client slots.
+    if (reactor_init(&shard->reactor, backend) < 0 ||
+        socket_set_nonblocking(shard->listen_socket) < 0 ||
+        reactor_add(&shard->reactor, shard->listen_socket, REACTOR_READ,
+                    NULL) < 0) {
+      print_socket_error("Failed to set up event loop");
+      close_socket(shard->listen_socket);
+      return -1;
+    }
+#if SERVER_HAVE_SHARDS
+    if (reactor_add(&shard->reactor, shard->wake_read_fd, REACTOR_READ,
+                    &shard->mailbox) < 0) {
+      print_socket_error("Failed to watch the shard mailbox");
+      reactor_close(&shard->reactor);
+      close_socket(shard->listen_socket);
+      return -1;
+    }
+#endif
+    if (verbose) {
+      printf("Event loop backend: %s\n", reactor_backend_name(&shard->reactor));
+    }
+  }
+  t_shard = NULL;
+  return 0;
+}
+
+void run_shard_loop(void) {
+#if URING_AVAILABLE
+  if (t_shard->use_uring) {
+    run_uring_loop();
+  } else
+#endif
+    run_reactor_loop();
+}
+
+void *shard_thread(void *arg) {
+  t_shard = (shard_t *)arg;
+  if (t_shard->pin_cpu >= 0 && thread_pin_to_cpu(t_shard->pin_cpu) < 0) {
+    printf("Shard %d: could not pin to CPU %d.\n", t_shard->id,
+           t_shard->pin_cpu);
+  }
+  run_shard_loop();
+  return NULL;
+}
+
+void shard_cleanup(shard_t *shard) {
+  for (int i = 0; i < shard->clients_cap; i++) {
+    if (shard->clients[i]->socket != 0) {
+      close_socket(shard->clients[i]->socket);
+    }
+    free(shard->clients[i]->inbound.data);
+    free(shard->clients[i]);
+  }
+  free(shard->clients);
+  free(shard->active_slots);
+  free(shard->out_dirty);
+  free(shard->out_flushing);
+  free(shard->logins);
+  strmap_free(&shard->by_name);
+  free(shard->log_ring.data);
+  for (int g = 0; g < g_num_groups; g++) {
+    free(shard->group_online[g].slots);
+  }
+#if URING_AVAILABLE
+  if (shard->use_uring) {
+    uring_buf_ring_free(&shard->uring_bufs);
+    uring_close(&shard->uring);
+  } else
+#endif
+    reactor_close(&shard->reactor);
+#if SERVER_HAVE_SHARDS
+  close(shard->wake_read_fd);
+  if (shard->wake_write_fd != shard->wake_read_fd) {
+    close(shard->wake_write_fd);
+  }
+#endif
+  close_socket(shard->listen_socket);
+}
+
+// Works out how many clients the whole server may hold: --max-clients if
+// given, capped by the descriptor limit (whose soft value is first raised
+// to the hard one) and, for select(), by FD_SETSIZE.
+int client_limit(reactor_backend_t backend) {
+  long limit = g_max_clients > 0 ? g_max_clients : INT_MAX;
+#ifndef _WIN32
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    if (rl.rlim_cur != rl.rlim_max) {
+      rlim_t soft = rl.rlim_cur;
+      rl.rlim_cur = rl.rlim_max;
+      if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        rl.rlim_cur = soft;
+      }
+    }
+    if (rl.rlim_cur != RLIM_INFINITY &&
+        (long)rl.rlim_cur - FD_RESERVE * g_num_shards < limit) {
+      limit = (long)rl.rlim_cur - FD_RESERVE * g_num_shards;
+    }
+  }
+#endif
+  if (backend == REACTOR_BACKEND_SELECT || !REACTOR_HAVE_EPOLL) {
+#ifdef _WIN32
+    long select_limit = FD_SETSIZE - 1; // Counted sets; one is the listener
+#else
+    long select_limit = FD_SETSIZE - FD_RESERVE; // Indexed by descriptor
+#endif
+    if (select_limit < limit) {
+      limit = select_limit;
+    }
+  }
+  return limit > 0 ? (int)limit : 1;
+}
+
+int parse_log_sync(const char *name, log_sync_t *sync) {
+  if (strcmp(name, "none") == 0) {
+    *sync = LOG_SYNC_NONE;
+  } else if (strcmp(name, "periodic") == 0) {
+    *sync = LOG_SYNC_PERIODIC;
+  } else if (strcmp(name, "batch") == 0) {
+    *sync = LOG_SYNC_BATCH;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int parse_stamp_precision(const char *name, ts_precision_t *precision) {
+  if (strcmp(name, "sec") == 0) {
+    *precision = TS_PRECISION_SEC;
+  } else if (strcmp(name, "ms") == 0) {
+    *precision = TS_PRECISION_MS;
+  } else if (strcmp(name, "us") == 0) {
+    *precision = TS_PRECISION_US;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int parse_log_full(const char *name, log_full_t *full) {
+  if (strcmp(name, "drop") == 0) {
+    *full = LOG_FULL_DROP;
+  } else if (strcmp(name, "block") == 0) {
+    *full = LOG_FULL_BLOCK;
+  } else if (strcmp(name, "spill") == 0) {
+    *full = LOG_FULL_SPILL;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int parse_slow_policy(const char *name, slow_policy_t *policy) {
+  if (strcmp(name, "disconnect") == 0) {
+    *policy = SLOW_POLICY_DISCONNECT;
+  } else if (strcmp(name, "drop-oldest") == 0) {
+    *policy = SLOW_POLICY_DROP_OLDEST;
+  } else if (strcmp(name, "collapse") == 0) {
+    *policy = SLOW_POLICY_COLLAPSE;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int want_uring = 0;
+  int pin_cpus = 0;
+  int num_threads = 1;
+  reactor_backend_t backend = REACTOR_BACKEND_AUTO;
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "--io-uring") == 0) {
+      want_uring = 1;
+    } else if (strcmp(argv[a], "--select") == 0) {
+      backend = REACTOR_BACKEND_SELECT;
+    } else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+      num_threads = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--pin-cpus") == 0) {
+      pin_cpus = 1;
+    } else if (strcmp(argv[a], "--send-hwm") == 0 && a + 1 < argc &&
+               atol(argv[a + 1]) > 0) {
+      g_send_hwm = (size_t)atol(argv[++a]);
+    } else if (strcmp(argv[a], "--slow-policy") == 0 && a + 1 < argc &&
+               parse_slow_policy(argv[a + 1], &g_slow_policy) == 0) {
+      a++;
+    } else if (strcmp(argv[a], "--max-clients") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) > 0) {
+      g_max_clients = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--backlog") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) > 0) {
+      g_listen_backlog = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--login-rate") == 0 && a + 1 < argc &&
+               atof(argv[a + 1]) >= 0) {
+      g_login_rate = atof(argv[++a]);
+    } else if (strcmp(argv[a], "--login-burst") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) > 0) {
+      g_login_burst = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--login-queue") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) >= 0) {
+      g_login_queue = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--ip-rate") == 0 && a + 1 < argc &&
+               atof(argv[a + 1]) >= 0) {
+      g_ip_rate = atof(argv[++a]);
+    } else if (strcmp(argv[a], "--ip-burst") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) > 0) {
+      g_ip_burst = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--slow-timeout") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) >= 0) {
+      g_slow_timeout = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--log-sync") == 0 && a + 1 < argc &&
+               parse_log_sync(argv[a + 1], &g_log_sync) == 0) {
+      a++;
+    } else if (strcmp(argv[a], "--log-sync-interval") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) > 0) {
+      g_log_sync_interval = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--log-full") == 0 && a + 1 < argc &&
+               parse_log_full(argv[a + 1], &g_log_full) == 0) {
+      a++;
+    } else if (strcmp(argv[a], "--stamp") == 0 && a + 1 < argc &&
+               parse_stamp_precision(argv[a + 1], &g_stamp_precision) == 0) {
+      a++;
+    } else if (strcmp(argv[a], "--stamp-monotonic") == 0) {
+      g_stamp_monotonic = 1;
+    } else if (strcmp(argv[a], "--log-dir") == 0 && a + 1 < argc) {
+      g_log_dir = argv[++a];
+    } else if (strcmp(argv[a], "--log-segment-size") == 0 && a + 1 < argc &&
+               atol(argv[a + 1]) > 0) {
+      g_log_segment_size = atol(argv[++a]);
+    } else if (strcmp(argv[a], "--log-rotate") == 0 && a + 1 < argc &&
+               (strcmp(argv[a + 1], "size") == 0 ||
+                strcmp(argv[a + 1], "daily") == 0)) {
+      g_log_rotate_daily = strcmp(argv[++a], "daily") == 0;
+    } else if (strcmp(argv[a], "--log-retain-segments") == 0 &&
+               a + 1 < argc && atoi(argv[a + 1]) >= 0) {
+      g_log_retain_segments = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--log-retain-days") == 0 && a + 1 < argc &&
+               atoi(argv[a + 1]) >= 0) {
+      g_log_retain_days = atoi(argv[++a]);
+    } else if (strcmp(argv[a], "--mailbox-dir") == 0 && a + 1 < argc) {
+      g_mailbox_dir = argv[++a];
+    } else if (strcmp(argv[a], "--mailbox-size") == 0 && a + 1 < argc &&
+               atol(argv[a + 1]) > 0) {
+      g_mailbox_size = atol(argv[++a]);
+    } else if (strcmp(argv[a], "--mailbox-expire-days") == 0 &&
+               a + 1 < argc && atoi(argv[a + 1]) >= 0) {
+      g_mailbox_expire_days = atoi(argv[++a]);
+    } else {
+      print_usage(argv[0]);
+      return strcmp(argv[a], "--help") == 0 ? 0 : 1;
+    }
+  }
+
+  if (num_threads <= 0) {
+    num_threads = cpu_count();
+  }
+  if (num_threads > MAX_SHARDS) {
+    num_threads = MAX_SHARDS;
+  }
+#if !SERVER_HAVE_SHARDS
+  if (num_threads > 1) {
+    printf("SO_REUSEPORT is not available on this platform; running a "
+           "single event loop.\n");
+    num_threads = 1;
+  }
+#endif
+  g_num_shards = num_threads;
+
+  ts_monotonic_now(&g_mono_start);
+  socket_init();
+  load_allowed_users();
+  load_groups();
+  if (load_verbs() < 0) {
+    perror("Failed to index protocol verbs");
+    socket_cleanup();
+    return 1;
+  }
+  if (log_open() < 0) {
+    socket_cleanup();
+    return 1;
+  }
+  history_load_tail();
+  if (dmstore_open(&g_mailboxes, g_mailbox_dir, g_mailbox_size,
+                   (int64_t)g_mailbox_expire_days * 86400) < 0) {
+    fprintf(stderr, "Mailbox directory name too long: %s\n", g_mailbox_dir);
+    socket_cleanup();
+    return 1;
+  }
+  mutex_init(&g_log_mutex);
+  mutex_init(&g_presence_mutex);
+  mutex_init(&g_admission_mutex);
+  tb_init(&g_login_bucket, g_login_burst, admission_now());
+
+  g_shards = (shard_t *)calloc((size_t)g_num_shards, sizeof(shard_t));
+  if (g_shards == NULL) {
+    perror("Failed to allocate shards");
+    socket_cleanup();
+    return 1;
+  }
+
+  int max_clients = client_limit(backend);
+  int per_shard = (max_clients + g_num_shards - 1) / g_num_shards;
+  int ncpu = cpu_count();
+  for (int s = 0; s < g_num_shards; s++) {
+    g_shards[s].id = s;
+    g_shards[s].pin_cpu = pin_cpus ? s % ncpu : -1;
+    g_shards[s].clients_max = per_shard;
+    g_shards[s].free_head = -1;
+    g_shards[s].login_cap = (g_login_queue + g_num_shards - 1) / g_num_shards;
+    if (shard_init(&g_shards[s], want_uring, backend) < 0) {
+      for (int k = 0; k < s; k++) {
+        shard_cleanup(&g_shards[k]);
+      }
+      free(g_shards);
+      socket_cleanup();
+      return 1;
+    }
+  }
+  printf("Accepting up to %d clients", max_clients);
+  if (g_num_shards > 1) {
+    printf(" over %d shards (%d each)%s", g_num_shards, per_shard,
+           pin_cpus ? ", pinned to CPUs" : "");
+  }
+  printf(".\n");
+  static const char *const policy_names[] = {"disconnect", "drop-oldest",
+                                              "collapse"};
+  printf("Slow-consumer policy: %s above %zu queued bytes per client",
+         policy_names[g_slow_policy], g_send_hwm);
+  if (g_slow_policy == SLOW_POLICY_DISCONNECT) {
+    printf(" (after %d s)", g_slow_timeout);
+  }
+  printf(".\n");
+  printf("Admission: ");
+  if (g_login_rate > 0) {
+    printf("%g logins/s (burst %g), up to %d queued", g_login_rate,
+           g_login_burst, g_login_queue);
+  } else {
+    printf("logins unlimited");
+  }
+  if (g_ip_rate > 0) {
+    printf("; %g connections/s per address (burst %g)", g_ip_rate,
+           g_ip_burst);
+  }
+  printf(".\n");
+  if (log_writer_start() < 0 || mail_thread_start() < 0) {
+    return 1;
+  }
+  static const char *const full_names[] = {"dropped", "waited for",
+                                            "kept in memory"};
+  printf("Chat log: written by a background thread; ");
+  if (g_log_sync == LOG_SYNC_NONE) {
+    printf("no forced syncs");
+  } else if (g_log_sync == LOG_SYNC_PERIODIC) {
+    printf("synced every %d s", g_log_sync_interval);
+  } else {
+    printf("synced after every commit");
+  }
+  printf("; lines %s when a %d KiB queue is full.\n", full_names[g_log_full],
+         LOG_RING_SIZE / 1024);
+  printf("Chat log: %zu segments in %s/, next record #%llu; new segment "
+         "every %ld bytes%s",
+         g_log.seg.count, g_log_dir, (unsigned long long)g_log.next_seq,
+         g_log_segment_size, g_log_rotate_daily ? " or day" : "");
+  if (g_log_retain_segments > 0) {
+    printf("; keeping %d segments", g_log_retain_segments);
+  }
+  if (g_log_retain_days > 0) {
+    printf("; keeping %d days", g_log_retain_days);
+  }
+  printf(".\n");
+  printf("Offline DMs: kept in %s/, up to %ld bytes per user", g_mailbox_dir,
+         g_mailbox_size);
+  if (g_mailbox_expire_days > 0) {
+    printf(", for %d days", g_mailbox_expire_days);
+  }
+  printf(".\n");
+  printf("Waiting for connections...\n");
+
+  // Shard 0 runs on the main thread
+  for (int s = 1; s < g_num_shards; s++) {
+    if (thread_create(&g_shards[s].thread, shard_thread, &g_shards[s]) < 0) {
+      fprintf(stderr, "Failed to start thread for shard %d.\n", s);
+      return 1;
+    }
+  }
+  shard_thread(&g_shards[0]);
+
+  // Cleanup (currently unreachable)
+  printf("Server shutting down.\n");
+  for (int s = 1; s < g_num_shards; s++) {
+    thread_join(g_shards[s].thread);
+  }
+  mail_thread_stop();
+  log_writer_stop(); // Reads the shards' log rings
+  for (int s = 0; s < g_num_shards; s++) {
+    shard_cleanup(&g_shards[s]);
+  }
+  free(g_shards);
+  for (size_t k = 0; k < g_presence.cap; k++) {
+    free(g_presence.slots[k].value);
   }
-  close_socket(listen_socket);
+  strmap_free(&g_presence);
+  mutex_destroy(&g_presence_mutex);
+  mutex_destroy(&g_admission_mutex);
+  mutex_destroy(&g_log_mutex);
   socket_cleanup();
 
   return 0;
@@ -49,6 +49,7 @@ type GroupInfo struct {
 
 var (
 	clients            = make(map[net.Conn]*ClientInfo)
+	clientsByName      = make(map[string]*ClientInfo) // Active clients only; guarded by clientsMutex
 	allowedUsernames   = make(map[string]bool)
 	groups             = make(map[string]*GroupInfo)
 	clientsMutex       sync.RWMutex
@@ -99,11 +100,6 @@ func loadAllowedUsers() {
 		log.Printf("Error reading %s: %v", ALLOWED_USERS_FILE, err)
 	}
 	log.Printf("Loaded %d allowed usernames from %s.", loadedCount, ALLOWED_USERS_FILE)
-	if loadedCount > 0 {
-		for u := range allowedUsernames {
-			log.Printf("  - %s", u)
-		}
-	}
 }
 
 func isUsernameAllowed(username string) bool {
@@ -304,6 +300,9 @@ func handleConnection(conn net.Conn) {
 			isActive := c.active
 
 			delete(clients, conn)
+			if isActive && clientsByName[c.username] == c {
+				delete(clientsByName, c.username)
+			}
 			clientsMutex.Unlock() // Unlock before logging and broadcasting
 
 			if isActive {
@@ -374,18 +373,16 @@ func handleConnection(conn net.Conn) {
 		return
 	}
 
-	// Check if username is already in use by another active client
-	clientsMutex.RLock()
-	alreadyExists := false
-	for _, existingClient := range clients {
-		// Check existingClient.conn != conn to allow a user to reconnect if their old session is still being cleaned up
-		// but primarily, check active status and username.
-		if existingClient.active && existingClient.username == username && existingClient.conn != conn {
-			alreadyExists = true
-			break
-		}
+	// Check if username is already in use by another active client, and claim
+	// it in the same critical section so two logins cannot both succeed.
+	clientsMutex.Lock()
+	_, alreadyExists := clientsByName[username]
+	if !alreadyExists {
+		client.username = username
+		client.active = true
+		clientsByName[username] = client
 	}
-	clientsMutex.RUnlock()
+	clientsMutex.Unlock()
 
 	if alreadyExists {
 		sendToClient(client, "BAD_USERNAME\nUsername already in use.")
@@ -397,13 +394,6 @@ func handleConnection(conn net.Conn) {
 		)
 		return
 	}
-	// Update client info under lock
-	clientsMutex.Lock()
-	client.username = username // Set username in the map's copy too
-	client.active = true
-	clients[conn] = client // Re-assign to update the map's value if ClientInfo is a value type (it is)
-	clientsMutex.Unlock()
-
 	log.Printf(
 		"Username '%s' (allowed) received for %s.",
 		username,
@@ -456,16 +446,8 @@ func handleConnection(conn net.Conn) {
 			recipientUsername := parts[1]
 			dmText := parts[2]
 
-			var recipientClient *ClientInfo
-			foundRecipient := false
 			clientsMutex.RLock()
-			for _, rc := range clients {
-				if rc.active && rc.username == recipientUsername {
-					recipientClient = rc
-					foundRecipient = true
-					break
-				}
-			}
+			recipientClient, foundRecipient := clientsByName[recipientUsername]
 			clientsMutex.RUnlock()
 
 			if foundRecipient && recipientClient != nil {